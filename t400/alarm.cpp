@@ -0,0 +1,351 @@
+#include <Arduino.h>
+#include "t400.h"
+#include "alarm.h"
+#include "sd_log.h"
+#include "serial_out.h"
+#include "functions.h"
+#include "memory.h"
+
+#if ALARM_ENABLED
+
+namespace Alarm {
+
+#define RATE_MAX_MS     60000UL   // Readings further apart than this don't give a rate
+#define CAPTURE_ROWS    ((ALARM_PRE_SECONDS*1000UL + ALARM_ROW_MS - 1)/ALARM_ROW_MS + 1)
+
+static_assert(CAPTURE_ROWS < 256, "Capture ring indexes are 8 bit");
+
+struct Trigger {
+  uint8_t type;         // ALARM_ABOVE, ALARM_BELOW, ALARM_OUTSIDE or ALARM_RATE
+  uint8_t channel;      // Channel the trigger watches
+  int16_t a;            // Limit, or the lower limit for ALARM_OUTSIDE
+  int16_t b;            // Upper limit for ALARM_OUTSIDE
+};
+
+const Trigger triggers[] = { ALARM_TRIGGER_LIST };
+
+static_assert(sizeof(triggers)/sizeof(triggers[0]) == ALARM_COUNT,
+              "ALARM_COUNT doesn't match ALARM_TRIGGER_LIST");
+static_assert(ALARM_COUNT <= 8, "Trigger state is kept in 8 bit masks");
+
+// Trigger state, one bit per trigger
+uint8_t activeMask;           // Condition currently holds
+uint8_t firedMask;            // Went active since task() last ran
+uint8_t reportedMask;         // State last written to the serial port
+uint8_t capturedMask;         // Fired during the current capture
+
+// Previous reading for the rate triggers
+uint8_t haveLast;             // One bit per trigger, set once lastTemperature is valid
+int16_t lastTemperature[ALARM_COUNT];
+uint32_t lastMs[ALARM_COUNT];
+
+volatile uint32_t seconds;    // Seconds since power on, counted by tick()
+volatile uint16_t tickMs;     // millis() at the last tick()
+
+bool rowFlag;                 // A capture row is due, set by check()
+uint32_t rowMs;               // Time of the row due, or of the last one taken
+
+// The readings every ALARM_ROW_MS, a sweep of the channels. The ring always
+// holds the last ALARM_PRE_SECONDS, so they can be written out when a
+// trigger fires.
+struct Row {
+  uint32_t ms;
+  int16_t temperatures[SENSOR_COUNT];
+};
+
+Row rows[CAPTURE_ROWS];
+uint8_t rowHead;              // Next row to be filled
+uint8_t rowCount;             // Valid rows in the ring
+uint8_t unwritten;            // Newest rows not yet in the event file
+
+enum CaptureState {
+  CAPTURE_IDLE,               // Only filling the ring
+  CAPTURE_PENDING,            // Triggered, waiting for the SD card
+  CAPTURE_WRITING,            // Event file open, rows are written as they come
+};
+
+uint8_t state = CAPTURE_IDLE;
+uint32_t triggerMs;           // Time of the first trigger, the event file's time 0
+uint32_t endMs;               // Capture stops after this row
+char fileName[] = "EV0000.CSV";
+
+// Time in ms since power on. millis() stops in power down on battery, so
+// the seconds come from tick() and only the time since the last one from
+// millis().
+static uint32_t clockMs()
+{
+  uint32_t s;
+  uint16_t sinceTick;
+
+  noInterrupts();
+  s = seconds;
+  sinceTick = (uint16_t)millis() - tickMs;
+  interrupts();
+  if(sinceTick > 999) sinceTick = 999;
+  return s*1000 + sinceTick;
+}
+
+// Describe a trigger, eg "T1 > 250.0"
+// @param buf Buffer of at least 32 characters
+static char* describe(char* buf, uint8_t i)
+{
+  const Trigger* t = &triggers[i];
+  char a[8];
+  char b[8];
+
+  switch(t->type) {
+  case ALARM_ABOVE:
+    sprintf(buf, "T%d > %s", t->channel + 1, printTenths(a, t->a));
+    break;
+  case ALARM_BELOW:
+    sprintf(buf, "T%d < %s", t->channel + 1, printTenths(a, t->a));
+    break;
+  case ALARM_OUTSIDE:
+    sprintf(buf, "T%d outside %s..%s", t->channel + 1, printTenths(a, t->a), printTenths(b, t->b));
+    break;
+  default:
+    sprintf(buf, "dT%d/dt > %s/s", t->channel + 1, printTenths(a, t->a));
+    break;
+  }
+  return buf;
+}
+
+// Test a trigger's condition. Once active, the value has to come
+// ALARM_HYSTERESIS back inside the limit before it clears.
+static bool holds(const Trigger* t, int16_t value, bool wasActive)
+{
+  int16_t h = wasActive ? ALARM_HYSTERESIS : 0;
+
+  switch(t->type) {
+  case ALARM_BELOW:   return value < t->a + h;
+  case ALARM_OUTSIDE: return (value < t->a + h) || (value > t->b - h);
+  default:            return value > t->a - h;    // ALARM_ABOVE and ALARM_RATE
+  }
+}
+
+void check(uint8_t sensor, int16_t temperature)
+{
+  uint32_t now = clockMs();
+
+  // Take a capture row once a sweep of the channels has had time to finish
+  if(!rowFlag && now - rowMs >= ALARM_ROW_MS) {
+    rowFlag = true;
+    rowMs = now;
+  }
+
+  for(uint8_t i = 0; i < ALARM_COUNT; i++)
+  {
+    const Trigger* t = &triggers[i];
+    uint8_t bit = _BV(i);
+    int16_t value = temperature;
+
+    if(t->channel != sensor) continue;
+
+    // An unplugged probe leaves the trigger as it was
+    if(temperature == OUT_OF_RANGE_INT) {
+      haveLast &= ~bit;
+      continue;
+    }
+
+    // The rate is taken over the time between this channel's conversions,
+    // on clockMs(), which keeps counting while the board sleeps
+    if(t->type == ALARM_RATE) {
+      uint32_t elapsed = now - lastMs[i];
+      bool valid = (haveLast & bit) && elapsed > 0 && elapsed <= RATE_MAX_MS;
+
+      // 1/10 degree per second, either direction
+      if(valid) {
+        int32_t rate = (labs((int32_t)temperature - lastTemperature[i])*1000L)/(int32_t)elapsed;
+        value = (rate > 0x7FFF) ? 0x7FFF : rate;
+      }
+
+      lastTemperature[i] = temperature;
+      lastMs[i] = now;
+      haveLast |= bit;
+      if(!valid) continue;
+    }
+
+    if(holds(t, value, activeMask & bit)) {
+      if(!(activeMask & bit)) firedMask |= bit;
+      activeMask |= bit;
+    }else{
+      activeMask &= ~bit;
+    }
+  }
+  return;
+}
+
+void tick()
+{
+  seconds++;
+  tickMs = millis();
+  return;
+}
+
+// Add a row to the ring, dropping the oldest once it is full
+static void pushRow(uint32_t ms, const int16_t* temperatures)
+{
+  Row* row = &rows[rowHead];
+
+  row->ms = ms;
+  memcpy(row->temperatures, temperatures, sizeof(row->temperatures));
+  rowHead = (rowHead + 1) % CAPTURE_ROWS;
+  if(rowCount < CAPTURE_ROWS) rowCount++;
+  if(unwritten < rowCount) unwritten++;
+  return;
+}
+
+// Write the rows that aren't in the event file yet, oldest first
+// @return Time of the last row written
+static uint32_t writeRows()
+{
+  char* line = Memory::scratch;     // time + ", -1234.5" per channel
+  char value[8];
+  uint32_t ms = triggerMs;
+
+  while(unwritten > 0)
+  {
+    const Row* row = &rows[(rowHead + CAPTURE_ROWS - unwritten) % CAPTURE_ROWS];
+    int32_t offset;
+    uint8_t index;
+
+    // Seconds from the trigger, to the ms
+    ms = row->ms;
+    offset = ms - triggerMs;
+    index = sprintf(line, "%s%ld.%03u", (offset < 0) ? "-" : "",
+                    labs(offset)/1000, (uint16_t)(labs(offset)%1000));
+    for(uint8_t i = 0; i < SENSOR_COUNT; i++)
+    {
+      if(row->temperatures[i] == OUT_OF_RANGE_INT)
+        index += sprintf(&line[index], ", -");
+      else
+        index += sprintf(&line[index], ", %s", printTenths(value, row->temperatures[i]));
+    }
+    sd::logEvent(line);
+    unwritten--;
+  }
+  return ms;
+}
+
+// Header for the event file: what fired, then the columns
+static void writeHeader()
+{
+  char* line = Memory::scratch;
+
+  for(uint8_t i = 0; i < ALARM_COUNT; i++)
+  {
+    if(!(capturedMask & _BV(i))) continue;
+    sprintf(line, "# trigger %d: ", i + 1);
+    describe(&line[strlen(line)], i);
+    sd::logEvent(line);
+  }
+
+  sd::logEvent((char*)"time (s)", false);
+  for(uint8_t i = 0; i < SENSOR_COUNT; i++)
+  {
+    sprintf(line, ", temp_%d (C)", i);
+    sd::logEvent(line, false);
+  }
+  sd::logEvent((char*)"");
+  return;
+}
+
+// Write trigger changes to the serial stream, as '#' lines
+static void reportChanges()
+{
+  #if SERIAL_OUTPUT_ENABLED
+  // A trigger can fire and clear again between two calls, report both
+  uint8_t raised = (activeMask | firedMask) & ~reportedMask;
+  uint8_t cleared = (reportedMask | firedMask) & ~activeMask;
+  char line[32];
+
+  for(uint8_t i = 0; i < ALARM_COUNT; i++)
+  {
+    if(raised & _BV(i)) {
+      SerialOut::port.print("# alarm ");
+      SerialOut::port.print(i + 1, DEC);
+      SerialOut::port.print(": ");
+      SerialOut::port.println(describe(line, i));
+    }
+    if(cleared & _BV(i)) {
+      SerialOut::port.print("# alarm ");
+      SerialOut::port.print(i + 1, DEC);
+      SerialOut::port.println(" clear");
+    }
+  }
+  #endif
+  reportedMask = activeMask;
+  return;
+}
+
+void task(const int16_t* temperatures, bool sdBusy)
+{
+  uint32_t now = clockMs();
+
+  if(rowFlag) {
+    rowFlag = false;
+    pushRow(rowMs, temperatures);
+  }
+
+  if(reportedMask != activeMask || firedMask) reportChanges();
+
+  if(firedMask) {
+    if(state == CAPTURE_IDLE) {
+      // Everything in the ring goes into the event file
+      state = CAPTURE_PENDING;
+      triggerMs = now;
+      unwritten = rowCount;
+      capturedMask = 0;
+    }
+    capturedMask |= firedMask;
+    firedMask = 0;
+    // Each trigger keeps the capture going for another ALARM_POST_SECONDS
+    endMs = now + ALARM_POST_SECONDS*1000UL;
+  }
+
+  if(state == CAPTURE_PENDING && !sdBusy) {
+    sd::EventState opened = sd::openEvent(fileName);
+
+    if(opened == sd::EVENT_OPEN) {
+      writeHeader();
+      state = CAPTURE_WRITING;
+      #if SERIAL_OUTPUT_ENABLED
+      SerialOut::port.print("# event ");
+      SerialOut::port.println(fileName);
+      #endif
+    }else if(opened == sd::EVENT_FAILED) {
+      state = CAPTURE_IDLE;
+      #if SERIAL_OUTPUT_ENABLED
+      SerialOut::port.println("# event file failed");
+      #endif
+    }
+  }
+
+  if(state == CAPTURE_WRITING && unwritten > 0) {
+    if((int32_t)(writeRows() - endMs) >= 0) {
+      sd::closeEvent();
+      state = CAPTURE_IDLE;
+    }
+  }
+  return;
+}
+
+uint8_t active()
+{
+  return activeMask;
+}
+
+bool capturing()
+{
+  return state != CAPTURE_IDLE;
+}
+
+char* eventFileName()
+{
+  if(state != CAPTURE_WRITING) return NULL;
+  return fileName;
+}
+
+} // namespace Alarm
+
+#endif
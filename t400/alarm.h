@@ -0,0 +1,41 @@
+/*
+ * Alarm triggers with a pre-trigger capture buffer. When a trigger fires,
+ * the seconds before and after it are written to their own EVxxxx.CSV file,
+ * a row per sweep of the channels.
+ */
+
+#ifndef ALARM_H
+#define ALARM_H
+
+#include <Arduino.h>
+#include "t400.h"
+
+namespace Alarm {
+
+  // Check the triggers against a new conversion result. Call this for every
+  // conversion, it only flags the work for task().
+  // @param sensor Channel that was converted
+  // @param temperature Converted temperature, in 1/10 C
+  void check(uint8_t sensor, int16_t temperature);
+
+  // Count a second. Call this from the 1 Hz interrupt.
+  void tick();
+
+  // Record capture rows and write event files. Call this once per loop() pass.
+  // @param temperatures Latest reading of each channel
+  // @param sdBusy True while the SD card is in use by something that can't be
+  //        interrupted; the event file is opened once it is free
+  void task(const int16_t* temperatures, bool sdBusy);
+
+  // @return Bitmask of the triggers whose condition currently holds
+  uint8_t active();
+
+  // @return True while an event is being captured
+  bool capturing();
+
+  // @return Name of the event file being written, or NULL
+  char* eventFileName();
+
+}
+
+#endif
@@ -0,0 +1,62 @@
+#include <Arduino.h>
+#include <SPI.h>
+#include "t400.h"
+#include "bus.h"
+#include "instrument.h"
+
+#if SPI_BUS_ENABLED
+
+namespace Bus {
+
+// Clock and mode of each device, in Device order
+const SPISettings settings[DEVICE_COUNT] = {
+  SPISettings(SD_SPI_CLOCK, MSBFIRST, SPI_MODE0),
+  SPISettings(LCD_SPI_CLOCK, MSBFIRST, SPI_MODE0),
+};
+
+uint8_t depth = 0;        // Nested begin() calls of the device holding the bus
+uint8_t used = 0;         // Bit per device that had the bus this pass
+uint8_t waited = 0;       // Bit per device held back on the last pass
+
+void begin(Device device)
+{
+  if(depth++ > 0) return;
+
+  used |= _BV(device);
+  SPI.beginTransaction(settings[device]);
+  Instrument::busBegin(device);
+  return;
+}
+
+void end()
+{
+  if(depth == 0 || --depth > 0) return;
+
+  Instrument::busEnd();
+  SPI.endTransaction();
+  return;
+}
+
+void pass()
+{
+  used = 0;
+  return;
+}
+
+bool available(Device device)
+{
+  uint8_t higher = _BV(device) - 1;   // Devices ahead of this one
+
+  if((used & higher) == 0 || (waited & _BV(device))) {
+    waited &= ~_BV(device);
+    return true;
+  }
+
+  waited |= _BV(device);
+  Instrument::countBusWait();
+  return false;
+}
+
+}
+
+#endif
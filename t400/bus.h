@@ -0,0 +1,50 @@
+/*
+ * Hardware SPI bus, shared by the SD card and the LCD
+ */
+
+#ifndef BUS_H
+#define BUS_H
+
+#include <Arduino.h>
+#include "t400.h"
+
+namespace Bus {
+
+// Devices on the bus, highest priority first
+enum Device {
+  DEVICE_SD = 0,    // Log rows, these carry the samples
+  DEVICE_LCD,       // Display pages, a frame can always be drawn again
+  DEVICE_COUNT
+};
+
+#if SPI_BUS_ENABLED
+
+// Take the bus for a device, setting its SPI clock and mode. Calls from the
+// device holding the bus nest, so a write that flushes is one transaction.
+// @param device Device about to select itself
+void begin(Device device);
+
+// Give the bus back, after the device has deselected itself
+void end();
+
+// Start a new pass of loop(). Call at the top of loop().
+void pass();
+
+// A device waits while one with a higher priority has used the bus on this
+// pass of loop(), but never for two passes in a row.
+// @param device Device with work for the bus
+// @return True if the device should go ahead on this pass
+bool available(Device device);
+
+#else
+
+inline void begin(Device) {}
+inline void end() {}
+inline void pass() {}
+inline bool available(Device) { return true; }
+
+#endif
+
+}
+
+#endif
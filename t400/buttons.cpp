@@ -1,37 +1,111 @@
 #include "buttons.h"
 #include "t400.h"
-#include <avr/sleep.h>
 
-uint8_t stuckButtonMask;
-uint8_t pendingButtons;
+// Buttons are read straight from the port registers, so all six are sampled
+// in one pass. The edge interrupts only start a debounce tick on timer 3,
+// which runs while any button is held or bouncing and stops itself once
+// everything has been released.
 
-uint8_t buttonDebounce = 0;
+#define BUTTON_TICK_MS          10    // Debounce tick period
+#define BUTTON_DEBOUNCE_TICKS   3     // Ticks a new level must be stable for
+#define BUTTON_LONG_PRESS_TICKS (BUTTON_LONG_PRESS_MS/BUTTON_TICK_MS)
 
-const uint8_t buttonPins[BUTTON_COUNT] = {
-  BUTTON_A_PIN,
-  BUTTON_B_PIN,
-  BUTTON_C_PIN,
-  BUTTON_D_PIN,
-  BUTTON_E_PIN,
-  BUTTON_POWER_PIN,
+#define BUTTON_QUEUE_SIZE       8     // Must be a power of 2
+
+enum ButtonPort {
+  PORT_B,
+  PORT_D,
+  PORT_E,
+  PORT_COUNT,
 };
 
-const uint8_t activeState[BUTTON_COUNT] = {
-  LOW,
-  LOW,
-  LOW,
-  LOW,
-  LOW,
-  HIGH,
+struct ButtonBit {
+  uint8_t port;   // ButtonPort
+  uint8_t mask;   // Bit within the port
 };
 
-void setupButtons() {
+// Where each button is, in Button order
+const ButtonBit buttonBits[BUTTON_COUNT] = {
+  {PORT_E, BUTTON_A_MASK},
+  {PORT_D, BUTTON_B_MASK},
+  {PORT_B, BUTTON_C_MASK},
+  {PORT_B, BUTTON_D_MASK},
+  {PORT_B, BUTTON_E_MASK},
+  {PORT_B, BUTTON_POWER_MASK},
+};
+
+// Buttons that read high when pressed, the rest have pull ups
+const uint8_t activeHighButtons = _BV(BUTTON_POWER);
+
+uint8_t stableButtons = 0;                      // Debounced pressed state, one bit per button
+uint8_t debounceTicks[BUTTON_COUNT];
+uint8_t heldTicks[BUTTON_COUNT];
+
+// Single producer (timer ISR), single consumer (loop) queue. Each side only
+// writes its own index, so no locking is needed.
+ButtonEvent eventQueue[BUTTON_QUEUE_SIZE];
+volatile uint8_t queueHead = 0;                 // Written by the ISR
+volatile uint8_t queueTail = 0;                 // Written by loop()
+volatile uint8_t droppedEvents = 0;
+
+// Read all buttons at once
+// @return Bit mask of the buttons that are pressed
+static inline uint8_t readButtons()
+{
+  uint8_t ports[PORT_COUNT];
+  uint8_t levels = 0;
+
+  ports[PORT_B] = PINB;
+  ports[PORT_D] = PIND;
+  ports[PORT_E] = PINE;
 
   for(uint8_t b = 0; b < BUTTON_COUNT; b++) {
-    if(activeState[b] == LOW) {
-      pinMode(buttonPins[b], INPUT_PULLUP);
+    if(ports[buttonBits[b].port] & buttonBits[b].mask) {
+      levels |= _BV(b);
     }
   }
+
+  // Pull up buttons read low when pressed
+  return levels ^ (~activeHighButtons & (_BV(BUTTON_COUNT)-1));
+}
+
+static void pushEvent(uint8_t button, uint8_t action)
+{
+  uint8_t next = (queueHead + 1) & (BUTTON_QUEUE_SIZE-1);
+  if(next == queueTail) {
+    if(droppedEvents < 255) droppedEvents++;
+    return;
+  }
+  eventQueue[queueHead].button = button;
+  eventQueue[queueHead].action = action;
+  eventQueue[queueHead].time = millis();
+  queueHead = next;
+  return;
+}
+
+static inline void tickStart()
+{
+  // Already running?
+  if(TCCR3B & 0x07) return;
+  TCNT3 = 0;
+  TCCR3B |= (1 << CS31) | (1 << CS30);  // prescaler 64
+  return;
+}
+
+static inline void tickStop()
+{
+  TCCR3B &= 0B11111000;
+  return;
+}
+
+void setupButtons() {
+
+  // SW_A..SW_E have pull ups, the power switch is active high
+  pinMode(BUTTON_A_PIN, INPUT_PULLUP);
+  pinMode(BUTTON_B_PIN, INPUT_PULLUP);
+  pinMode(BUTTON_C_PIN, INPUT_PULLUP);
+  pinMode(BUTTON_D_PIN, INPUT_PULLUP);
+  pinMode(BUTTON_E_PIN, INPUT_PULLUP);
   
   // SW_A 	Logging interval 	INT6 	PE6
   EICRB &= ~0x30;    // Configure INT6 to trigger on low level
@@ -48,50 +122,66 @@ void setupButtons() {
   // SW_PWR      Power on/off            PCINT7  PB7
   PCMSK0 |= 0xF0;
   PCICR |= _BV(PCIE0);
+
+  // Timer 3 debounce tick, CTC mode, not started
+  // 8MHz/64 = 125000Hz, so 125 counts per ms
+  TCCR3A = 0;
+  TCCR3B = (1 << WGM32);
+  OCR3A = (BUTTON_TICK_MS*125) - 1;
+  TIMSK3 |= (1 << OCIE3A);
   return;
 }
 
-// Scan for new button presses
-void buttonTask() {
-  
-  for(uint8_t b = 0; b < BUTTON_COUNT; b++) {
-    if(bitRead(stuckButtonMask, b)) {
-      if (digitalRead(buttonPins[b]) == !activeState[b]) {
-        bitClear(stuckButtonMask, b);
-      }
-    }
-    else {
-      if (digitalRead(buttonPins[b]) == activeState[b]) {
-        bitSet(stuckButtonMask, b);
-        bitSet(pendingButtons, b);
-      }
-    }
-  }
-  return;
+bool buttonPending() {
+  return (queueHead != queueTail);
 }
 
+bool buttonGetEvent(ButtonEvent* event) {
+  uint8_t tail = queueTail;
 
-bool buttonPending() {
-  return (pendingButtons != 0);
+  if(tail == queueHead) return false;
+
+  *event = eventQueue[tail];
+  queueTail = (tail + 1) & (BUTTON_QUEUE_SIZE-1);
+  return true;
 }
 
-// If a button was pressed, return it!
-uint8_t buttonGetPending() {
-  uint8_t button = BUTTON_COUNT;
-  
-  noInterrupts();
+uint8_t buttonDroppedEvents() {
+  return droppedEvents;
+}
+
+// Debounce tick
+ISR(TIMER3_COMPA_vect) {
+  uint8_t pressed = readButtons();
+  uint8_t changed = pressed ^ stableButtons;
 
   for(uint8_t b = 0; b < BUTTON_COUNT; b++) {
-    if (bitRead(pendingButtons, b)) {
-      bitClear(pendingButtons, b);
-      button = b;
-      break;
+    uint8_t mask = _BV(b);
+
+    if(changed & mask) {
+      // Level differs from the debounced state, wait for it to settle
+      if(++debounceTicks[b] >= BUTTON_DEBOUNCE_TICKS) {
+        debounceTicks[b] = 0;
+        heldTicks[b] = 0;
+        stableButtons ^= mask;
+        pushEvent(b, (pressed & mask) ? BUTTON_PRESSED : BUTTON_RELEASED);
+      }
+    }
+    else {
+      debounceTicks[b] = 0;
+      if((stableButtons & mask) && heldTicks[b] < BUTTON_LONG_PRESS_TICKS) {
+        if(++heldTicks[b] == BUTTON_LONG_PRESS_TICKS) {
+          pushEvent(b, BUTTON_LONG_PRESSED);
+        }
+      }
     }
   }
-  
-  interrupts();
-  
-  return button;
+
+  // Nothing held and nothing bouncing, go back to waiting for an edge
+  if(pressed == 0 && stableButtons == 0) {
+    tickStop();
+  }
+  return;
 }
 
 // button interrupts
@@ -99,20 +189,18 @@ ISR(INT6_vect) {
   // Workaround for the issue that ISR6 needs to be level sensitive to wake the processor from power down:
   // If we got here and the INT6 switch was low (button pressed), switch to rising mode so we don't get stuck here
   // If we got here and the INT6 switch was was high (button released), switch to level mode so we can wake the processor
-  // In addition, don't put the processor in POWER_DOWN sleep mode when INT6 is level sensitive or the INT6 switch won't
-  // be able to wake the processor
-  if(digitalRead(BUTTON_A_PIN) == LOW) {
+  // In addition, don't put the processor in POWER_DOWN sleep mode when INT6 is edge sensitive or the INT6 switch won't
+  // be able to wake the processor. Power::sleep() checks EICRB for this.
+  if((PINE & BUTTON_A_MASK) == 0) {
     EICRB |= 0x30;    // Configure INT6 to trigger on rising edge
-    set_sleep_mode(SLEEP_MODE_IDLE);
   }
   else {
     EICRB &= ~0x30;    // Configure INT6 to trigger on low level
-    set_sleep_mode(SLEEP_MODE_PWR_DOWN);
   }
   
-  buttonTask();
+  tickStart();
   return;
 }
 
-ISR(INT3_vect) { buttonTask();}
-ISR(PCINT0_vect) { buttonTask();}
+ISR(INT3_vect) { tickStart();}
+ISR(PCINT0_vect) { tickStart();}
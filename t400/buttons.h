@@ -14,8 +14,28 @@ enum Button {
     BUTTON_COUNT
 };
 
+// What happened to a button
+enum ButtonAction {
+    BUTTON_PRESSED,
+    BUTTON_RELEASED,
+    BUTTON_LONG_PRESSED,    // Still held BUTTON_LONG_PRESS_MS after being pressed
+};
+
+struct ButtonEvent {
+    uint8_t button;         // Button
+    uint8_t action;         // ButtonAction
+    uint16_t time;          // Low 16 bits of millis() when the event was detected
+};
+
 void setupButtons();
 bool buttonPending();
-uint8_t buttonGetPending();
+
+// Take the oldest event off the queue
+// @param event Filled in with the event
+// @return True if there was an event
+bool buttonGetEvent(ButtonEvent* event);
+
+// Events lost because the queue was full
+uint8_t buttonDroppedEvents();
 
 #endif // BUTTONARRAY_HH
@@ -0,0 +1,188 @@
+#include <Arduino.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <avr/eeprom.h>
+#include "t400.h"
+#include "calibration.h"
+#include "config.h"
+#include "serial_out.h"
+
+extern boolean logging;
+
+namespace Calibration {
+
+Coefficients channels[SENSOR_COUNT];
+
+bool set(uint8_t sensor, int32_t gainPpm, int32_t offsetNv)
+{
+  int32_t gain = gainPpm - 1000000;
+  int32_t offset;
+  int32_t rest;
+
+  // gain/1e6 in 1/65536 is gain*4096/62500, which stays inside 32 bits
+  if(sensor >= SENSOR_COUNT || gain < -500000 || gain > 499984) return false;
+  gain = gain*4096;
+  gain = (gain >= 0) ? (gain + 31250)/62500 : -((31250 - gain)/62500);
+
+  // Whole microvolts rounded down, the nanovolts left over go in the fraction
+  offset = offsetNv/1000;
+  rest = offsetNv - offset*1000;
+  if(rest < 0) {
+    offset--;
+    rest += 1000;
+  }
+  if(offset < -32768 || offset > 32767) return false;
+
+  channels[sensor].gain = gain;
+  channels[sensor].offset = offset;
+  channels[sensor].fraction = (rest*65536 + 500)/1000;
+  return true;
+}
+
+void get(uint8_t sensor, int32_t* gainPpm, int32_t* offsetNv)
+{
+  const Coefficients* c = &channels[sensor];
+  int32_t gain = (int32_t)c->gain*15625;   // 1e6/65536 = 15625/1024
+
+  *gainPpm = 1000000 + ((gain >= 0) ? (gain + 512)/1024 : -((512 - gain)/1024));
+  *offsetNv = (int32_t)c->offset*1000 + (((uint32_t)c->fraction*1000 + 32768) >> 16);
+  return;
+}
+
+char* describe(char* buf, uint8_t sensor)
+{
+  int32_t gainPpm;
+  int32_t offsetNv;
+
+  get(sensor, &gainPpm, &offsetNv);
+  sprintf(buf, "# cal %u %ld %ld", sensor, (long)gainPpm, (long)offsetNv);
+  return buf;
+}
+
+// Every channel on the compiled in calibration
+static void defaults()
+{
+  for(uint8_t i = 0; i < SENSOR_COUNT; i++)
+    set(i, MCP3424_CALIBRATION_MUL_INT*100L, MCP3424_CALIBRATION_ADD_INT/10);
+  return;
+}
+
+#if CALIBRATION_COMMAND_ENABLED
+
+struct Record {
+  uint8_t version;
+  uint8_t count;                // Channels in the record
+  Coefficients channels[SENSOR_COUNT];
+  uint16_t crc;
+};
+
+void load()
+{
+  Record record;
+
+  defaults();
+  eeprom_read_block(&record, (const void*)CALIBRATION_EEPROM_ADDRESS, sizeof(record));
+  if(record.version != CALIBRATION_VERSION || record.count != SENSOR_COUNT) return;
+  if(record.crc != Config::recordCrc(&record, offsetof(Record, crc))) return;
+  memcpy(channels, record.channels, sizeof(channels));
+  return;
+}
+
+static void save()
+{
+  Record record;
+
+  record.version = CALIBRATION_VERSION;
+  record.count = SENSOR_COUNT;
+  memcpy(record.channels, channels, sizeof(channels));
+  record.crc = Config::recordCrc(&record, offsetof(Record, crc));
+  eeprom_update_block(&record, (void*)CALIBRATION_EEPROM_ADDRESS, sizeof(record));
+  return;
+}
+
+#define LINE_MAX        32
+#define LINE_DISCARD    0xFF    // lineLength while skipping the rest of a line that was too long
+
+char line[LINE_MAX];
+uint8_t lineLength = 0;
+
+#define WORDS_MAX       5       // One more than any command has, to catch extra words
+
+// @return True if word is a whole decimal number
+static bool parseNumber(const char* word, long* value)
+{
+  char* end;
+
+  *value = strtol(word, &end, 10);
+  return end != word && *end == 0;
+}
+
+// Run one command line
+static void command(char* text)
+{
+  char buf[32];
+  char* words[WORDS_MAX];
+  uint8_t count = 0;
+  long sensor;
+  long gainPpm;
+  long offsetNv;
+
+  for(char* word = strtok(text, " "); word != NULL && count < WORDS_MAX; word = strtok(NULL, " "))
+    words[count++] = word;
+  if(count == 0 || strcmp(words[0], "cal") != 0) return;
+
+  if(count > 1) {
+    // A log should be calibrated the same way from start to end
+    if(logging) {
+      SerialOut::port.println("# cal refused while logging");
+      return;
+    }
+
+    if(count == 2 && strcmp(words[1], "reset") == 0) {
+      defaults();
+    }else if(!(count == 4 && parseNumber(words[1], &sensor) && parseNumber(words[2], &gainPpm)
+               && parseNumber(words[3], &offsetNv) && sensor >= 0 && sensor < SENSOR_COUNT
+               && set(sensor, gainPpm, offsetNv))) {
+      SerialOut::port.println("# cal error, use: cal N GAIN_PPM OFFSET_NV");
+      return;
+    }
+    save();
+  }
+
+  // Echo the whole table, so the host can check what took
+  for(uint8_t i = 0; i < SENSOR_COUNT; i++)
+    SerialOut::port.println(describe(buf, i));
+  return;
+}
+
+void task()
+{
+  while(Serial.available() > 0) {
+    char c = Serial.read();
+
+    if(c == '\r' || c == '\n') {
+      if(lineLength != LINE_DISCARD) {
+        line[lineLength] = 0;
+        command(line);
+      }
+      lineLength = 0;
+    }else if(lineLength < LINE_MAX - 1) {
+      line[lineLength++] = c;
+    }else{
+      lineLength = LINE_DISCARD;
+    }
+  }
+  return;
+}
+
+#else
+
+void load()
+{
+  defaults();
+  return;
+}
+
+#endif
+
+} // namespace Calibration
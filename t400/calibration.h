@@ -0,0 +1,72 @@
+/*
+ * Per channel calibration of the thermocouple inputs, kept in EEPROM and
+ * set over the serial port with the 'cal' command
+ */
+
+#ifndef CALIBRATION_H
+#define CALIBRATION_H
+
+#include <Arduino.h>
+#include "t400.h"
+
+// Readings are clamped to this before calibration, so the multiply can't
+// overflow. It is past the end of the thermocouple tables either way.
+#define CALIBRATION_INPUT_LIMIT     65000
+
+namespace Calibration {
+
+  // y = x*gain + offset, in microvolts, folded so applying it is one 32x16
+  // multiply and a shift: y = x + offset + ((x*gain + fraction) >> 16)
+  struct Coefficients {
+    int16_t gain;         // Gain - 1, in 1/65536
+    int16_t offset;       // Offset in microvolts, rounded down
+    uint16_t fraction;    // Rest of the offset, in 1/65536 microvolt
+  };
+
+  extern Coefficients channels[SENSOR_COUNT];
+
+  // Calibrate a reading
+  // @param sensor Channel the reading is from
+  // @param microvolts Reading from the ADC
+  inline int32_t apply(uint8_t sensor, int32_t microvolts) {
+    const Coefficients* c = &channels[sensor];
+
+    if(microvolts > CALIBRATION_INPUT_LIMIT) microvolts = CALIBRATION_INPUT_LIMIT;
+    else if(microvolts < -CALIBRATION_INPUT_LIMIT) microvolts = -CALIBRATION_INPUT_LIMIT;
+    return microvolts + c->offset + ((microvolts*c->gain + c->fraction) >> 16);
+  }
+
+  // Set a channel's calibration
+  // @param gainPpm Gain in parts per million, 500000 to 1499984
+  // @param offsetNv Offset in nanovolts, -32768000 to 32767999
+  // @return False if either is out of range, the channel is left alone
+  bool set(uint8_t sensor, int32_t gainPpm, int32_t offsetNv);
+
+  // Read a channel's calibration back, in the units of set()
+  void get(uint8_t sensor, int32_t* gainPpm, int32_t* offsetNv);
+
+  // Describe a channel's calibration, as "# cal N GAIN_PPM OFFSET_NV"
+  // @return buf
+  char* describe(char* buf, uint8_t sensor);
+
+  // Load the calibration saved in EEPROM. Channels start from the
+  // MCP3424_CALIBRATION_* defaults if there isn't a good record.
+  void load();
+
+#if CALIBRATION_COMMAND_ENABLED
+
+  // Read commands from the serial port. Call this once per loop() pass.
+  //   cal                      List every channel
+  //   cal N GAIN_PPM OFFSET_NV Set channel N (from 0) and save it
+  //   cal reset                Go back to the defaults for every channel
+  void task();
+
+#else
+
+  inline void task() {}
+
+#endif
+
+}
+
+#endif
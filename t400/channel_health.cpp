@@ -0,0 +1,66 @@
+#include <Arduino.h>
+#include "t400.h"
+#include "channel_health.h"
+#include "instrument.h"
+
+namespace ChannelHealth {
+
+struct Health {
+  uint8_t state;        // State that has been confirmed
+  uint8_t candidate;    // State seen on the latest readings
+  uint8_t streak;       // Readings in a row that gave candidate
+  uint8_t skips;        // Slots skipped since the last re-probe
+};
+
+Health health[SENSOR_COUNT];
+
+static inline bool dead(uint8_t state)
+{
+  return (state == OPEN) || (state == OUT_OF_RANGE);
+}
+
+void update(uint8_t sensor, int32_t microVolts, int16_t temperature)
+{
+  Health* h = &health[sensor];
+  uint8_t seen = LIVE;
+
+  if(microVolts >= CHANNEL_OPEN_UV || microVolts <= -CHANNEL_OPEN_UV) seen = OPEN;
+  else if(temperature == OUT_OF_RANGE_INT) seen = OUT_OF_RANGE;
+  else if(microVolts <= CHANNEL_SHORT_UV && microVolts >= -CHANNEL_SHORT_UV) seen = SHORTED;
+
+  if(seen != h->candidate) {
+    h->candidate = seen;
+    h->streak = 0;
+  }
+  if(h->streak < 255) h->streak++;
+
+  // A good reading brings a channel straight back, going bad takes a streak
+  if(seen != h->state && (seen == LIVE || h->streak >= CHANNEL_DEAD_STREAK)) {
+    h->state = seen;
+    h->skips = 0;
+    Instrument::setChannelDead(sensor, dead(seen));
+  }
+  return;
+}
+
+bool wanted(uint8_t sensor)
+{
+  Health* h = &health[sensor];
+
+  if(!dead(h->state)) return true;
+
+  if(++h->skips >= CHANNEL_REPROBE_SKIPS) {
+    h->skips = 0;
+    Instrument::countChannelReprobe();
+    return true;
+  }
+  Instrument::countChannelSkip();
+  return false;
+}
+
+uint8_t get(uint8_t sensor)
+{
+  return health[sensor].state;
+}
+
+}
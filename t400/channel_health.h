@@ -0,0 +1,37 @@
+/*
+ * Thermocouple channel health, used to skip unplugged probes
+ */
+
+#ifndef CHANNEL_HEALTH_H
+#define CHANNEL_HEALTH_H
+
+#include <Arduino.h>
+#include "t400.h"
+
+namespace ChannelHealth {
+
+  enum State {
+    LIVE = 0,           // Giving readings
+    OPEN = 1,           // Input floating, reading near ADC full scale
+    OUT_OF_RANGE = 2,   // Reading outside the thermocouple table
+    SHORTED = 3,        // Reading ~0uV. Could be a probe at ambient, so it is still converted
+  };
+
+  // Fold a conversion result into the channel's health
+  // @param sensor Channel that was converted
+  // @param microVolts Raw reading from the ADC
+  // @param temperature Converted temperature, OUT_OF_RANGE_INT if it was off the table
+  void update(uint8_t sensor, int32_t microVolts, int16_t temperature);
+
+  // Decide whether a channel should get the next conversion. Dead channels
+  // are only given a slot every CHANNEL_REPROBE_SKIPS times they come up.
+  // @param sensor Channel the round-robin has reached
+  // @return True to convert it, false to move on
+  bool wanted(uint8_t sensor);
+
+  // @return Current State of the channel
+  uint8_t get(uint8_t sensor);
+
+}
+
+#endif
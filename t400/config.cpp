@@ -0,0 +1,46 @@
+#include <Arduino.h>
+#include <stddef.h>
+#include <avr/eeprom.h>
+#include "t400.h"
+#include "config.h"
+
+#if CONFIG_ENABLED
+
+namespace Config {
+
+// Bump CONFIG_VERSION when the meaning of a field changes. The size is
+// checked too, so adding a field can't read another record's CRC as data.
+struct Record {
+  uint8_t version;
+  uint8_t size;
+  Settings settings;
+  uint16_t crc;
+};
+
+bool load(Settings* settings)
+{
+  Record record;
+
+  eeprom_read_block(&record, (const void*)CONFIG_EEPROM_ADDRESS, sizeof(record));
+  if(record.version != CONFIG_VERSION || record.size != sizeof(Settings)) return false;
+  if(record.crc != recordCrc(&record, offsetof(Record, crc))) return false;
+
+  *settings = record.settings;
+  return true;
+}
+
+void save(const Settings* settings)
+{
+  Record record;
+
+  record.version = CONFIG_VERSION;
+  record.size = sizeof(Settings);
+  record.settings = *settings;
+  record.crc = recordCrc(&record, offsetof(Record, crc));
+  eeprom_update_block(&record, (void*)CONFIG_EEPROM_ADDRESS, sizeof(record));
+  return;
+}
+
+} // namespace Config
+
+#endif
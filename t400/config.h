@@ -0,0 +1,43 @@
+/*
+ * User settings kept in EEPROM, so the logger comes back up the way it was
+ * left after a power cut
+ */
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <Arduino.h>
+#include <util/crc16.h>
+#include "t400.h"
+
+namespace Config {
+
+  // CRC-16 of an EEPROM record, to tell a good record from garbage
+  // @param length Bytes to cover, not including the CRC itself
+  inline uint16_t recordCrc(const void* record, uint8_t length) {
+    const uint8_t* p = (const uint8_t*)record;
+    uint16_t crc = 0xFFFF;
+    for(uint8_t i = 0; i < length; i++) crc = _crc16_update(crc, p[i]);
+    return crc;
+  }
+
+  struct Settings {
+    uint8_t logInterval;      // Index into the log interval table
+    uint8_t temperatureUnit;
+    uint8_t graphChannel;
+    uint8_t autoStart;        // Start logging at power up
+  };
+
+  // Read the settings. The record is ignored if its version or size don't
+  // match this firmware, or its CRC is wrong.
+  // @param settings Filled in if the record is good, left alone otherwise
+  // @return True if the record was good
+  bool load(Settings* settings);
+
+  // Write the settings. Only bytes that changed are written, so saving
+  // settings that haven't changed costs no EEPROM wear.
+  void save(const Settings* settings);
+
+}
+
+#endif
@@ -0,0 +1,82 @@
+/*
+ * Temperature conversion chain, specialized at compile time
+ *
+ * ADC microvolts -> calibration -> cold junction compensation -> linearization
+ * gives 1/10 C, which is what gets stored. Unit scaling is applied when the
+ * value is shown. The fixed steps are template parameters, so loops over many
+ * points can pick the unit once and run a specialized body instead of
+ * switching on the unit for every point. Calibration is per channel, see
+ * calibration.h.
+ */
+
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include "t400.h"
+#include "functions.h"
+#include "calibration.h"
+
+// Thermocouple linearization
+template<uint8_t TYPE>
+struct Thermocouple;
+
+template<>
+struct Thermocouple<THERMOCOUPLE_TYPE_K> {
+  static inline int32_t toMicrovolts(int16_t celcius) { return celcius_to_microvolts(celcius); }
+  static inline int16_t toCelcius(int32_t microvolts) { return microvolts_to_celcius(microvolts); }
+};
+
+// The whole chain from ADC reading to temperature
+template<class TC>
+struct Acquisition {
+  // @param sensor Channel the reading is from, for its calibration
+  // @param microvolts Reading from the ADC
+  // @param ambient Junction temperature, in 1/10 C
+  // @return Temperature in 1/10 C, or OUT_OF_RANGE_INT
+  static inline int16_t convert(uint8_t sensor, int32_t microvolts, int16_t ambient) {
+    // Add the junction voltage back in so the result is relative to 0C
+    return TC::toCelcius(Calibration::apply(sensor, microvolts) + TC::toMicrovolts(ambient));
+  }
+};
+
+typedef Acquisition<Thermocouple<THERMOCOUPLE_TYPE> > BoardAcquisition;
+
+// Unit scaling from 1/10 C. Differences and rates scale without the offset.
+template<uint8_t UNIT>
+struct Unit {
+  static inline int16_t fromCelcius(int16_t celcius) { return celcius; }
+  static inline int16_t fromCelciusDelta(int16_t celcius) { return celcius; }
+};
+
+template<>
+struct Unit<TEMPERATURE_UNITS_F> {
+  // 32 bit so values above 182C don't overflow
+  static inline int16_t fromCelcius(int16_t celcius) { return ((int32_t)celcius*18)/10 + 320; }
+  static inline int16_t fromCelciusDelta(int16_t celcius) { return ((int32_t)celcius*18)/10; }
+};
+
+template<>
+struct Unit<TEMPERATURE_UNITS_K> {
+  static inline int16_t fromCelcius(int16_t celcius) { return celcius + 2732; }
+  static inline int16_t fromCelciusDelta(int16_t celcius) { return celcius; }
+};
+
+// Convert a single value. Loops should dispatch on the unit once instead.
+inline int16_t convertTemperatureInt(uint8_t unit, int16_t celcius)
+{
+  switch(unit){
+  case TEMPERATURE_UNITS_F: return Unit<TEMPERATURE_UNITS_F>::fromCelcius(celcius);
+  case TEMPERATURE_UNITS_K: return Unit<TEMPERATURE_UNITS_K>::fromCelcius(celcius);
+  default: break;
+  }
+  return Unit<TEMPERATURE_UNITS_C>::fromCelcius(celcius);
+}
+
+// Convert a single difference
+inline int16_t convertTemperatureDeltaInt(uint8_t unit, int16_t celcius)
+{
+  if(unit == TEMPERATURE_UNITS_F) return Unit<TEMPERATURE_UNITS_F>::fromCelciusDelta(celcius);
+  return celcius;
+}
+
+#endif
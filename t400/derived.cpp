@@ -0,0 +1,152 @@
+#include <Arduino.h>
+#include "t400.h"
+#include "derived.h"
+
+#if DERIVED_CHANNELS_ENABLED
+
+namespace Derived {
+
+struct Definition {
+  uint8_t type;         // DERIVED_DIFFERENCE or DERIVED_SLOPE
+  uint8_t a;            // Channel the value is taken from
+  uint8_t b;            // Channel subtracted from a, differences only
+};
+
+constexpr Definition definitions[] = { DERIVED_CHANNEL_LIST };
+
+static_assert(sizeof(definitions)/sizeof(definitions[0]) == DERIVED_COUNT,
+              "DERIVED_COUNT doesn't match DERIVED_CHANNEL_LIST");
+// Larger windows overflow the 32 bit sums
+static_assert(DERIVED_SLOPE_WINDOW >= 2 && DERIVED_SLOPE_WINDOW <= 32,
+              "DERIVED_SLOPE_WINDOW must be 2-32");
+
+// Number of slope channels before channel i. Each slope has its own window,
+// differences don't need one.
+constexpr uint8_t slopesBefore(uint8_t i)
+{
+  return (i == 0) ? 0 : slopesBefore(i - 1) + (definitions[i - 1].type == DERIVED_SLOPE);
+}
+
+#define SLOPE_COUNT     slopesBefore(DERIVED_COUNT)
+
+// Least squares line through the last DERIVED_SLOPE_WINDOW samples, with
+// the oldest sample at x=0. Sum(x) and Sum(x^2) only depend on the number
+// of samples, so only Sum(y) and Sum(xy) need to be kept.
+struct Slope {
+  int32_t sumY;
+  int32_t sumXY;
+  uint8_t count;                          // Samples in the window
+  uint8_t head;                           // Oldest sample once the window is full
+  int16_t window[DERIVED_SLOPE_WINDOW];   // Samples, so the oldest can be taken back out
+};
+
+Slope slopes[SLOPE_COUNT > 0 ? SLOPE_COUNT : 1];
+uint16_t halfSeconds = 1;     // Time between samples
+
+static void clear(Slope* s)
+{
+  s->sumY = 0;
+  s->sumXY = 0;
+  s->count = 0;
+  s->head = 0;
+  return;
+}
+
+// @return Slope of the window in 1/10 degree per minute, or OUT_OF_RANGE_INT
+static int16_t fit(const Slope* s)
+{
+  int32_t n = s->count;
+  int32_t num;
+  int32_t den;
+  int32_t rate;
+
+  if(n < 2) return OUT_OF_RANGE_INT;
+
+  // slope = (n*Sum(xy) - Sum(x)*Sum(y)) / (n*Sum(x^2) - Sum(x)^2)
+  num = n*s->sumXY - (n*(n - 1)/2)*s->sumY;
+  den = n*n*(n*n - 1)/12;
+
+  // Per sample to per minute, num*120/(den*halfSeconds). The quotient and
+  // remainder are scaled separately so the product can't overflow.
+  rate = ((num/den)*120 + ((num%den)*120)/den)/(int32_t)halfSeconds;
+
+  if(rate >= OUT_OF_RANGE_INT) rate = OUT_OF_RANGE_INT - 1;
+  if(rate <= -OUT_OF_RANGE_INT) rate = -(OUT_OF_RANGE_INT - 1);
+  return rate;
+}
+
+// Slide the window along by one sample
+// @return Slope including the new sample
+static int16_t addSample(Slope* s, int16_t y)
+{
+  if(y == OUT_OF_RANGE_INT) {
+    // Start the fit over when the channel comes back
+    clear(s);
+    return OUT_OF_RANGE_INT;
+  }
+
+  if(s->count < DERIVED_SLOPE_WINDOW) {
+    s->sumXY += (int32_t)s->count*y;
+    s->sumY += y;
+    s->count++;
+  }else{
+    // Take the oldest sample (x=0) out, then every other sample moves down
+    // one x, which takes one Sum(y) off Sum(xy)
+    s->sumY -= s->window[s->head];
+    s->sumXY -= s->sumY;
+    s->sumXY += (int32_t)(DERIVED_SLOPE_WINDOW - 1)*y;
+    s->sumY += y;
+  }
+  s->window[s->head] = y;
+  s->head = (s->head + 1) % DERIVED_SLOPE_WINDOW;
+
+  return fit(s);
+}
+
+void reset(uint8_t logInterval)
+{
+  halfSeconds = (logInterval == 0) ? 1 : 2*(uint16_t)logInterval;
+  for(uint8_t i = 0; i < SLOPE_COUNT; i++) {
+    clear(&slopes[i]);
+  }
+  return;
+}
+
+void update(int16_t* values)
+{
+  for(uint8_t i = 0; i < DERIVED_COUNT; i++)
+  {
+    const Definition* d = &definitions[i];
+    int16_t a = values[d->a];
+    int16_t b = values[d->b];
+    int16_t* out = &values[SENSOR_COUNT + i];
+
+    if(d->type == DERIVED_SLOPE) {
+      *out = addSample(&slopes[slopesBefore(i)], a);
+    }else if(a == OUT_OF_RANGE_INT || b == OUT_OF_RANGE_INT) {
+      *out = OUT_OF_RANGE_INT;
+    }else{
+      *out = a - b;
+    }
+  }
+  return;
+}
+
+bool isRate(uint8_t channel)
+{
+  return definitions[channel].type == DERIVED_SLOPE;
+}
+
+char* name(char* buf, uint8_t channel)
+{
+  const Definition* d = &definitions[channel];
+  if(d->type == DERIVED_SLOPE)
+    sprintf(buf, "dT%d/dt", d->a + 1);
+  else
+    sprintf(buf, "T%d-T%d", d->a + 1, d->b + 1);
+  return buf;
+}
+
+} // namespace Derived
+
+#endif
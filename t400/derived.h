@@ -0,0 +1,36 @@
+/*
+ * Derived channels: differences between two thermocouples and the rate of
+ * change of one, computed from each row of samples
+ */
+
+#ifndef DERIVED_H
+#define DERIVED_H
+
+#include <Arduino.h>
+#include "t400.h"
+
+namespace Derived {
+
+  // Clear the rate of change windows. Call this whenever the time between
+  // samples changes, the old points would give the wrong slope.
+  // @param logInterval Seconds between samples, 0 for 500ms
+  void reset(uint8_t logInterval);
+
+  // Compute the derived channels for a row of samples. The slopes are kept
+  // as running sums, so each row costs the same whatever the window size.
+  // @param values Row of GRAPH_ROWS values. The first SENSOR_COUNT are read,
+  //               the derived channels are written after them.
+  void update(int16_t* values);
+
+  // @return True if the channel is a rate of change, in 1/10 degree per minute,
+  //         false if it is a difference in 1/10 degree
+  bool isRate(uint8_t channel);
+
+  // Write a short name for the channel, eg "T1-T2" or "dT1/dt"
+  // @param buf Buffer of at least 8 characters
+  // @return buf
+  char* name(char* buf, uint8_t channel);
+
+}
+
+#endif
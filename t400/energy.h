@@ -0,0 +1,74 @@
+/*
+ * Energy model for projecting battery life from activity counters
+ *
+ * This has no Arduino dependencies so it can be built on a PC to compare
+ * modes from counters captured on the device.
+ */
+
+#ifndef ENERGY_H
+#define ENERGY_H
+
+#include <stdint.h>
+
+// Rough current draw of each part of the board. These come from the datasheets
+// and should be tuned against a bench measurement.
+#define ENERGY_ACTIVE_UA          4500    // 32U4 running at 8MHz/3.3V
+#define ENERGY_IDLE_UA            1500    // 32U4 in SLEEP_MODE_IDLE
+#define ENERGY_POWER_DOWN_UA      60      // 32U4 powered down + RTC, regulators, sensors
+#define ENERGY_LCD_UA             300     // PI13264 controller on
+#define ENERGY_BACKLIGHT_UA       15000   // LCD backlight LEDs
+
+// Charge used by each event, in nA*s
+#define ENERGY_ADC_CONVERSION_NAS 9700    // MCP3424 16 bit conversion, 145uA for 67ms
+#define ENERGY_I2C_NAS            400     // ~4 byte transfer at 100kHz
+#define ENERGY_SD_BLOCK_NAS       60000   // SD sector write, ~40mA for 1.5ms
+#define ENERGY_LCD_PAGE_NAS       500     // 132 byte page pushed over SPI
+
+#define BATTERY_CAPACITY_MAH      850     // Nominal pack capacity
+
+struct EnergyCounters {
+  uint32_t seconds;             // Wall time covered by the counters
+  uint32_t activeMs;            // CPU running
+  uint32_t idleMs;              // CPU in SLEEP_MODE_IDLE, the rest of the time is power down
+  uint32_t adcConversions;      // MCP3424 conversions
+  uint32_t i2cTransactions;     // I2C transfers to the ADC and ambient sensor
+  uint32_t sdBlocks;            // SD sector writes (approximate)
+  uint32_t lcdPages;            // Display pages pushed
+  uint32_t lcdOnSeconds;        // Seconds with the LCD awake
+  uint32_t backlightOnSeconds;  // Seconds with the backlight on
+};
+
+// Average current over the counted period
+// @return Current in uA, 0 if no time has been counted
+inline uint32_t energyAverageMicroamps(const EnergyCounters& c)
+{
+  uint64_t totalMs = (uint64_t)c.seconds*1000;
+  uint64_t powerDownMs = 0;
+  uint64_t charge;              // nA*s, or equivalently uA*ms
+
+  if(totalMs == 0) return 0;
+  if(totalMs > (uint64_t)c.activeMs + c.idleMs) powerDownMs = totalMs - c.activeMs - c.idleMs;
+
+  charge = (uint64_t)c.activeMs*ENERGY_ACTIVE_UA
+         + (uint64_t)c.idleMs*ENERGY_IDLE_UA
+         + powerDownMs*ENERGY_POWER_DOWN_UA
+         + (uint64_t)c.lcdOnSeconds*ENERGY_LCD_UA*1000
+         + (uint64_t)c.backlightOnSeconds*ENERGY_BACKLIGHT_UA*1000
+         + (uint64_t)c.adcConversions*ENERGY_ADC_CONVERSION_NAS
+         + (uint64_t)c.i2cTransactions*ENERGY_I2C_NAS
+         + (uint64_t)c.sdBlocks*ENERGY_SD_BLOCK_NAS
+         + (uint64_t)c.lcdPages*ENERGY_LCD_PAGE_NAS;
+
+  return (uint32_t)(charge/totalMs);
+}
+
+// Battery life if the counted activity continued
+// @return Hours from a full battery, 0 if no time has been counted
+inline uint32_t energyProjectedHours(const EnergyCounters& c)
+{
+  uint32_t microamps = energyAverageMicroamps(c);
+  if(microamps == 0) return 0;
+  return ((uint32_t)BATTERY_CAPACITY_MAH*1000)/microamps;
+}
+
+#endif
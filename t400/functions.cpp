@@ -8,6 +8,11 @@
 #include "typek_constant.h"
 #include "t400.h"
 #include "functions.h"
+#include "convert.h"
+#include "instrument.h"
+#include "stats.h"
+#include "bus.h"
+#include "timing.h"
 
 
 #define U8G_PAGE_HEIGHT     8
@@ -17,6 +22,8 @@
 
 #define LINE_COUNT          4
 
+#define READINGS_PAGE       7     // Last page sent, the top band of the rotated screen
+
 const uint8_t lines[LINE_COUNT][4] = {
     { 0,  7, 132,   7}, // hline between temperatures and status bar
     {31,  0,  31,   7}, // vline between TC1 and TC2
@@ -24,16 +31,13 @@ const uint8_t lines[LINE_COUNT][4] = {
     {99,  0,  99,   7}, // vline between TC3 and TC4
 };
 
-// Function prototypes for t400.ino
-int16_t convertTemperatureInt(int16_t celcius);
-
 // Graphical LCD
 U8GLIB_PI13264  u8g(LCD_CS, LCD_A0, LCD_RST); // Use HW-SPI
   
 // Graph data
-int16_t graph[SENSOR_COUNT][MAXIMUM_GRAPH_POINTS]={}; // Array to hold graph data, in temperature values
+int16_t graph[GRAPH_ROWS][GRAPH_POINTS]={};          // Array to hold graph data, in temperature values
 
-uint8_t graphCurrentPoint;                           // Index of latest point added to the graph (0,MAXIMUM_GRAPH_POINTS]
+uint8_t graphCurrentPoint;                           // Index of latest point added to the graph (0,GRAPH_POINTS]
 uint8_t graphPoints;                                 // Number of valid points to graph
 
 uint32_t graphScale;    // Number of degrees per pixel in the graph[] array.
@@ -46,8 +50,60 @@ int16_t maxTempInt;
 
 extern uint8_t btn_disable_count;
 extern uint8_t sd_full_count;
+extern uint8_t temperatureUnit;
+extern int16_t temperatures_int[SENSOR_COUNT];
+
+#if DISPLAY_CACHE_ENABLED
+// Bands that only change with their inputs are kept as page buffer bytes,
+// and copied back in instead of being drawn again
+#define STATUS_CACHE_WIDTH  128   // Status bar text, the battery icon is drawn each time
+#define AXIS_CACHE_WIDTH    (CHARACTER_SPACING*4 + 3)  // Axis labels and separator, at their widest
+#define AXIS_PAGES          6     // Pages 0-5 hold the graph
+
+// Inputs of the cached status bar
+struct StatusKey {
+  uint8_t unit;
+  uint8_t logInterval;
+  uint16_t batteryMinutes;  // RUNTIME_UNKNOWN unless the runtime is shown
+  bool logging;
+  char fileName[13];
+};
+
+StatusKey statusKey;
+bool statusCached = false;
+uint8_t statusCache[STATUS_CACHE_WIDTH];
+
+// Inputs of the cached axis, see updateGraphScaling()
+int16_t axisMinLabel;
+uint32_t axisScale;
+uint8_t axisCachedDigits;
+uint8_t axisCached = 0;       // Bit per page held in axisCache
+uint8_t axisCache[AXIS_PAGES][AXIS_CACHE_WIDTH];
+#endif
 
 // Helper functions
+// Page buffer of the panel, under the rotation. Each byte is a column of the
+// page being drawn, and the rotation puts column x at width-1-x.
+static u8g_pb_t* pageBuffer()
+{
+  u8g_t* u = u8g.getU8g();
+  u8g_dev_t* dev = (u8g_dev_t*)u->dev->dev_mem;
+
+  return (u8g_pb_t*)dev->dev_mem;
+}
+
+// Send the page buffer to the LCD, and start the next page if there is one
+static uint8_t sendPage()
+{
+  uint8_t more;
+
+  Bus::begin(Bus::DEVICE_LCD);
+  more = u8g.nextPage();
+  Bus::end();
+
+  return more;
+}
+
 // Prints an int and returns the pointer to buffer
 #define printi(B,I)   (sprintf((B),"%d",(I)),(B))
 
@@ -62,6 +118,13 @@ char * printtemp(char * buf, int16_t temp)
     return buf;
 }
 
+char * printTenths(char * buf, int16_t value)
+{
+    int16_t magnitude = abs(value);
+    sprintf(buf,"%s%d.%d",(value<0) ? "-" : "",magnitude/10,magnitude%10);
+    return buf;
+}
+
 void resetGraph()
 {
   graphCurrentPoint = 0;
@@ -70,9 +133,9 @@ void resetGraph()
   graphScale = 1;
 
   // Blank the array
-  for(uint8_t x = 0; x < SENSOR_COUNT; x++)
+  for(uint8_t x = 0; x < GRAPH_ROWS; x++)
   {
-    for(uint8_t y=0; y < MAXIMUM_GRAPH_POINTS; y++)
+    for(uint8_t y=0; y < GRAPH_POINTS; y++)
     {
         graph[x][y] = OUT_OF_RANGE_INT;
     }
@@ -81,24 +144,24 @@ void resetGraph()
   return;
 }
 
-// Update the graph using temperatures[NUM_SENSORS]
+// Update the graph using temperatures[GRAPH_ROWS]
 void updateGraphData(int16_t* temperatures)
 {
     // Increment the current graph point (it wraps around)
     if(graphCurrentPoint == 0)
     {
-        graphCurrentPoint = MAXIMUM_GRAPH_POINTS - 1;
+        graphCurrentPoint = GRAPH_POINTS - 1;
     }else{
         graphCurrentPoint -= 1;
     }
 
     // Increment the number of stored graph points
-    if(graphPoints < MAXIMUM_GRAPH_POINTS) {
+    if(graphPoints < GRAPH_POINTS) {
         graphPoints++;
     }
 
     // Stick the new temperature in the array
-    for(uint8_t sensor = 0; sensor < SENSOR_COUNT; sensor++)
+    for(uint8_t sensor = 0; sensor < GRAPH_ROWS; sensor++)
     {
         graph[sensor][graphCurrentPoint] = temperatures[sensor];
     }
@@ -106,24 +169,77 @@ void updateGraphData(int16_t* temperatures)
   return;
 }
 
-void updateGraphScaling()
+// Bank of channels shown in the readings row for a graph view
+static inline uint8_t graphBank(uint8_t graphChannel)
+{
+    if(graphChannel < SENSOR_COUNT) return graphChannel/SENSOR_BANK_SIZE;
+    if(graphChannel >= GRAPH_STATS_VIEW) return graphChannel - GRAPH_STATS_VIEW;
+    return graphChannel - SENSOR_COUNT;
+}
+
+// True for the views of a single derived channel
+static inline bool derivedView(uint8_t graphChannel)
+{
+    return (graphChannel >= GRAPH_DERIVED_VIEW) && (graphChannel < GRAPH_STATS_VIEW);
+}
+
+// Graph rows drawn for a graph view: a single channel, all the channels in
+// a bank, or a single derived channel
+static void graphRows(uint8_t graphChannel, uint8_t* first, uint8_t* last)
+{
+    if(graphChannel < SENSOR_COUNT) {
+        *first = graphChannel;
+        *last = graphChannel + 1;
+    }else if(derivedView(graphChannel)) {
+        *first = SENSOR_COUNT + (graphChannel - GRAPH_DERIVED_VIEW);
+        *last = *first + 1;
+    }else{
+        *first = graphBank(graphChannel)*SENSOR_BANK_SIZE;
+        *last = *first + SENSOR_BANK_SIZE;
+        if(*last > SENSOR_COUNT) *last = SENSOR_COUNT;
+    }
+    return;
+}
+
+// Convert a graph point to UNIT. Derived rows are differences and rates,
+// which don't take the unit's offset.
+template<uint8_t UNIT>
+static inline int16_t graphValue(uint8_t row, int16_t value)
+{
+    if(row >= SENSOR_COUNT) return Unit<UNIT>::fromCelciusDelta(value);
+    return Unit<UNIT>::fromCelcius(value);
+}
+
+// Get the max & min of the graph data shown in a view, in UNIT
+template<uint8_t UNIT>
+static void graphRange(uint8_t graphChannel, int16_t* minPtr, int16_t* maxPtr)
 {
-  uint16_t delta;
   int16_t max=TEMP_MIN_VALUE_I;
   int16_t min=TEMP_MAX_VALUE_I;
   int16_t * ptr;
   int16_t p;
+  uint8_t first;
+  uint8_t last;
+
+  // Temperature views share one scale, so switching between them doesn't
+  // rescale. A derived channel is scaled on its own.
+  if(derivedView(graphChannel)) {
+    graphRows(graphChannel, &first, &last);
+  }else{
+    first = 0;
+    last = SENSOR_COUNT;
+  }
 
   // Itterate over all the data and get the max & min
-  for(uint8_t x = 0; x < SENSOR_COUNT; x++)
+  for(uint8_t x = first; x < last; x++)
   {
      ptr = (int16_t*)&graph[x][0];
-     for(uint8_t y=0; y < MAXIMUM_GRAPH_POINTS; y++)
+     for(uint8_t y=0; y < GRAPH_POINTS; y++)
      {
        p = *ptr;
        if(p!=OUT_OF_RANGE_INT)
        {
-           p = convertTemperatureInt(p);
+           p = graphValue<UNIT>(x, p);
            if(p>max) max = p;
            if(p<min) min = p;
        }
@@ -131,6 +247,24 @@ void updateGraphScaling()
      }
   }
 
+  *minPtr = min;
+  *maxPtr = max;
+  return;
+}
+
+void updateGraphScaling(uint8_t graphChannel)
+{
+  uint16_t delta;
+  int16_t max;
+  int16_t min;
+
+  // Pick the unit once for the whole scan
+  switch(temperatureUnit){
+  case TEMPERATURE_UNITS_F: graphRange<TEMPERATURE_UNITS_F>(graphChannel, &min, &max); break;
+  case TEMPERATURE_UNITS_K: graphRange<TEMPERATURE_UNITS_K>(graphChannel, &min, &max); break;
+  default:                  graphRange<TEMPERATURE_UNITS_C>(graphChannel, &min, &max); break;
+  }
+
   if(max==TEMP_MIN_VALUE_I) max=0;
   if(min==TEMP_MAX_VALUE_I) min=0;
 
@@ -158,10 +292,23 @@ void updateGraphScaling()
 
 void setupDisplay()
 {
+  Bus::begin(Bus::DEVICE_LCD);
   u8g.setContrast(LCD_CONTRAST);    // Set contrast level
   u8g.setRot180();                  // Rotate screen
   u8g.setColorIndex(1);             // Set color mode to binary
   u8g.setFont(u8g_font_5x8r);       // Select font. See https://code.google.com/p/u8glib/wiki/fontsize
+  Bus::end();
+  Instrument::setLoad(Instrument::LOAD_LCD, true);
+  return;
+}
+
+void displaySleep(bool sleep)
+{
+  Bus::begin(Bus::DEVICE_LCD);
+  if(sleep) u8g.sleepOn();
+  else u8g.sleepOff();
+  Bus::end();
+  Instrument::setLoad(Instrument::LOAD_LCD, !sleep);
   return;
 }
 
@@ -173,7 +320,7 @@ uint8_t numlength(int16_t num)
     return 1;
 }
 
-uint8_t temperature_to_pixel(int16_t temp)
+inline uint8_t temperature_to_pixel(int16_t temp)
 {
     uint16_t p;
     // This gets the delta between our measurement and the min value (which
@@ -194,257 +341,586 @@ uint8_t temperature_to_pixel(int16_t temp)
     return (uint8_t)p;
 }
 
-void draw(
-  uint8_t graphChannel,
-  uint8_t temperatureUnit,
-  char* fileName,
-  uint8_t logInterval,
-  ChargeStatus::State bStatus,
-  uint8_t batteryLevel
-  ) {
+// Draw the temperature graph for each sensor, converting to UNIT
+template<uint8_t UNIT>
+static void drawGraphPoints(uint8_t graphChannel, uint8_t num_points)
+{
+    uint8_t p;
+    uint8_t index;
+    uint8_t first;
+    uint8_t last;
 
-  // Graphic commands to redraw the complete screen should be placed here
-  char buf[8];
+    graphRows(graphChannel, &first, &last);
 
-  uint8_t page = 0;
-  uint8_t x;
-  //uint8_t debug_point=0;
-  //int16_t debug_point2=0;
-  uint8_t num_points=0;
-  uint8_t battX = 128;
-  uint8_t battY = 9;
+    for(uint8_t sensor = first; sensor < last; sensor++)
+    {
+        int16_t tmp16;
+        #if GRAPH_POINT_WIDTH > 1
+        uint8_t lastP = 0;
+        #endif
 
-  // Update the screen
-  u8g.firstPage();
-  do {
+        // if the sensor is out of range, don't show it
+        if(graph[sensor][graphCurrentPoint] == OUT_OF_RANGE_INT)
+          continue;
 
-    // Each 'page' is a band of 10 pixels across the screen
-    // Draw temperature graph
-    switch(page){
-    case 5:
-        u8g.drawLine( 0, 16, 132,  16);    // hline between status bar and graph
-        // no break
-    default:
-    {
-        // This runs when we are on page 1-5
-        uint8_t p;
-        uint8_t index;
-        uint8_t bot,top;
+        tmp16 = graphValue<UNIT>(sensor, graph[sensor][graphCurrentPoint]);
 
-        // We only write a horizontal row within a range for each page, this is
-        // called 6 times and we loop the whole temperature buffer each time!
-        // TODO: Make more efficient
+        // Get the position of the latest point
+        //p = temperature_to_pixel(graph[sensor][graphCurrentPoint]);
+        p = temperature_to_pixel(tmp16);
 
-        bot = 63-(page*U8G_PAGE_HEIGHT);
-        top = bot-(U8G_PAGE_HEIGHT-1);
+        // Draw the channel number at the latest point
+        {
+            char chan[2];
+            // 1-9, then A-G, then a-z for the derived channels
+            if(sensor >= SENSOR_COUNT) chan[0] = 'a'+(sensor-SENSOR_COUNT);
+            else chan[0]  = (sensor < 9) ? '1'+sensor : 'A'+(sensor-9);
+            chan[1] = 0;
+            u8g.drawStr(113+5*(sensor%SENSOR_BANK_SIZE), 3 + p, chan);
+        }
+        // Now, draw all the points
+        index = graphCurrentPoint;
+        for(uint8_t point = 0; point < num_points; point++)
+        {
+            tmp16 = graphValue<UNIT>(sensor, graph[sensor][index]);
+            //p = temperature_to_pixel(graph[sensor][index]);
+            p = temperature_to_pixel(tmp16);
+            // Draw pixel at X, Y. X is # of pixels from the left
+            #if GRAPH_POINT_WIDTH > 1
+            // Points are spread out, join them up
+            if(point > 0)
+                u8g.drawLine(MAXIMUM_GRAPH_POINTS+12-(point-1)*GRAPH_POINT_WIDTH, lastP,
+                             MAXIMUM_GRAPH_POINTS+12-point*GRAPH_POINT_WIDTH, p);
+            lastP = p;
+            #else
+            u8g.drawPixel(MAXIMUM_GRAPH_POINTS+12-point,p);
+            #endif
+            // Go to next pixel
+            index++;
+            // Wrap when we hit the end of the array
+            if(index>=GRAPH_POINTS) index = 0;
+
+        } // end for point
+
+    }// end for sensor
+    return;
+}
 
-        // Draw the separator line between axes labels and legend
-        u8g.drawLine(CHARACTER_SPACING*axisDigits + 2, bot,
-                   CHARACTER_SPACING*axisDigits + 2, top);
+// Draw the thermocouple readings row, on the top page
+static void drawReadingsRow(uint8_t graphChannel)
+{
+    char buf[8];
 
-        // TODO: This draw function is called for each page.  The switch
-        // statement runs this block of code for pages 0-5.  This means all
-        // the code below is run 6 times!  This is super inefficient.
-        // Should fix but this is how the u8g library works :-/
+    for (uint8_t i = 0; i < LINE_COUNT; i++)
+    {
+      const uint8_t* pos = lines[i];
+      u8g.drawLine(pos[0], pos[1], pos[2], pos[3]);
+    }
 
+    // Display temperature readings for the bank being graphed, or all the
+    // derived channels when one of those is graphed. Derived channels only
+    // change with each sample, the thermocouples are shown as converted.
+    for(uint8_t cell = 0; cell < SENSOR_BANK_SIZE; cell++)
+    {
+      uint8_t sensor;
+      int16_t value;
+      if(derivedView(graphChannel)) {
+        sensor = SENSOR_COUNT + cell;
+        if(sensor >= GRAPH_ROWS) break;
+        value = graph[sensor][graphCurrentPoint];
+      }else{
+        sensor = graphBank(graphChannel)*SENSOR_BANK_SIZE + cell;
+        if(sensor >= SENSOR_COUNT) break;
+        #if LIVE_READINGS_ENABLED
+        value = temperatures_int[sensor];
+        #else
+        value = graph[sensor][graphCurrentPoint];
+        #endif
+      }
 
-        // Draw axis labels and marks
-        for(uint8_t interval = 0; interval < GRAPH_INTERVALS; interval++)
-        {
-            uint8_t spaces=0,x;
-            int16_t tmp16;
-            u8g.drawPixel(CHARACTER_SPACING*axisDigits + 1, 63-(interval*10)-3);
-            tmp16 = (minTempInt/10) + (graphScale*interval);
-            // TODO: Write a space string, then over write with number, drrr
-            // Add spaces for right justified
-            spaces = axisDigits-numlength(tmp16);
-            if(spaces>3) spaces=3;
-            for(x=0;x<spaces;x++)
-                sprintf(&(buf[x])," ");
-            sprintf(&(buf[spaces]), "%d", tmp16);
-            u8g.drawStr(0, DISPLAY_HEIGHT - interval*10,  buf);
-        }
+      if(value == OUT_OF_RANGE_INT)
+      {
+        u8g.drawStr(cell*34,   6,  " ----");
+      }else {
+        u8g.drawStr(cell*34, 6, printtemp(buf,value));
+      }
+    }
+    return;
+}
 
-        // Calculate how many graph points to display.
-        // If the number of axis digits is >2, scale back how many
-        // graph points to show
-        num_points = graphPoints;
-        x = MAXIMUM_GRAPH_POINTS - ((axisDigits - 2)*5);
-        if(x<num_points) num_points = x;
+#if STATS_ENABLED
+// Table of the session statistics for a bank, in whole degrees
+static void drawStats(uint8_t bank, const Stats::Summary* summaries, uint8_t valid, uint8_t unit)
+{
+    char buf[28];
 
-        // Draw the temperature graph for each sensor
-        for(uint8_t sensor = 0; sensor < 4; sensor++)
-        {
-            int16_t tmp16;
+    u8g.drawStr(0, 24, "#   Min   Max  Mean   SD");
+    for(uint8_t cell = 0; cell < SENSOR_BANK_SIZE; cell++)
+    {
+        const Stats::Summary* s = &summaries[cell];
+        uint8_t sensor = bank*SENSOR_BANK_SIZE + cell;
+        char chan;
+
+        if(sensor >= SENSOR_COUNT) break;
+
+        // 1-9, then A-G
+        chan = (sensor < 9) ? '1'+sensor : 'A'+(sensor-9);
+        if(valid & _BV(cell)) {
+            sprintf(buf, "%c %5d %5d %5d %4d", chan,
+                    convertTemperatureInt(unit, s->min)/10,
+                    convertTemperatureInt(unit, s->max)/10,
+                    convertTemperatureInt(unit, s->mean)/10,
+                    convertTemperatureDeltaInt(unit, s->stddev)/10);
+        }else{
+            sprintf(buf, "%c     ----", chan);
+        }
+        u8g.drawStr(0, 32 + cell*8, buf);
+    }
+    return;
+}
+#endif
 
-            // if the sensor is out of range, don't show it. If we are showing one
-            // channel, ignore the others
-            if(graph[sensor][graphCurrentPoint] == OUT_OF_RANGE_INT || (sensor != graphChannel && graphChannel < 4) )
-              continue;
+// Draw the axis labels and marks, and the separator between them and the
+// graph, on the page covering rows top to bot
+static void drawAxis(uint8_t bot, uint8_t top)
+{
+    char buf[8];
 
-            tmp16 = convertTemperatureInt(graph[sensor][graphCurrentPoint]);
+    // Draw the separator line between axes labels and legend
+    u8g.drawLine(CHARACTER_SPACING*axisDigits + 2, bot,
+               CHARACTER_SPACING*axisDigits + 2, top);
 
-            // Get the position of the latest point
-            //p = temperature_to_pixel(graph[sensor][graphCurrentPoint]);
-            p = temperature_to_pixel(tmp16);
+    // Draw axis labels and marks
+    for(uint8_t interval = 0; interval < GRAPH_INTERVALS; interval++)
+    {
+        uint8_t spaces=0,x;
+        int16_t tmp16;
+        u8g.drawPixel(CHARACTER_SPACING*axisDigits + 1, 63-(interval*10)-3);
+        tmp16 = (minTempInt/10) + (graphScale*interval);
+        // TODO: Write a space string, then over write with number, drrr
+        // Add spaces for right justified
+        spaces = axisDigits-numlength(tmp16);
+        if(spaces>3) spaces=3;
+        for(x=0;x<spaces;x++)
+            sprintf(&(buf[x])," ");
+        sprintf(&(buf[spaces]), "%d", tmp16);
+        u8g.drawStr(0, DISPLAY_HEIGHT - interval*10,  buf);
+    }
+    return;
+}
 
-            // Draw the channel number at the latest point
-            {
-                char chan[2];
-                chan[0]  = '1'+sensor;
-                chan[1] = 0;
-                u8g.drawStr(113+5*sensor, 3 + p, chan);
-            }
-            // Now, draw all the points
-            index = graphCurrentPoint;
-            for(uint8_t point = 0; point < num_points; point++)
-            {
-                tmp16 = convertTemperatureInt(graph[sensor][index]);
-                //p = temperature_to_pixel(graph[sensor][index]);
-                p = temperature_to_pixel(tmp16);
-                // Draw pixel at X, Y. X is # of pixels from the left
-                u8g.drawPixel(MAXIMUM_GRAPH_POINTS+12-point,p);
-                // Go to next pixel
-                index++;
-                // Wrap when we hit the end of the array
-                if(index>=MAXIMUM_GRAPH_POINTS) index = 0;
-
-            } // end for point
-
-        }// end for sensor
+// Draw the status bar text: runtime or thermocouple type, unit, file and interval
+// @param batteryMinutes Runtime to show, RUNTIME_UNKNOWN to show the type
+static void drawStatus(uint8_t temperatureUnit, const char* fileName,
+                       uint8_t logInterval, uint16_t batteryMinutes)
+{
+    char buf[8];
 
+    //u8g.drawStr(0,  15, printi(buf,ambient));         // Ambient temperature
+    if(batteryMinutes != RUNTIME_UNKNOWN)
+    {
+        if(batteryMinutes < 600)
+            sprintf(buf,"%dh%02d",batteryMinutes/60,batteryMinutes%60);
+        else
+            sprintf(buf,"%dh",batteryMinutes/60);
+        u8g.drawStr(0,  15, buf);
+    }else{
+        u8g.drawStr(0,  15, "TypK");
+    }
+    u8g.drawStr(25,  13, "o");
+
+    switch(temperatureUnit){
+    case TEMPERATURE_UNITS_C:
+      u8g.drawStr(30, 15, "C");
+      break;
+    case TEMPERATURE_UNITS_F:
+      u8g.drawStr(30, 15, "F");
+      break;
+    default:
+      u8g.drawStr(30, 15, "K");
+      break;
     }
-    break;
 
-    case 6:
+    // Write file name
+    if(fileName==NULL)
+        u8g.drawStr(40, 15,"Not logging");
+    else
+        u8g.drawStr(40, 15,fileName);
 
-    if(btn_disable_count>0)
+    // Interval
+    if(logInterval==0)
     {
-        u8g.drawStr(11, DISPLAY_HEIGHT - page*8-1,  "Disabled while logging");
-    }else if(sd_full_count>0){
-        u8g.drawStr(40, DISPLAY_HEIGHT - page*8-1,  "SD max files!");
+        u8g.drawStr( 100, 15, "500ms");
     }else{
-      // Draw status bar
-      //u8g.drawStr(0,  15, printi(buf,ambient));         // Ambient temperature
-      u8g.drawStr(0,  15, "TypK"); 
-      u8g.drawStr(25,  13, "o"); 
-      
-      switch(temperatureUnit){
-      case TEMPERATURE_UNITS_C:
-        u8g.drawStr(30, 15, "C");
-        break;
-      case TEMPERATURE_UNITS_F:
-        u8g.drawStr(30, 15, "F");
-        break;
-      default:
-        u8g.drawStr(30, 15, "K");
-        break;
-      }
-      
-      // Write file name
-      if(fileName==NULL)
-          u8g.drawStr(40, 15,"Not logging");
-      else
-          u8g.drawStr(40, 15,fileName);
-
-      // Interval
-      if(logInterval==0)
-      {
-          u8g.drawStr( 100, 15, "500ms");
-      }else{
-          sprintf(buf,"%2d",logInterval);
-          u8g.drawStr( 103, 15, buf);
-          u8g.drawStr(113, 15, "s");
+        sprintf(buf,"%2d",logInterval);
+        u8g.drawStr( 103, 15, buf);
+        u8g.drawStr(113, 15, "s");
+    }
+    return;
+}
+
+// Draw the battery icon at the right of the status bar
+static void drawBattery(ChargeStatus::State bStatus, uint8_t batteryLevel)
+{
+    uint8_t battX = 128;
+    uint8_t battY = 9;
+
+    switch(bStatus){
+    case ChargeStatus::DISCHARGING:
+      u8g.drawLine(battX,   14, battX+3, 14);
+      u8g.drawLine(battX,   14, battX,   10);
+      u8g.drawLine(battX+3, 14, battX+3, 10);
+      u8g.drawLine(battX+1,  9, battX+2,  9);
+
+      // TODO: charge level
+      for(uint8_t i = 0; i < batteryLevel; i++) {
+        u8g.drawLine(battX, 13-i, battX+3, 13-i);
       }
+      break;
+    case ChargeStatus::NO_BATTERY:
+      u8g.drawLine(battX,   battY,   battX,   battY+5);
+      u8g.drawLine(battX,   battY,   battX+3, battY);
+      u8g.drawLine(battX,   battY+2, battX+2, battY+2);
+      u8g.drawLine(battX,   battY+5, battX+3, battY+5);
 
-      // Draw battery
-      switch(bStatus){
-      case ChargeStatus::DISCHARGING:
-        u8g.drawLine(battX,   14, battX+3, 14);
-        u8g.drawLine(battX,   14, battX,   10);
-        u8g.drawLine(battX+3, 14, battX+3, 10);
-        u8g.drawLine(battX+1,  9, battX+2,  9);
-      
-        // TODO: charge level
-        for(uint8_t i = 0; i < batteryLevel; i++) {
-          u8g.drawLine(battX, 13-i, battX+3, 13-i);
-        }
-        break;
-      case ChargeStatus::NO_BATTERY:
-        u8g.drawLine(battX,   battY,   battX,   battY+5);
-        u8g.drawLine(battX,   battY,   battX+3, battY);
-        u8g.drawLine(battX,   battY+2, battX+2, battY+2);
-        u8g.drawLine(battX,   battY+5, battX+3, battY+5);
-
-        break;
-      case ChargeStatus::CHARGING:
-        u8g.drawLine(battX,   14, battX+3, 14);
-        u8g.drawLine(battX,   14, battX,   10);
-        u8g.drawLine(battX+3, 14, battX+3, 10);
-        u8g.drawLine(battX+1,  9, battX+2,  9);
-      
-        static uint8_t batteryState = 0;
-        batteryState = (batteryState+1)%5;
-        for(uint8_t i = 0; i < batteryState; i++) {
-          u8g.drawLine(battX, 13-i, battX+3, 13-i);
-        }
-        break;
-      default:
-        // CHARGED
-        u8g.drawLine(battX,   battY+1, battX,   battY+5);
-        u8g.drawLine(battX+1, battY,   battX+1, battY+5);
-        u8g.drawLine(battX+2, battY,   battX+2, battY+5);
-        u8g.drawLine(battX+3, battY+1, battX+3, battY+5);
-        break;
+      break;
+    case ChargeStatus::CHARGING:
+      u8g.drawLine(battX,   14, battX+3, 14);
+      u8g.drawLine(battX,   14, battX,   10);
+      u8g.drawLine(battX+3, 14, battX+3, 10);
+      u8g.drawLine(battX+1,  9, battX+2,  9);
+
+      static uint8_t batteryState = 0;
+      batteryState = (batteryState+1)%5;
+      for(uint8_t i = 0; i < batteryState; i++) {
+        u8g.drawLine(battX, 13-i, battX+3, 13-i);
       }
+      break;
+    default:
+      // CHARGED
+      u8g.drawLine(battX,   battY+1, battX,   battY+5);
+      u8g.drawLine(battX+1, battY,   battX+1, battY+5);
+      u8g.drawLine(battX+2, battY,   battX+2, battY+5);
+      u8g.drawLine(battX+3, battY+1, battX+3, battY+5);
+      break;
     }
-    break;
+    return;
+}
 
-    case 7:
-      // Draw thermocouple readings
-      for (uint8_t i = 0; i < LINE_COUNT; i++)
-      {
-        const uint8_t* pos = lines[i];
-        u8g.drawLine(pos[0], pos[1], pos[2], pos[3]);
-      }
+#if DISPLAY_CACHE_ENABLED
+// Copy the leftmost width columns of the page being drawn into a cache
+static void saveColumns(uint8_t* cache, uint8_t width)
+{
+  u8g_pb_t* pb = pageBuffer();
 
-      // Display temperature readings  
-      #if 1
-      for(uint8_t sensor = 0; sensor < SENSOR_COUNT; sensor++)
-      {
-        if(graph[sensor][graphCurrentPoint] == OUT_OF_RANGE_INT)
-        {
-          u8g.drawStr(sensor*34,   6,  " ----");
-        }else {
-          u8g.drawStr(sensor*34, 6, printtemp(buf,graph[sensor][graphCurrentPoint]));
-        }
+  memcpy(cache, (uint8_t*)pb->buf + pb->width - width, width);
+  return;
+}
+
+// Put cached columns back, on top of anything already drawn there
+static void loadColumns(const uint8_t* cache, uint8_t width)
+{
+  u8g_pb_t* pb = pageBuffer();
+  uint8_t* columns = (uint8_t*)pb->buf + pb->width - width;
+
+  for(uint8_t i = 0; i < width; i++) columns[i] |= cache[i];
+  return;
+}
+
+// drawAxis(), redrawn only when the labels move. Call first on the page,
+// before anything else lands in the axis columns.
+static void drawAxisCached(uint8_t page, uint8_t bot, uint8_t top)
+{
+  int16_t minLabel = minTempInt/10;
+
+  if(minLabel != axisMinLabel || graphScale != axisScale || axisDigits != axisCachedDigits) {
+    axisMinLabel = minLabel;
+    axisScale = graphScale;
+    axisCachedDigits = axisDigits;
+    axisCached = 0;
+  }
+
+  if(axisCached & _BV(page)) {
+    loadColumns(axisCache[page], AXIS_CACHE_WIDTH);
+    return;
+  }
+  drawAxis(bot, top);
+  saveColumns(axisCache[page], AXIS_CACHE_WIDTH);
+  axisCached |= _BV(page);
+  return;
+}
+
+// drawStatus(), redrawn only when its text changes. The status page holds
+// nothing else, so the capture is the text alone.
+static void drawStatusCached(uint8_t temperatureUnit, const char* fileName,
+                             uint8_t logInterval, uint16_t batteryMinutes)
+{
+  StatusKey key;
+
+  key.unit = temperatureUnit;
+  key.logInterval = logInterval;
+  key.batteryMinutes = batteryMinutes;
+  key.logging = (fileName != NULL);
+  key.fileName[0] = 0;
+  if(fileName != NULL) {
+    // A name too long to key on is drawn every time
+    if(strlen(fileName) >= sizeof(key.fileName)) {
+      drawStatus(temperatureUnit, fileName, logInterval, batteryMinutes);
+      return;
+    }
+    strcpy(key.fileName, fileName);
+  }
+
+  if(statusCached && key.unit == statusKey.unit && key.logInterval == statusKey.logInterval
+     && key.batteryMinutes == statusKey.batteryMinutes && key.logging == statusKey.logging
+     && strcmp(key.fileName, statusKey.fileName) == 0) {
+    loadColumns(statusCache, STATUS_CACHE_WIDTH);
+    return;
+  }
+  drawStatus(temperatureUnit, fileName, logInterval, batteryMinutes);
+  saveColumns(statusCache, STATUS_CACHE_WIDTH);
+  statusKey = key;
+  statusCached = true;
+  return;
+}
+
+void resetDisplayCache()
+{
+  statusCached = false;
+  axisCached = 0;
+  return;
+}
+#endif
+
+// The frame being sent by drawTask(). Its inputs are copied when it starts, so
+// the pages agree with each other whatever loop() does in between.
+struct Frame {
+  bool pending;                         // Pages left to draw
+  uint8_t page;                         // Next page to draw
+  uint8_t graphChannel;
+  uint8_t temperatureUnit;
+  bool logging;                         // fileName is shown
+  char fileName[13];
+  uint8_t logInterval;
+  ChargeStatus::State bStatus;
+  uint8_t batteryLevel;
+  uint16_t batteryMinutes;
+  void (*drawPoints)(uint8_t, uint8_t);
+  #if STATS_ENABLED
+  bool statsPage;
+  uint8_t statsValid;                   // Bit per cell of summaries[]
+  Stats::Summary summaries[SENSOR_BANK_SIZE];
+  #endif
+};
+
+Frame frame;
+
+static void drawPage(uint8_t page)
+{
+  uint8_t x;
+  uint8_t num_points=0;
+  const char* fileName = frame.logging ? frame.fileName : NULL;
+
+  // Each 'page' is a band of 8 pixels across the screen
+  // Draw temperature graph
+  switch(page){
+  case 5:
+      u8g.drawLine( 0, 16, 132,  16);    // hline between status bar and graph
+      // no break
+  default:
+  {
+      // This runs when we are on page 0-5
+      uint8_t bot,top;
+
+      #if STATS_ENABLED
+      if(frame.statsPage) {
+          drawStats(graphBank(frame.graphChannel), frame.summaries, frame.statsValid, frame.temperatureUnit);
+          break;
       }
+      #endif
+
+      // We only write a horizontal row within a range for each page, this is
+      // called 6 times and we loop the whole temperature buffer each time!
+      // TODO: Make more efficient
 
+      bot = 63-(page*U8G_PAGE_HEIGHT);
+      top = bot-(U8G_PAGE_HEIGHT-1);
+
+      // Draw the axis, from the cache once it has been drawn at this scale
+      #if DISPLAY_CACHE_ENABLED
+      drawAxisCached(page, bot, top);
       #else
-      // DEBUG: Write variable values to the spaces rather than the current temp
-      u8g.drawStr(0*34,   6,  printi(buf,temperatures_int[0]));
-      u8g.drawStr(1*34,   6,  printi(buf,temperatures_int[1]));
-      u8g.drawStr(2*34,   6,  printi(buf,temperatures_int[2]));
-      u8g.drawStr(3*34,   6,  printi(buf,temperatures_int[3]));
+      drawAxis(bot, top);
       #endif
 
-      break;
+      // Calculate how many graph points to display.
+      // If the number of axis digits is >2, scale back how many
+      // graph points to show
+      num_points = graphPoints;
+      x = (MAXIMUM_GRAPH_POINTS - ((axisDigits - 2)*5))/GRAPH_POINT_WIDTH;
+      if(x<num_points) num_points = x;
 
-    } // End of select(page)
-    
-    // Go to next page
-    page++;
+      // Draw the temperature graph for each sensor
+      frame.drawPoints(frame.graphChannel, num_points);
 
-  }while( u8g.nextPage() );
+  }
+  break;
+
+  case 6:
+
+  if(btn_disable_count>0)
+  {
+      u8g.drawStr(11, DISPLAY_HEIGHT - page*8-1,  "Disabled while logging");
+  }else if(sd_full_count>0){
+      u8g.drawStr(40, DISPLAY_HEIGHT - page*8-1,  "SD max files!");
+  }else{
+    // On battery, show the remaining runtime in place of the thermocouple type
+    uint16_t batteryMinutes = frame.batteryMinutes;
+    if(frame.bStatus != ChargeStatus::DISCHARGING) batteryMinutes = RUNTIME_UNKNOWN;
+    #if DISPLAY_CACHE_ENABLED
+    drawStatusCached(frame.temperatureUnit, fileName, frame.logInterval, batteryMinutes);
+    #else
+    drawStatus(frame.temperatureUnit, fileName, frame.logInterval, batteryMinutes);
+    #endif
+    drawBattery(frame.bStatus, frame.batteryLevel);
+  }
+  break;
+
+  case READINGS_PAGE:
+    drawReadingsRow(frame.graphChannel);
+    break;
+
+  } // End of select(page)
 
-  
   return;
 }
 
+void drawStart(
+  uint8_t graphChannel,
+  uint8_t temperatureUnit,
+  char* fileName,
+  uint8_t logInterval,
+  ChargeStatus::State bStatus,
+  uint8_t batteryLevel,
+  uint16_t batteryMinutes
+  ) {
+
+  frame.graphChannel = graphChannel;
+  frame.temperatureUnit = temperatureUnit;
+  frame.logInterval = logInterval;
+  frame.bStatus = bStatus;
+  frame.batteryLevel = batteryLevel;
+  frame.batteryMinutes = batteryMinutes;
+
+  // The name may live in a buffer that changes before the status bar is drawn
+  frame.logging = (fileName != NULL);
+  if(fileName != NULL) {
+    strncpy(frame.fileName, fileName, sizeof(frame.fileName) - 1);
+    frame.fileName[sizeof(frame.fileName) - 1] = 0;
+  }
+
+  // Pick the unit once per frame rather than once per point
+  switch(temperatureUnit){
+  case TEMPERATURE_UNITS_F: frame.drawPoints = drawGraphPoints<TEMPERATURE_UNITS_F>; break;
+  case TEMPERATURE_UNITS_K: frame.drawPoints = drawGraphPoints<TEMPERATURE_UNITS_K>; break;
+  default:                  frame.drawPoints = drawGraphPoints<TEMPERATURE_UNITS_C>; break;
+  }
+
+  #if STATS_ENABLED
+  // Work the statistics out once, not for every page
+  frame.statsPage = (graphChannel >= GRAPH_STATS_VIEW);
+  frame.statsValid = 0;
+  if(frame.statsPage) {
+    for(uint8_t cell = 0; cell < SENSOR_BANK_SIZE; cell++) {
+      uint8_t sensor = graphBank(graphChannel)*SENSOR_BANK_SIZE + cell;
+      if(sensor < SENSOR_COUNT && Stats::get(sensor, &frame.summaries[cell])) frame.statsValid |= _BV(cell);
+    }
+  }
+  #endif
+
+  // A frame that was still being sent is dropped, this one draws every page
+  Instrument::lcdFrameBegin();
+  u8g.firstPage();
+  frame.page = 0;
+  frame.pending = true;
+
+  return;
+}
+
+bool drawTask()
+{
+  bool more;
+
+  if(!frame.pending) return false;
+
+  Instrument::lcdStepBegin();
+
+  // Draw the page, then sendPage() sends it and clears the buffer for the next
+  drawPage(frame.page);
+  Timing::injectLcd();
+  frame.page++;
+  more = sendPage();
+
+  Instrument::lcdStepEnd(!more);
+  Instrument::countLcdPages(1);
+
+  frame.pending = more;
+  return more;
+}
+
+bool drawing()
+{
+  return frame.pending;
+}
+
+void draw(
+  uint8_t graphChannel,
+  uint8_t temperatureUnit,
+  char* fileName,
+  uint8_t logInterval,
+  ChargeStatus::State bStatus,
+  uint8_t batteryLevel,
+  uint16_t batteryMinutes
+  ) {
+
+  drawStart(graphChannel, temperatureUnit, fileName, logInterval,
+            bStatus, batteryLevel, batteryMinutes);
+  while(drawTask());
+
+  return;
+}
+
+#if LIVE_READINGS_ENABLED
+void drawReadings(uint8_t graphChannel)
+{
+  // u8glib only draws whole frames. Start one, then move the page buffer
+  // straight to the readings page. nextPage() sends that page and, as it is
+  // the last one, ends the frame. The other pages keep what the LCD shows.
+  u8g_t* u = u8g.getU8g();
+  u8g_pb_t* pb = pageBuffer();
+
+  frame.pending = false;
+  u8g.firstPage();
+  pb->p.page = READINGS_PAGE;
+  pb->p.page_y0 = READINGS_PAGE*pb->p.page_height;
+  pb->p.page_y1 = pb->p.page_y0 + pb->p.page_height - 1;
+  u8g_call_dev_fn(u, u->dev, U8G_DEV_MSG_GET_PAGE_BOX, &u->current_page);
+
+  do {
+    drawReadingsRow(graphChannel);
+  } while( sendPage() );
+
+  Instrument::countLcdPages(1);
+
+  return;
+}
+#endif
+
 void clear() {
   // Clear the screen
+  frame.pending = false;
   u8g.firstPage();  
-  while( u8g.nextPage() );
+  while( sendPage() );
 
   return;
 }
@@ -571,24 +1047,56 @@ int16_t microvolts_to_celcius(int32_t microVolts)
 }
 
 namespace ChargeStatus {
-  
-void setup() {
-  // Set VBAT_EN high to enable VBAT_SENSE readings
-  pinMode(VBAT_EN, OUTPUT);
-  digitalWrite(VBAT_EN, HIGH);
 
-  // Configure the batt stat pin as an input
-//  analogReference(DEFAULT);
-  pinMode(BATT_STAT, INPUT);
-  pinMode(VBAT_SENSE, INPUT);  
+#define BATT_CHARGING_COUNTS_MAX  217 // 1024/3.3*.7
+#define BATT_DISCONNECTED_COUNTS_MIN 248 // 1024/3.3*.8
+#define BATT_DISCONNECTED_COUNTS_MAX 372 // 1024/3.3*.1.2
+
+// VBAT_SENSE_V= 34 × VBAT/(34 + 18.7)
+// VBAT_SENSE_COUNTS = VBAT_SENSE_V / 3.3 * 1024
+#define VBAT_SENSE_FULL 820   // 4.1V
+#define VBAT_SENSE_EMPTY 720  // 3.6V
+
+#define STATE_DEBOUNCE_SAMPLES  3     // Samples a new state must be seen for before it is reported
+#define VBAT_FILTER_SHIFT       4     // Battery voltage is filtered in 1/16 counts
+#define VBAT_LEVEL_HYSTERESIS   (2<<VBAT_FILTER_SHIFT)  // 2 counts (~13mV) either side of a bar boundary
+#define RATE_WINDOW_SECONDS     300   // Seconds between discharge rate updates
+
+// Which input the ADC is converting
+enum {
+  PHASE_IDLE,
+  PHASE_BATT_STAT,
+  PHASE_VBAT_SENSE,
+};
 
-  // enable the VBUS pad
-  USBCON |= (1<<OTGPADE);
+volatile uint8_t phase = PHASE_IDLE;
+
+// Published snapshot, written only from the ADC interrupt
+volatile State state = DISCHARGING;
+volatile uint8_t batteryLevel = 0;
+volatile uint16_t vbatFiltered = 0;     // VBAT_SENSE counts << VBAT_FILTER_SHIFT
+volatile uint16_t dischargeRate = 0;    // Drop in vbatFiltered per RATE_WINDOW_SECONDS, 0 = unknown
+
+uint16_t battStatCounts;
+State pendingState;
+uint8_t pendingCount = 0;
+bool firstSample = true;
 
+uint16_t rateSeconds = 0;
+uint16_t rateReference = 0;             // vbatFiltered at the start of the window, 0 = none
+
+static void startConversion(uint8_t channel)
+{
+  // Channels 8-13 are selected with MUX5
+  if(channel & 0x08) ADCSRB |= _BV(MUX5);
+  else ADCSRB &= ~_BV(MUX5);
+  ADMUX = _BV(REFS0) | (channel & 0x07);  // AVcc reference
+  ADCSRA |= _BV(ADIE) | _BV(ADSC);
   return;
 }
 
-State get() {
+static State measureState()
+{
   // We want to output one of these states:
 //   DISCHARGING = 0,    // VBUS=0
 //   CHARGING = 1,       // VBUS=1, BATT_STAT<.7V
@@ -597,12 +1105,6 @@ State get() {
 
   bool usbConnected = USBSTA & _BV(VBUS);
 
-  uint16_t battStatCounts = analogRead(BATT_STAT);
-  
-  #define BATT_CHARGING_COUNTS_MAX  217 // 1024/3.3*.7
-  #define BATT_DISCONNECTED_COUNTS_MIN 248 // 1024/3.3*.8
-  #define BATT_DISCONNECTED_COUNTS_MAX 372 // 1024/3.3*.1.2
-
   if(!usbConnected) {
     return DISCHARGING;
   }
@@ -618,27 +1120,147 @@ State get() {
   return CHARGED;
 }
 
-uint8_t getBatteryLevel()
+static uint8_t levelFor(uint16_t filtered)
 {
-
-  // VBAT_SENSE_V= 34 × VBAT/(34 + 18.7)
-  // VBAT_SENSE_COUNTS = VBAT_SENSE_V / 3.3 * 1024
-  
-  #define VBAT_SENSE_FULL 820   // 4.1V
-  #define VBAT_SENSE_EMPTY 720  // 3.6V
-  
   // Note: We'll divide this into 5 sections so that the user gets a full battery for a little bit.
-  uint16_t vbatSenseCounts;
-  
-  vbatSenseCounts = analogRead(VBAT_SENSE);
+  uint16_t counts = filtered >> VBAT_FILTER_SHIFT;
 
   // Prevent wrap, if <= lowest level just return 0 bars
-  if(vbatSenseCounts<=VBAT_SENSE_EMPTY) return 0;
+  if(counts<=VBAT_SENSE_EMPTY) return 0;
+
+  uint8_t level = ((counts - VBAT_SENSE_EMPTY)*5)/(VBAT_SENSE_FULL - VBAT_SENSE_EMPTY);
+
+  return level<5?level:4;
+}
+
+// Fold a new pair of readings into the published state
+static void update(uint16_t vbatCounts)
+{
+  State measured = measureState();
+  uint16_t vbat = vbatCounts << VBAT_FILTER_SHIFT;
+
+  if(firstSample) {
+    firstSample = false;
+    state = measured;
+    pendingState = measured;
+    vbatFiltered = vbat;
+    batteryLevel = levelFor(vbat);
+    return;
+  }
+
+  // Debounce the charge state
+  if(measured != pendingState) {
+    pendingState = measured;
+    pendingCount = 0;
+  }else if(measured != state && ++pendingCount >= STATE_DEBOUNCE_SAMPLES) {
+    state = measured;
+    // The discharge rate only means something for an uninterrupted discharge
+    rateSeconds = 0;
+    rateReference = 0;
+    dischargeRate = 0;
+  }
+
+  // Low pass the battery voltage, 1/8 of each new reading
+  vbatFiltered = vbatFiltered - (vbatFiltered >> 3) + (vbat >> 3);
+
+  // Only move a bar once the voltage is clear of the boundary
+  uint8_t up = levelFor(vbatFiltered - VBAT_LEVEL_HYSTERESIS);
+  uint8_t down = levelFor(vbatFiltered + VBAT_LEVEL_HYSTERESIS);
+  if(up > batteryLevel) batteryLevel = up;
+  else if(down < batteryLevel) batteryLevel = down;
+
+  // Track how fast the battery is dropping
+  if(state == DISCHARGING && ++rateSeconds >= RATE_WINDOW_SECONDS) {
+    rateSeconds = 0;
+    if(rateReference != 0) {
+      uint16_t drop = 0;
+      if(rateReference > vbatFiltered) drop = rateReference - vbatFiltered;
+      if(dischargeRate == 0) dischargeRate = drop;
+      else dischargeRate = (dischargeRate*3 + drop)/4;
+    }
+    rateReference = vbatFiltered;
+  }
+  return;
+}
 
-  uint8_t batteryLevel = ((vbatSenseCounts - VBAT_SENSE_EMPTY)*5)/(VBAT_SENSE_FULL - VBAT_SENSE_EMPTY);
+void setup() {
+  // Set VBAT_EN high to enable VBAT_SENSE readings
+  pinMode(VBAT_EN, OUTPUT);
+  digitalWrite(VBAT_EN, HIGH);
+
+  // Configure the batt stat pin as an input
+//  analogReference(DEFAULT);
+  pinMode(BATT_STAT, INPUT);
+  pinMode(VBAT_SENSE, INPUT);  
+
+  // enable the VBUS pad
+  USBCON |= (1<<OTGPADE);
+
+  // Take the first reading now so the state is valid before the first draw()
+  sample();
+  while(sampling()) {};
+
+  return;
+}
+
+void sample() {
+  // If a conversion was lost (ex: we went to sleep under it), start over
+  phase = PHASE_BATT_STAT;
+  startConversion(BATT_STAT_ADC_CHANNEL);
+  return;
+}
 
-  return batteryLevel<5?batteryLevel:4;
+bool sampling() {
+  return phase != PHASE_IDLE;
+}
 
+State get() {
+  return state;
 }
 
+uint8_t getBatteryLevel() {
+  return batteryLevel;
+}
+
+uint16_t getRemainingMinutes()
+{
+  uint16_t filtered;
+  uint16_t rate;
+
+  noInterrupts();
+  filtered = vbatFiltered;
+  rate = dischargeRate;
+  interrupts();
+
+  if(state != DISCHARGING || rate == 0) return RUNTIME_UNKNOWN;
+
+  if(filtered <= (VBAT_SENSE_EMPTY << VBAT_FILTER_SHIFT)) return 0;
+
+  // Linear extrapolation down to VBAT_SENSE_EMPTY
+  uint32_t minutes = (uint32_t)(filtered - (VBAT_SENSE_EMPTY << VBAT_FILTER_SHIFT))
+                     * (RATE_WINDOW_SECONDS/60) / rate;
+  if(minutes >= RUNTIME_UNKNOWN) minutes = RUNTIME_UNKNOWN - 1;
+  return (uint16_t)minutes;
+}
+
+}
+
+// ADC conversion complete, step through BATT_STAT then VBAT_SENSE
+ISR(ADC_vect)
+{
+  uint16_t counts = ADC;
+
+  switch(ChargeStatus::phase) {
+  case ChargeStatus::PHASE_BATT_STAT:
+    ChargeStatus::battStatCounts = counts;
+    ChargeStatus::phase = ChargeStatus::PHASE_VBAT_SENSE;
+    ChargeStatus::startConversion(VBAT_SENSE_ADC_CHANNEL);
+    break;
+  case ChargeStatus::PHASE_VBAT_SENSE:
+    ChargeStatus::phase = ChargeStatus::PHASE_IDLE;
+    ChargeStatus::update(counts);
+    break;
+  default: break;
+  }
+  return;
 }
@@ -2,6 +2,7 @@
 #define FUNCTIONS_H
 
 #include "t400.h"
+#include "instrument.h"
 
 // Number of intervals in the graph
 #define GRAPH_INTERVALS 5
@@ -17,13 +18,27 @@ namespace ChargeStatus {
      NO_BATTERY = 3,     // VBUS=1, BATT_STAT=1, VBATT_SENSE=?
   };
   
+  // Returned by getRemainingMinutes() when there is no estimate yet
+  #define RUNTIME_UNKNOWN   0xFFFF
+
+  // Start a background measurement of BATT_STAT and VBAT_SENSE. Call this once
+  // a second; the ADC interrupt picks up the results and updates the cached state.
+  void sample();
+
+  // True while a background measurement is still converting
+  bool sampling();
+
   // Get the battery status
-  // @return 
+  // @return Debounced state from the last measurements
   State get();
   
   // Get a measurement of the battery leve
   // @return 0 = empty, 4= full
   uint8_t getBatteryLevel();
+
+  // Estimate how long the battery will last at the current discharge rate
+  // @return Minutes remaining, or RUNTIME_UNKNOWN if not discharging or not yet known
+  uint16_t getRemainingMinutes();
 }
 
 
@@ -40,24 +55,66 @@ namespace Backlight {
     else {
       digitalWrite(LCD_BACKLIGHT_PIN, HIGH);
     }
+    Instrument::setLoad(Instrument::LOAD_BACKLIGHT, level > 0);
   }
 
 }
 
 
+// Print a value in 1/10 units as "-12.3", without padding
+// @param buf Buffer of at least 8 characters
+// @return buf
+char* printTenths(char* buf, int16_t value);
+
 void resetGraph();
 void updateGraphData(int16_t* temperatures);
-void updateGraphScaling();
+void updateGraphScaling(uint8_t graphChannel);
 
 void setupDisplay();
 
+// Put the display controller to sleep, or wake it up
+void displaySleep(bool sleep);
+
+// Draw a whole frame, waiting for every page to be sent
 void draw(uint8_t graphChannel,
         uint8_t temperatureUnit,
         char* fileName,
         uint8_t logInterval,
         ChargeStatus::State bStatus,
-        uint8_t batteryLevel);
+        uint8_t batteryLevel,
+        uint16_t batteryMinutes);
+
+// Start a frame that drawTask() sends a page at a time, so loop() keeps
+// running between pages. Takes the same inputs as draw(), and drops any
+// frame that was still being sent.
+void drawStart(uint8_t graphChannel,
+        uint8_t temperatureUnit,
+        char* fileName,
+        uint8_t logInterval,
+        ChargeStatus::State bStatus,
+        uint8_t batteryLevel,
+        uint16_t batteryMinutes);
+
+// Draw and send the next page of the frame. Call from loop().
+// @return True while the frame has pages left
+bool drawTask();
+
+// @return True while a frame is part way through being sent
+bool drawing();
   
+#if LIVE_READINGS_ENABLED
+// Redraw just the readings row from the latest conversions, leaving the
+// graph and status bar as they are. Costs one page instead of a frame.
+void drawReadings(uint8_t graphChannel);
+#endif
+
+#if DISPLAY_CACHE_ENABLED
+// Forget the cached status bar and axis, so the next frame draws them in
+// full. Their inputs are checked on every frame, so this is only needed to
+// measure what a frame costs without the cache.
+void resetDisplayCache();
+#endif
+
 void clear();
 
 // Converts the junction temperature into a voltage for offset
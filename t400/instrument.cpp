@@ -0,0 +1,215 @@
+#include <Arduino.h>
+#include <avr/sleep.h>
+#include "t400.h"
+#include "energy.h"
+#include "instrument.h"
+#include "serial_out.h"
+#include "bus.h"
+
+#if INSTRUMENTATION_ENABLED
+
+namespace Instrument {
+
+EnergyCounters energy;
+const char* modeName = "";
+
+uint8_t loads = 0;
+volatile bool reportDue = false;
+uint8_t reportSeconds = 0;
+
+uint32_t awakeSinceUs;        // micros() when we last woke up
+uint32_t sleepStartUs;
+uint8_t sleepMode;
+uint16_t activeUs = 0;        // Sub-millisecond remainders
+uint16_t idleUs = 0;
+
+uint16_t deadChannels = 0;    // Bit per channel being skipped
+uint32_t channelSkips = 0;    // Conversion slots given to another channel
+uint32_t channelReprobes = 0; // Slots given to a dead channel to see if it came back
+
+uint32_t lcdStepStartUs;
+uint32_t lcdFrameUs = 0;      // Frame being sent: all its pages
+uint16_t lcdStepMaxUs = 0;    // and the longest one
+uint32_t lcdLastFrameUs = 0;  // The same for the last whole frame
+uint16_t lcdLastStepMaxUs = 0;
+
+uint32_t busStartUs;
+uint8_t busDevice;
+uint32_t busUs[Bus::DEVICE_COUNT];        // Time each device held the bus since the last report
+uint16_t busTransactions[Bus::DEVICE_COUNT];
+uint16_t busWaits = 0;                    // Passes the display was held back
+
+uint16_t firstSampleMs = 0;   // millis() at the first sample after power up, 0 = not yet
+bool firstSampleReported = false;
+
+static void addTime(uint32_t* ms, uint16_t* us, uint32_t delta)
+{
+  delta += *us;
+  *ms += delta/1000;
+  *us = delta%1000;
+  return;
+}
+
+void tick()
+{
+  energy.seconds++;
+  if(loads & LOAD_LCD) energy.lcdOnSeconds++;
+  if(loads & LOAD_BACKLIGHT) energy.backlightOnSeconds++;
+
+  if(++reportSeconds >= INSTRUMENT_REPORT_SECONDS) {
+    reportSeconds = 0;
+    reportDue = true;
+  }
+  return;
+}
+
+void setLoad(uint8_t load, bool on)
+{
+  if(on) loads |= load;
+  else loads &= ~load;
+  return;
+}
+
+void setMode(const char* name)
+{
+  if(name == modeName) return;
+
+  noInterrupts();
+  memset(&energy, 0, sizeof(energy));
+  interrupts();
+  modeName = name;
+  return;
+}
+
+void sleepBegin(uint8_t mode)
+{
+  sleepStartUs = micros();
+  addTime(&energy.activeMs, &activeUs, sleepStartUs - awakeSinceUs);
+  sleepMode = mode;
+  return;
+}
+
+void sleepEnd()
+{
+  awakeSinceUs = micros();
+  // Timer 0 keeps running in idle, so micros() covers the time asleep. In power
+  // down it stops, and that time is whatever is left over at report time.
+  if(sleepMode == SLEEP_MODE_IDLE) {
+    addTime(&energy.idleMs, &idleUs, awakeSinceUs - sleepStartUs);
+  }
+  return;
+}
+
+void countAdcConversion() { energy.adcConversions++; }
+void countI2c(uint8_t transactions) { energy.i2cTransactions += transactions; }
+void countSdBlocks(uint8_t blocks) { energy.sdBlocks += blocks; }
+void countLcdPages(uint8_t pages) { energy.lcdPages += pages; }
+
+void lcdFrameBegin()
+{
+  lcdFrameUs = 0;
+  lcdStepMaxUs = 0;
+  return;
+}
+
+void lcdStepBegin() { lcdStepStartUs = micros(); }
+
+void lcdStepEnd(bool frameDone)
+{
+  uint32_t us = micros() - lcdStepStartUs;
+
+  lcdFrameUs += us;
+  if(us > lcdStepMaxUs) lcdStepMaxUs = (us > 0xFFFF) ? 0xFFFF : us;
+  if(frameDone) {
+    lcdLastFrameUs = lcdFrameUs;
+    lcdLastStepMaxUs = lcdStepMaxUs;
+  }
+  return;
+}
+
+void busBegin(uint8_t device)
+{
+  busDevice = device;
+  busStartUs = micros();
+  return;
+}
+
+void busEnd()
+{
+  busUs[busDevice] += micros() - busStartUs;
+  busTransactions[busDevice]++;
+  return;
+}
+
+void countBusWait() { busWaits++; }
+
+void setChannelDead(uint8_t sensor, bool dead)
+{
+  uint16_t bit = (uint16_t)1 << sensor;
+
+  if(dead) deadChannels |= bit;
+  else deadChannels &= ~bit;
+  return;
+}
+
+void firstSample() { firstSampleMs = millis(); }
+
+void countChannelSkip() { channelSkips++; }
+void countChannelReprobe() { channelReprobes++; }
+
+void task()
+{
+  EnergyCounters snapshot;
+  char buf[48];
+
+  // Boot to first sample latency, reported straight away
+  if(firstSampleMs != 0 && !firstSampleReported) {
+    firstSampleReported = true;
+    sprintf(buf, "# boot first sample %u ms", firstSampleMs);
+    SerialOut::port.println(buf);
+  }
+
+  if(!reportDue) return;
+  reportDue = false;
+
+  noInterrupts();
+  snapshot = energy;
+  interrupts();
+
+  SerialOut::port.print("# energy ");
+  SerialOut::port.print(modeName);
+  sprintf(buf, " t=%lu act=%lu idle=%lu", snapshot.seconds, snapshot.activeMs, snapshot.idleMs);
+  SerialOut::port.println(buf);
+  sprintf(buf, "# adc=%lu i2c=%lu sd=%lu lcd=%lu", snapshot.adcConversions,
+          snapshot.i2cTransactions, snapshot.sdBlocks, snapshot.lcdPages);
+  SerialOut::port.println(buf);
+  sprintf(buf, "# on lcd=%lu bl=%lu", snapshot.lcdOnSeconds, snapshot.backlightOnSeconds);
+  SerialOut::port.println(buf);
+  sprintf(buf, "# avg_uA=%lu life_h=%lu", energyAverageMicroamps(snapshot),
+          energyProjectedHours(snapshot));
+  SerialOut::port.println(buf);
+
+  // Time loop() waits for the display, per page, against a whole frame
+  if(lcdLastFrameUs != 0) {
+    sprintf(buf, "# lcd frame=%lu us page=%u us", lcdLastFrameUs, lcdLastStepMaxUs);
+    SerialOut::port.println(buf);
+  }
+
+  // Bus occupancy over the report period, in ms and transactions
+  sprintf(buf, "# bus sd=%lu/%u lcd=%lu/%u wait=%u",
+          busUs[Bus::DEVICE_SD]/1000, busTransactions[Bus::DEVICE_SD],
+          busUs[Bus::DEVICE_LCD]/1000, busTransactions[Bus::DEVICE_LCD], busWaits);
+  SerialOut::port.println(buf);
+  memset(busUs, 0, sizeof(busUs));
+  memset(busTransactions, 0, sizeof(busTransactions));
+  busWaits = 0;
+
+  sprintf(buf, "# sched dead=%04x skip=%lu probe=%lu", deadChannels,
+          channelSkips, channelReprobes);
+  SerialOut::port.println(buf);
+  return;
+}
+
+}
+
+#endif
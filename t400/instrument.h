@@ -0,0 +1,91 @@
+/*
+ * Debug counters, reported over serial as lines starting with '#'
+ */
+
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+#include <Arduino.h>
+#include "t400.h"
+
+namespace Instrument {
+
+// Loads that are on for whole seconds at a time
+enum Load {
+  LOAD_LCD = 0x01,
+  LOAD_BACKLIGHT = 0x02,
+};
+
+#if INSTRUMENTATION_ENABLED
+
+// Count one second of wall time. Call from the 1 Hz RTC interrupt.
+void tick();
+
+// Set whether a load is currently on
+void setLoad(uint8_t load, bool on);
+
+// Start counting a new mode, so each report covers a single mode
+// @param name Mode name for the report
+void setMode(const char* name);
+
+// Bracket a sleep so the time awake and asleep can be told apart
+// @param mode Sleep mode about to be entered
+void sleepBegin(uint8_t mode);
+void sleepEnd();
+
+void countAdcConversion();
+void countI2c(uint8_t transactions);
+void countSdBlocks(uint8_t blocks);
+void countLcdPages(uint8_t pages);
+
+// Time the pages of a frame sent one per loop() pass, to see how long loop()
+// is held up by the display against the frame as a whole
+void lcdFrameBegin();
+void lcdStepBegin();
+void lcdStepEnd(bool frameDone);
+
+// Time each device holds the SPI bus, and the passes a device was held back
+// @param device Bus::Device taking the bus
+void busBegin(uint8_t device);
+void busEnd();
+void countBusWait();
+
+// Note that the first sample after power up has been taken
+void firstSample();
+
+// Channel scheduling
+void setChannelDead(uint8_t sensor, bool dead);
+void countChannelSkip();
+void countChannelReprobe();
+
+// Print a report if one is due. Call from loop().
+void task();
+
+#else
+
+inline void tick() {}
+inline void setLoad(uint8_t, bool) {}
+inline void setMode(const char*) {}
+inline void sleepBegin(uint8_t) {}
+inline void sleepEnd() {}
+inline void countAdcConversion() {}
+inline void countI2c(uint8_t) {}
+inline void countSdBlocks(uint8_t) {}
+inline void countLcdPages(uint8_t) {}
+inline void lcdFrameBegin() {}
+inline void lcdStepBegin() {}
+inline void lcdStepEnd(bool) {}
+inline void busBegin(uint8_t) {}
+inline void busEnd() {}
+inline void countBusWait() {}
+inline void firstSample() {}
+inline void setChannelDead(uint8_t, bool) {}
+inline void countChannelSkip() {}
+inline void countChannelReprobe() {}
+inline void task() {}
+
+#endif
+
+}
+
+#endif
@@ -0,0 +1,53 @@
+#include <Arduino.h>
+#include <stddef.h>
+#include <avr/eeprom.h>
+#include "t400.h"
+#include "config.h"
+#include "journal.h"
+
+#if JOURNAL_ENABLED
+
+namespace Journal {
+
+// The version byte doubles as the open flag, clearing the journal is a
+// single byte write
+struct Record {
+  uint8_t version;
+  Entry entry;
+  uint16_t crc;
+};
+
+#define JOURNAL_CLOSED      0
+
+bool load(Entry* entry)
+{
+  Record record;
+
+  eeprom_read_block(&record, (const void*)JOURNAL_EEPROM_ADDRESS, sizeof(record));
+  if(record.version != JOURNAL_VERSION) return false;
+  if(record.crc != Config::recordCrc(&record, offsetof(Record, crc))) return false;
+
+  *entry = record.entry;
+  return true;
+}
+
+void write(const Entry* entry)
+{
+  Record record;
+
+  record.version = JOURNAL_VERSION;
+  record.entry = *entry;
+  record.crc = Config::recordCrc(&record, offsetof(Record, crc));
+  eeprom_update_block(&record, (void*)JOURNAL_EEPROM_ADDRESS, sizeof(record));
+  return;
+}
+
+void clear()
+{
+  eeprom_update_byte((uint8_t*)JOURNAL_EEPROM_ADDRESS, JOURNAL_CLOSED);
+  return;
+}
+
+} // namespace Journal
+
+#endif
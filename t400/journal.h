@@ -0,0 +1,37 @@
+/*
+ * Journal of the log file being written, kept in EEPROM so logging can
+ * pick up where it left off after a watchdog reset or a brown-out
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <Arduino.h>
+#include "t400.h"
+
+namespace Journal {
+
+  struct Entry {
+    uint16_t fileIndex;       // xxxx of LDxxxx.CSV
+    uint32_t startSeconds;    // RTC time logging started, see rtcSeconds() in t400.ino
+    uint32_t committedSize;   // File size at the last commit, after a flush
+    uint32_t committedTime;   // Log time (s) of the last row at that commit
+    uint8_t logInterval;      // Index into the log interval table
+    uint8_t temperatureUnit;
+  };
+
+  // Read the journal
+  // @param entry Filled in if a session was left open
+  // @return True if logging was still running when the board reset
+  bool load(Entry* entry);
+
+  // Record the open session. The size and time only move forward every
+  // JOURNAL_COMMIT_SECONDS, so this is a handful of EEPROM writes an hour.
+  void write(const Entry* entry);
+
+  // Mark the session as closed cleanly
+  void clear();
+
+}
+
+#endif
@@ -0,0 +1,92 @@
+#include <Arduino.h>
+#include "t400.h"
+#include "memory.h"
+#include "serial_out.h"
+#include "PaxInstruments-U8glib.h"
+
+#if SD_LOGGING_ENABLED
+#include <SdFat.h>
+#endif
+
+extern U8GLIB_PI13264 u8g;
+
+// The largest users, see memory.h
+static_assert(SCRATCH_SIZE >= 12 + SENSOR_COUNT*9, "Scratch can't hold an event file row");
+static_assert(SCRATCH_SIZE >= 40, "Scratch can't hold an event file header line");
+
+#if RAM_REPORT_ENABLED
+// Set by the linker: the start of .data, the end of .bss and the top of RAM.
+// Outside the namespace, so the names aren't mangled.
+extern "C" uint8_t __data_start;
+extern "C" uint8_t __heap_start;
+extern "C" uint8_t __stack;
+#endif
+
+namespace Memory {
+
+char scratch[SCRATCH_SIZE];
+
+#if RAM_REPORT_ENABLED
+
+#define STACK_CANARY    0xC5
+
+uint16_t checkMs = 0;           // millis() of the last check
+uint16_t reportedHeadroom = 0xFFFF;
+
+// Fill the free RAM with the canary before main() runs. This is in .init3,
+// after the stack pointer is set and before .bss is cleared, so it can't
+// call anything or put anything on the stack.
+void paintStack() __attribute__((naked, used, section(".init3")));
+void paintStack()
+{
+  uint8_t* p = &__heap_start;
+
+  while(p <= &__stack) *p++ = STACK_CANARY;
+}
+
+uint16_t headroom()
+{
+  const uint8_t* p = &__heap_start;
+
+  // Nothing uses the heap, so the first byte that isn't the canary is the
+  // deepest the stack has been. A local array that was never written can
+  // leave canaries behind, so this can be a few bytes high.
+  while(p <= &__stack && *p == STACK_CANARY) p++;
+  return p - &__heap_start;
+}
+
+void task()
+{
+  uint16_t free;
+  char line[56];
+
+  if((uint16_t)millis() - checkMs < 1000) return;
+  checkMs = millis();
+
+  free = headroom();
+  if(free >= reportedHeadroom) return;
+  reportedHeadroom = free;
+
+  sprintf(line, "# ram static=%u stack=%u free=%u",
+          (uint16_t)(&__heap_start - &__data_start),
+          (uint16_t)(&__stack + 1 - &__heap_start - free), free);
+  SerialOut::port.println(line);
+
+  // The big static users. The serial ring is there without
+  // SERIAL_OUTPUT_ENABLED too, it carries the '#' reports.
+  sprintf(line, "# ram graph=%u lcd=%u scratch=%u serial=%u sd=%u",
+          (uint16_t)(GRAPH_ROWS*GRAPH_POINTS*sizeof(int16_t)), u8g.getWidth(), SCRATCH_SIZE,
+          SERIAL_TX_BUFFER,
+          #if SD_LOGGING_ENABLED
+          (uint16_t)(sizeof(SdFat) + 2*sizeof(SdFile))
+          #else
+          0
+          #endif
+          );
+  SerialOut::port.println(line);
+  return;
+}
+
+#endif
+
+} // namespace Memory
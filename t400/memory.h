@@ -0,0 +1,39 @@
+/*
+ * SRAM budget: a scratch buffer shared by short lived users, and a stack
+ * high-water mark, reported over serial as lines starting with '#'
+ */
+
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <Arduino.h>
+#include "t400.h"
+
+namespace Memory {
+
+  // Shared by code that needs a row sized buffer for a moment. The users
+  // never call each other and none run from an interrupt:
+  //   output rows, from formatOutputs() until the row is written (t400.ino)
+  //   log file header columns and the summary file (sd::startTask(), sd::close())
+  //   event file header and rows (Alarm::task())
+  extern char scratch[SCRATCH_SIZE];
+
+#if RAM_REPORT_ENABLED
+
+  // @return Bytes between the end of static data and the deepest the stack
+  //         has reached since power up
+  uint16_t headroom();
+
+  // Check the stack high-water mark about once a second, and report the
+  // RAM map whenever it goes up. Call from loop().
+  void task();
+
+#else
+
+  inline void task() {}
+
+#endif
+
+}
+
+#endif
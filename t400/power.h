@@ -4,6 +4,7 @@
 
 #include <avr/sleep.h>
 #include "t400.h"
+#include "instrument.h"
 
 #ifndef POWER_H
 #define POWER_H
@@ -20,13 +21,24 @@ namespace Power {
   }
   
   // Put the processor into sleep mode
-  inline void sleep() {
+  // @param mode Deepest sleep mode wanted. Power down is only used if nothing that
+  //        needs the clock running is active:
+  //        - INT6 must be level sensitive or BUTTON_A can't wake us (see buttons.cpp)
+  //        - Timer 1 must be stopped or the half second sample would be missed
+  //        - Timer 3 must be stopped or button debouncing would stall
+  inline void sleep(uint8_t mode = SLEEP_MODE_PWR_DOWN) {
     cli();
+    if((EICRB & 0x30) || (TCCR1B & 0x07) || (TCCR3B & 0x07)) {
+      mode = SLEEP_MODE_IDLE;
+    }
+    set_sleep_mode(mode);
+    Instrument::sleepBegin(mode);
     sleep_enable();
     sei();
     sleep_cpu();
     /* wake up here */
     sleep_disable();
+    Instrument::sleepEnd();
   }
   
   // Turn off the power to the board
@@ -0,0 +1,43 @@
+/*
+ * Formatting of the output rows written to the serial port and the log file
+ *
+ * This has no Arduino dependencies so the host tools can generate rows
+ * exactly as the logger writes them.
+ */
+
+#ifndef ROW_FORMAT_H
+#define ROW_FORMAT_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifndef OUT_OF_RANGE_INT
+#define OUT_OF_RANGE_INT        32760      // Same as t400.h, for host builds
+#endif
+
+// Format one row, eg "12, 21.5, -, -3.2". Values are in 1/10 degree and a
+// value with no reading is written as "-".
+// @param buf Buffer of at least 12 + count*9 characters
+// @param time Seconds since logging started
+// @param values Array of count values
+// @return Length of the row
+inline uint16_t formatRow(char* buf, uint32_t time, const int16_t* values, uint8_t count)
+{
+  uint16_t index = 0;
+
+  index += sprintf(&buf[index], "%lu", (unsigned long)time);
+
+  for(uint8_t i = 0; i < count; i++)
+  {
+    int16_t value = values[i];
+    uint16_t magnitude = (value < 0) ? -value : value;
+
+    if(value == OUT_OF_RANGE_INT)
+      index += sprintf(&buf[index], ", -");
+    else
+      index += sprintf(&buf[index], ", %s%u.%u", (value < 0) ? "-" : "", magnitude/10, magnitude%10);
+  }
+  return index;
+}
+
+#endif
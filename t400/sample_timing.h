@@ -0,0 +1,148 @@
+/*
+ * Sample timing statistics: how late each row is written after its tick,
+ * and how far the ticks stray from the log interval
+ *
+ * This has no Arduino dependencies so the host timing simulator records and
+ * reports exactly as the logger does.
+ */
+
+#ifndef SAMPLE_TIMING_H
+#define SAMPLE_TIMING_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// Histogram bins. Bin 0 counts times under 256 us, each bin after that is
+// twice as wide as the one before, and the last one counts everything from
+// 256 ms up.
+#define TIMING_BINS             12
+#define TIMING_BIN0_US          256
+#define TIMING_LINE_SIZE        112     // Longest report line, with its terminator
+
+struct TimingHistogram {
+  uint16_t bins[TIMING_BINS];
+};
+
+// One sample, all times in micros()
+struct SampleTimes {
+  uint32_t tickUs;        // The interrupt that asked for the sample
+  uint32_t nominalUs;     // Sample interval the tick was meant to keep
+  uint32_t adcUs;         // The last conversion read before the sample was taken
+  uint32_t noticeUs;      // loop() took the sample
+  uint32_t commitUs;      // The row was written to serial and the SD card
+};
+
+struct SampleTiming {
+  uint16_t samples;         // Recorded since the last reset
+  uint16_t intervals;       // Of those, the ones with an interval in jitter
+  bool havePrevious;        // lastTickUs can be used for the interval
+  uint32_t lastTickUs;
+  uint32_t lastNominalUs;
+  TimingHistogram latency;  // Tick to commit
+  TimingHistogram jitter;   // |interval - nominal|
+  uint32_t latencyMaxUs;
+  uint32_t dispatchMaxUs;   // Tick to loop() noticing it
+  int32_t jitterMinUs;      // Interval - nominal, negative is early
+  int32_t jitterMaxUs;
+  int32_t adcAgeMinUs;      // Tick - last conversion, negative if read after the tick
+  int32_t adcAgeMaxUs;
+};
+
+inline void timingAdd(TimingHistogram* h, uint32_t us)
+{
+  uint8_t bin = 0;
+
+  for(us /= TIMING_BIN0_US; us > 0 && bin < TIMING_BINS - 1; us >>= 1) bin++;
+  if(h->bins[bin] < 0xFFFF) h->bins[bin]++;
+  return;
+}
+
+// Clear the statistics, keeping the last tick so the next interval counts
+inline void timingReset(SampleTiming* t)
+{
+  bool havePrevious = t->havePrevious;
+  uint32_t lastTickUs = t->lastTickUs;
+  uint32_t lastNominalUs = t->lastNominalUs;
+
+  memset(t, 0, sizeof(*t));
+  t->havePrevious = havePrevious;
+  t->lastTickUs = lastTickUs;
+  t->lastNominalUs = lastNominalUs;
+  return;
+}
+
+// Forget the last tick, when the ticks have been restarted on purpose
+inline void timingRestart(SampleTiming* t)
+{
+  t->havePrevious = false;
+  return;
+}
+
+inline void timingRecord(SampleTiming* t, const SampleTimes* s)
+{
+  uint32_t latency = s->commitUs - s->tickUs;
+  uint32_t dispatch = s->noticeUs - s->tickUs;
+  int32_t adcAge = (int32_t)(s->tickUs - s->adcUs);
+
+  timingAdd(&t->latency, latency);
+  if(latency > t->latencyMaxUs) t->latencyMaxUs = latency;
+  if(dispatch > t->dispatchMaxUs) t->dispatchMaxUs = dispatch;
+  if(t->samples == 0 || adcAge < t->adcAgeMinUs) t->adcAgeMinUs = adcAge;
+  if(t->samples == 0 || adcAge > t->adcAgeMaxUs) t->adcAgeMaxUs = adcAge;
+
+  // The interval only means something between ticks at the same setting
+  if(t->havePrevious && s->nominalUs == t->lastNominalUs) {
+    int32_t error = (int32_t)(s->tickUs - t->lastTickUs - s->nominalUs);
+
+    timingAdd(&t->jitter, (error < 0) ? -error : error);
+    if(t->intervals == 0 || error < t->jitterMinUs) t->jitterMinUs = error;
+    if(t->intervals == 0 || error > t->jitterMaxUs) t->jitterMaxUs = error;
+    t->intervals++;
+  }
+  t->havePrevious = true;
+  t->lastTickUs = s->tickUs;
+  t->lastNominalUs = s->nominalUs;
+
+  t->samples++;
+  return;
+}
+
+inline uint16_t timingBins(char* buf, const TimingHistogram* h)
+{
+  uint16_t index = 0;
+
+  for(uint8_t b = 0; b < TIMING_BINS; b++) index += sprintf(&buf[index], " %u", h->bins[b]);
+  return index;
+}
+
+// Format one line of the report, eg
+//   # timing n=120 dispatch<=1840 us adc age=-12000..55000 us
+//   # latency<=9120 us: 0 0 3 ...
+//   # jitter -3960..3960 us: 0 0 ...
+// @param buf Buffer of at least TIMING_LINE_SIZE characters
+// @param line Line of the report, from 0
+// @return False once there are no more lines
+inline bool timingReportLine(const SampleTiming* t, uint8_t line, char* buf)
+{
+  uint16_t index;
+
+  switch(line) {
+  case 0:
+    sprintf(buf, "# timing n=%u dispatch<=%lu us adc age=%ld..%ld us", t->samples,
+            (unsigned long)t->dispatchMaxUs, (long)t->adcAgeMinUs, (long)t->adcAgeMaxUs);
+    return true;
+  case 1:
+    index = sprintf(buf, "# latency<=%lu us:", (unsigned long)t->latencyMaxUs);
+    timingBins(&buf[index], &t->latency);
+    return true;
+  case 2:
+    index = sprintf(buf, "# jitter %ld..%ld us:", (long)t->jitterMinUs, (long)t->jitterMaxUs);
+    timingBins(&buf[index], &t->jitter);
+    return true;
+  default:
+    return false;
+  }
+}
+
+#endif
@@ -1,6 +1,15 @@
 #include "Arduino.h"  // for boolean type
 #include "t400.h"
 #include "sd_log.h"
+#include "serial_out.h"
+#include "instrument.h"
+#include "derived.h"
+#include "stats.h"
+#include "functions.h"
+#include "memory.h"
+#include "calibration.h"
+#include "bus.h"
+#include "timing.h"
 
 #if SD_LOGGING_ENABLED
 #include <SdFat.h>
@@ -9,12 +18,19 @@
 #include <avr/wdt.h>
 
 extern uint8_t temperatureUnit;
+#if SAMPLE_ALIGNMENT_ENABLED
+extern uint16_t rowSkewMs;
+extern uint16_t rowResidualSkewMs;
+extern uint8_t rowChannels;
+extern uint8_t rowAlignedChannels;
+#endif
 
 namespace sd {
 
 #if SD_LOGGING_ENABLED
 SdFat sd;
 SdFile file;
+SdFile eventFile;
 #endif
 
 uint32_t syncTime      = 0;     // time of last sync(), in millis()
@@ -131,131 +147,455 @@ bool find_filename(uint8_t * dirid_ptr, uint8_t * fileid_ptr)
 }
 #endif
 
-void init() {
-  close();
-  #if SD_LOGGING_ENABLED
-  if (!sd.begin(SD_CS, SPI_FULL_SPEED)) {
-//    error_P("card.init");
-    return;
+StartState startState = START_IDLE;
+char* startFileName;            // Buffer the file name is searched in
+uint16_t searchIndex;           // Last LDxxxx number probed
+uint8_t searchStep;             // Probe stride, 10 for the coarse pass then 1
+uint32_t resumeSize;            // Smallest size a resumed file may have
+uint32_t resumeEnd;             // End of the last whole row found after resumeSize
+#if LOG_ROTATION_ENABLED
+uint32_t eraseBlock;            // Next block of the part to erase, 0 before the range is looked up
+uint32_t eraseLast;             // Last block of the part
+#endif
+#if LOG_ROTATION_ENABLED
+uint16_t previousPart = 0;      // LDxxxx number this part continues, 0 for the first part
+#endif
+
+#if SAMPLE_ALIGNMENT_ENABLED
+uint16_t headerSkew;            // Channel skew of the last row, written to the header
+uint16_t headerResidualSkew;    // and what was left of it after alignment
+uint8_t headerChannels;
+uint8_t headerAlignedChannels;
+#endif
+uint8_t echoLine;               // Next header line to copy to the serial port
+
+// Print one line of the data header
+// @param out The log file or the serial port
+// @param line Line of the header, from 0
+// @param serial True for the serial copy, which also gives the firmware
+//        version and the file name
+// @return False once there are no more lines
+static bool printHeaderLine(Print* out, uint8_t line, bool serial)
+{
+  uint8_t n = 0;
+
+  #if LOG_ROTATION_ENABLED
+  // Which file the session started in, and how it got here
+  if(previousPart != 0 && line == n++) {
+    sprintf(Memory::scratch, "# continued from LD%04u.CSV", previousPart);
+    out->println(Memory::scratch);
+    return true;
   }
   #endif
+
+  if(serial && line == n++) {
+    out->print("v");
+    out->println(FIRMWARE_VERSION);
+    return true;
+  }
+  if(serial && line == n++) {
+    out->print("File: ");
+    out->println(startFileName);
+    return true;
+  }
+
+  #if SAMPLE_ALIGNMENT_ENABLED
+  // How far apart the channels of a row were, and still are after the
+  // channels that could be were moved to the sample time
+  if(line == n++) {
+    out->print("# channel skew ");
+    out->print(headerSkew, DEC);
+    out->print(" ms, ");
+    out->print(headerResidualSkew, DEC);
+    out->print(" ms after aligning ");
+    out->print(headerAlignedChannels, DEC);
+    out->print(" of ");
+    out->print(headerChannels, DEC);
+    out->println(" channels");
+    return true;
+  }
+  #endif
+
+  // The calibration each channel was logged with
+  if(line >= n && line < n + SENSOR_COUNT) {
+    out->println(Calibration::describe(Memory::scratch, line - n));
+    return true;
+  }
+  n += SENSOR_COUNT;
+
+  if(line != n) return false;
+
+  // The columns
+  out->print("time (s)");
+  for (uint8_t i = 0; i < SENSOR_COUNT; i++) {
+    out->print(", temp_");
+    out->print(i, DEC);
+
+    switch(temperatureUnit) {
+    case TEMPERATURE_UNITS_C:
+      out->print(" (C)");
+      break;
+    case TEMPERATURE_UNITS_F:
+      out->print(" (F)");
+      break;
+    case TEMPERATURE_UNITS_K:
+      out->print(" (K)");
+      break;
+    }
+  }
+
+  #if DERIVED_LOGGING_ENABLED && DERIVED_CHANNELS_ENABLED
+  // Derived channels, eg ", T1-T2 (C)" or ", dT1/dt (C/min)"
+  for (uint8_t i = 0; i < DERIVED_COUNT; i++) {
+    char* column = Memory::scratch;
+    char name[8];
+    sprintf(column, ", %s (%c%s)", Derived::name(name, i),
+            "CFK"[temperatureUnit], Derived::isRate(i) ? "/min" : "");
+    out->print(column);
+  }
+  #endif
+
+  out->println();
+  return true;
 }
 
-bool open(char* fileName)
+// Write the data header to the file. The serial copy follows a line per
+// pass in START_ECHO, so the transmit ring never has to hold all of it.
+static bool writeHeader()
 {
-  // Create LDxxxx.CSV for the lowest value of x.
+  #if SAMPLE_ALIGNMENT_ENABLED
+  headerSkew = rowSkewMs;
+  headerResidualSkew = rowResidualSkewMs;
+  headerChannels = rowChannels;
+  headerAlignedChannels = rowAlignedChannels;
+  #endif
+  echoLine = 0;
 
   #if SD_LOGGING_ENABLED
-
-  uint16_t i = 0;
-  // NOTE: Could jump by 100 here, take up like 60 bytes of flash
-#if 0
-  do{
-      i+=100;
-      sprintf(fileName,"LD%04d.CSV",i);
-  }while(sd.exists(fileName));
-  // We now know that value doesn't exist, go back 100 and search from here
-  i-=100;
-#endif
-  do{
-      i+=10;
-      sprintf(fileName,"LD%04d.CSV",i);
-      // This could take a while, so reset the watchdog here
-      wdt_reset();
-  }while(sd.exists(fileName));
-  // We now know that value doesn't exist, go back 10 and search from here
-  i-=10;
-  do{
-      i+=1;
-      sprintf(fileName,"LD%04d.CSV",i);
-  }while(sd.exists(fileName));
-
-  if(!file.open(fileName, O_CREAT | O_WRITE | O_EXCL)) {
-//    error_P("file open");
-    return false;
-  }
   file.clearWriteError();
+  for(uint8_t line = 0; printHeaderLine(&file, line, false); line++);
+  file.flush();
 
-  // write data header
-  file.print("time (s)");
+  return (file.getWriteError() == false);
+  #else
+    return true;
+  #endif
+}
 
+void start(char* fileName)
+{
+  close();
+  startFileName = fileName;
+  searchIndex = 0;
+  searchStep = 10;
+  resumeSize = 0;
+  #if LOG_ROTATION_ENABLED
+  previousPart = 0;
   #endif
-  #if SERIAL_OUTPUT_ENABLED
-  Serial.print("v");
-  Serial.println(FIRMWARE_VERSION);
+  startState = START_INIT;
+  return;
+}
 
-  Serial.print("File: ");
-  Serial.println(fileName);
-  Serial.print("time (s)");
+void resume(char* fileName, uint32_t committedSize)
+{
+  start(fileName);
+  // Any nonzero size marks a resume, a journal is only written after the header
+  resumeSize = committedSize;
+  return;
+}
+
+#if SD_LOGGING_ENABLED
+// Create the log file, preallocated to a whole part if rotation is enabled
+static bool createFile()
+{
+  #if LOG_ROTATION_ENABLED
+  // Take the part in one run of clusters, so appending never has to grow the
+  // cluster chain. Without a free run that long, the file is created empty
+  // and grows as it is written.
+  if(file.createContiguous(sd.vwd(), startFileName, LOG_PART_BYTES) || file.isOpen()) return true;
   #endif
+  return file.open(startFileName, O_CREAT | O_WRITE | O_EXCL);
+}
+#endif
 
-  for (uint8_t i = 0; i < SENSOR_COUNT; i++) {
-    #if SD_LOGGING_ENABLED
-    file.print(", temp_");
-    file.print(i, DEC);
-    #endif
+StartState startTask()
+{
+  // The serial copy of the header doesn't touch the card
+  if(startState == START_ECHO) {
     #if SERIAL_OUTPUT_ENABLED
-    Serial.print(", temp_");
-    Serial.print(i, DEC);
+    if(printHeaderLine(&SerialOut::port, echoLine, true)) {
+      echoLine++;
+      return startState;
+    }
     #endif
+    startState = START_DONE;
+    return startState;
+  }
 
-    switch(temperatureUnit) {
-    case TEMPERATURE_UNITS_C:
-      #if SD_LOGGING_ENABLED
-      file.print(" (C)");
-      #endif
-      #if SERIAL_OUTPUT_ENABLED
-      Serial.print(" (C)");
-      #endif
+  Bus::begin(Bus::DEVICE_SD);
+
+  // Each case does at most one SD operation, so loop() keeps running in between
+  switch(startState) {
+  case START_INIT:
+    #if SD_LOGGING_ENABLED
+    // This is the longest single step, card init can take ~100ms. Don't
+    // reset the card under an open event file.
+    if (!eventFile.isOpen() && !sd.begin(SD_CS, SPI_FULL_SPEED)) {
+      startState = START_FAILED;
       break;
-    case TEMPERATURE_UNITS_F:
-      #if SD_LOGGING_ENABLED
-      file.print(" (F)");
-      #endif
-      #if SERIAL_OUTPUT_ENABLED
-      Serial.print(" (F)");
-      #endif
+    }
+    #endif
+    startState = resumeSize ? START_REOPEN : START_SEARCH;
+    break;
+
+  case START_REOPEN:
+    #if SD_LOGGING_ENABLED
+    if(!file.open(startFileName, O_RDWR) || file.fileSize() < resumeSize) {
+      file.close();
+      startState = START_FAILED;
       break;
-    case TEMPERATURE_UNITS_K:
-      #if SD_LOGGING_ENABLED
-      file.print(" (K)");
-      #endif
-      #if SERIAL_OUTPUT_ENABLED
-      Serial.print(" (K)");
-      #endif
+    }
+    file.seekSet(resumeSize);
+    #endif
+    resumeEnd = resumeSize;
+    startState = START_SCAN;
+    break;
+
+  case START_SCAN:
+    // Rows flushed after the last commit are kept up to the last whole line.
+    // After that comes a row torn by the reset, then the end of the file or
+    // the erased end of a preallocated part. One block per step.
+    #if SD_LOGGING_ENABLED
+    for(uint16_t i = 0; i < 512; i++) {
+      int16_t c = file.read();
+      if(c == '\n') resumeEnd = file.curPosition();
+      if(c >= 0 && c != 0x00 && c != 0xFF) continue;
+
+      // Cut the file back to the line. A preallocated part gives up its
+      // erased end too and grows row by row from here, so it is never left
+      // with a 0x00 or 0xFF tail if the board resets again.
+      file.truncate(resumeEnd);
+      file.seekSet(resumeEnd);
+      file.clearWriteError();
+      startState = START_DONE;
+      break;
+    }
+    #else
+    startState = START_DONE;
+    #endif
+    break;
+
+  case START_SEARCH:
+    // Create LDxxxx.CSV for the lowest value of x. Jump by 10 until an unused
+    // name is found, then go back 10 and search from there one at a time.
+    searchIndex += searchStep;
+    sprintf(startFileName,"LD%04d.CSV",searchIndex);
+    #if SD_LOGGING_ENABLED
+    if(sd.exists(startFileName)) break;
+    #endif
+    if(searchStep > 1) {
+      searchIndex -= searchStep;
+      searchStep = 1;
+      break;
+    }
+    startState = START_OPEN;
+    break;
+
+  case START_OPEN:
+    #if SD_LOGGING_ENABLED
+    if(!createFile()) {
+//      error_P("file open");
+      startState = START_FAILED;
       break;
     }
+    #endif
+    #if LOG_ROTATION_ENABLED
+    eraseBlock = 0;
+    #endif
+    startState = START_ERASE;
+    break;
+
+  case START_ERASE:
+    #if SD_LOGGING_ENABLED && LOG_ROTATION_ENABLED
+    // The clusters hold whatever was on the card. Erase them, so that after
+    // a reset the end of the rows can be found. A part is erased
+    // LOG_ERASE_BLOCKS at a time, one erase is too long for the watchdog. A
+    // card that can't erase the range gets a file that grows instead.
+    if(eraseBlock == 0) {
+      if(file.fileSize() == 0 || !file.contiguousRange(&eraseBlock, &eraseLast)) {
+        file.truncate(0);
+        startState = START_HEADER;
+        break;
+      }
+    }
+    {
+      uint32_t last = eraseBlock + LOG_ERASE_BLOCKS - 1;
+
+      if(last > eraseLast) last = eraseLast;
+      wdt_reset();
+      if(!sd.card()->erase(eraseBlock, last)) {
+        file.truncate(0);
+        eraseBlock = 0;
+        startState = START_HEADER;
+        break;
+      }
+      eraseBlock = last + 1;
+      if(eraseBlock <= eraseLast) break;
+      eraseBlock = 0;
+    }
+    #endif
+    startState = START_HEADER;
+    break;
+
+  case START_HEADER:
+    startState = writeHeader() ? START_ECHO : START_FAILED;
+    break;
+
+  default: break;
   }
+
+  Bus::end();
+  Instrument::countSdBlocks(1);
+
+  return startState;
+}
+
+#if STATS_ENABLED
+// Write the session statistics next to the log, LDxxxx.CSV -> LDxxxx.STA,
+// so they can be looked up without reading the whole log
+static void writeSummary()
+{
+  char name[13];
+  char* line = Memory::scratch;
+
+  strcpy(name, startFileName);
+  strcpy(strchr(name, '.'), ".STA");
+
   #if SD_LOGGING_ENABLED
+  if(!file.open(name, O_CREAT | O_WRITE | O_TRUNC)) return;
+
+  file.print("# ");
+  file.print(startFileName);
+  file.println(" summary, temperatures in C");
+
+  // Each bin counts from its lower edge up to the next one
+  file.print("channel, samples, min, max, mean, stddev, <");
+  file.print(printTenths(line, STATS_BIN_MIN + STATS_BIN_WIDTH));
+  for(uint8_t b = 1; b < STATS_BINS; b++) {
+    file.print(", >=");
+    file.print(printTenths(line, STATS_BIN_MIN + b*STATS_BIN_WIDTH));
+  }
   file.println();
-  file.flush();
+
+  for(uint8_t i = 0; i < SENSOR_COUNT; i++) {
+    Stats::Summary s;
+    file.print("temp_");
+    file.print(i, DEC);
+    if(!Stats::get(i, &s)) {
+      file.println(", 0");
+      continue;
+    }
+    file.print(", ");
+    file.print(s.count, DEC);
+    file.print(", ");
+    file.print(printTenths(line, s.min));
+    file.print(", ");
+    file.print(printTenths(line, s.max));
+    file.print(", ");
+    file.print(printTenths(line, s.mean));
+    file.print(", ");
+    file.print(printTenths(line, s.stddev));
+    for(uint8_t b = 0; b < STATS_BINS; b++) {
+      file.print(", ");
+      file.print(Stats::bin(i, b), DEC);
+    }
+    file.println();
+  }
+  file.close();
+  #endif
+  Instrument::countSdBlocks(2);
+  return;
+}
+#endif
+
+// Close the file, giving back the preallocated blocks past the last row
+static void closeFile()
+{
+  #if SD_LOGGING_ENABLED
+  #if LOG_ROTATION_ENABLED
+  if(file.isOpen()) file.truncate(file.curPosition());
+  #endif
+  file.close();
+  #endif
+  return;
+}
+
+void close() {
+  #if STATS_ENABLED
+  // Only summarize a log that was actually opened
+  bool summary = (startState == START_DONE);
   #endif
-  #if SERIAL_OUTPUT_ENABLED
-  Serial.println();
+
+  startState = START_IDLE;
+  Bus::begin(Bus::DEVICE_SD);
+  closeFile();
+
+  #if STATS_ENABLED
+  if(summary) writeSummary();
   #endif
+  Bus::end();
+}
 
+#if LOG_ROTATION_ENABLED
+void rotate()
+{
+  uint16_t part = atoi(startFileName + 2);
+
+  // Statistics run on across the parts, and are written when the log is closed
+  Bus::begin(Bus::DEVICE_SD);
+  closeFile();
+  Bus::end();
+
+  // The card is already up, carry on searching from this part's number
+  previousPart = part;
+  searchIndex = part;
+  searchStep = 1;
+  resumeSize = 0;
+  startState = START_SEARCH;
+  return;
+}
+
+bool partFull()
+{
   #if SD_LOGGING_ENABLED
-  return (file.getWriteError() == false);
+  return (file.curPosition() + SCRATCH_SIZE > LOG_PART_BYTES);
   #else
-    return true;
+  return false;
   #endif
 }
+#endif
 
-void close() {
+uint32_t fileSize()
+{
   #if SD_LOGGING_ENABLED
-  file.close();
+  return file.curPosition();
+  #else
+  return 0;
   #endif
 }
 
 bool log(char* message) {
   // TODO: Test if file is open first
 
-  // log time to file
+  // log time to file, the row and any flush are one bus transaction
+  Bus::begin(Bus::DEVICE_SD);
   #if SD_LOGGING_ENABLED
   file.println(message);
   #endif
+  Timing::injectSd();
 
   sync(false);
+  Bus::end();
 
   #if SD_LOGGING_ENABLED
   return (file.getWriteError() == false);
@@ -274,9 +614,88 @@ void sync(boolean force) {
   }
 
   syncTime = millis();
+  Bus::begin(Bus::DEVICE_SD);
   #if SD_LOGGING_ENABLED
   file.flush();
   #endif
+  Bus::end();
+  // Data sector plus the directory entry
+  Instrument::countSdBlocks(2);
+}
+
+uint16_t eventIndex = 0;        // Last EVxxxx number used or probed
+uint8_t eventStep = 0;          // Probe stride, 10 for the coarse pass then 1; 0 before the card is checked
+
+EventState openEvent(char* fileName)
+{
+  EventState state = EVENT_SEARCH;
+
+  Bus::begin(Bus::DEVICE_SD);
+
+  // One SD operation per call, as in startTask()
+  if(eventStep == 0) {
+    #if SD_LOGGING_ENABLED
+    // The card is already up if a log file is open
+    if(!file.isOpen() && !sd.begin(SD_CS, SPI_FULL_SPEED)) state = EVENT_FAILED;
+    #endif
+    eventStep = 10;
+  }else if(eventIndex + eventStep <= 9999) {
+    // Carry on from the last event, so only the first one searches far. Jump
+    // by 10 until an unused name is found, then go back and step by 1.
+    eventIndex += eventStep;
+    sprintf(fileName, "EV%04d.CSV", eventIndex);
+    Instrument::countSdBlocks(1);
+    #if SD_LOGGING_ENABLED
+    if(sd.exists(fileName)) {
+      Bus::end();
+      return state;
+    }
+    #endif
+    if(eventStep > 1) {
+      eventIndex -= eventStep;
+      eventStep = 1;
+    }else{
+      state = EVENT_OPEN;
+      #if SD_LOGGING_ENABLED
+      if(!eventFile.open(fileName, O_CREAT | O_WRITE | O_EXCL)) state = EVENT_FAILED;
+      eventFile.clearWriteError();
+      #endif
+    }
+  }else if(eventStep > 1) {
+    eventStep = 1;
+  }else{
+    state = EVENT_FAILED;
+  }
+
+  Bus::end();
+
+  // The next event checks the card again
+  if(state != EVENT_SEARCH) eventStep = 0;
+  return state;
+}
+
+bool logEvent(char* message, bool newline)
+{
+  #if SD_LOGGING_ENABLED
+  Bus::begin(Bus::DEVICE_SD);
+  if(newline) eventFile.println(message);
+  else eventFile.print(message);
+  Bus::end();
+  return (eventFile.getWriteError() == false);
+  #else
+  return true;
+  #endif
+}
+
+void closeEvent()
+{
+  Bus::begin(Bus::DEVICE_SD);
+  #if SD_LOGGING_ENABLED
+  eventFile.close();
+  #endif
+  Bus::end();
+  Instrument::countSdBlocks(2);
+  return;
 }
 
 } // namespace sd
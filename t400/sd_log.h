@@ -3,19 +3,56 @@
 
 namespace sd {
 
-// Initialize the SD card
-void init();
+// States of the incremental start-up sequence
+enum StartState {
+  START_IDLE,       // Nothing in progress
+  START_INIT,       // Bring up the SD card
+  START_SEARCH,     // Probe for the lowest unused LDxxxx.CSV
+  START_OPEN,       // Create the file
+  START_ERASE,      // Blank the preallocated part, see LOG_ROTATION_ENABLED
+  START_HEADER,     // Write the data header
+  START_ECHO,       // Copy the header to the serial port, a line per step
+  START_REOPEN,     // Reopen a file left by a reset, see resume()
+  START_SCAN,       // Find the end of the rows in a reopened file
+  START_DONE,       // File is open and ready for log()
+  START_FAILED,     // Card or file could not be opened
+};
 
-// Open a file for logging
+// Begin opening a file for logging. The work is done by startTask(), so this returns immediately.
 // @param fileName File name to save to. If the file already exists, the name will be iterated until
 //        an unused file is found.
-// @return True if the file could be opened, false otherwise
-bool open(char* fileName);
+void start(char* fileName);
+
+// Begin reopening a log file that was open when the board reset, and append to it.
+// Uses the same startTask() sequence as start(), but opens the file by name with
+// no search and no header.
+// @param fileName Name of the file to reopen
+// @param committedSize Size the file had at the last journal commit. The file
+//        is refused if it is shorter, something else has been at the card.
+void resume(char* fileName, uint32_t committedSize);
+
+// Advance the start-up sequence by one bounded step. Call this once per loop() pass.
+// @return The current state; START_DONE or START_FAILED when finished
+StartState startTask();
 
 // Close the file on the SD card and disconnect from it
 // Call this before powering down the board
 void close();
 
+#if LOG_ROTATION_ENABLED
+// Close the current part of the log and begin the next one, numbered on from
+// it. The new part is brought up by startTask() as at the start, and its
+// header says which part it continues.
+void rotate();
+
+// @return True once the current part has no room left for a row
+bool partFull();
+#endif
+
+// @return Bytes written to the log file. A preallocated part is longer than
+//         this until it is closed.
+uint32_t fileSize();
+
 // Log a message to the SD card
 bool log(char* message);
 
@@ -23,6 +60,26 @@ bool log(char* message);
 // @param force If true, force the data to be synced
 void sync(boolean force);
 
+// Results of openEvent()
+enum EventState {
+  EVENT_SEARCH,     // Still looking for an unused name, call again
+  EVENT_OPEN,       // Event file is open
+  EVENT_FAILED,     // Card or file could not be opened
+};
+
+// Advance opening a new alarm event file, EVxxxx.CSV, by one bounded step:
+// bring up the card, probe one name or create the file. Call it once per
+// loop() pass until it stops returning EVENT_SEARCH.
+// @param fileName Buffer the chosen name is written into
+EventState openEvent(char* fileName);
+
+// Write to the event file
+// @param newline If true, end the line
+bool logEvent(char* message, bool newline = true);
+
+// Close the event file
+void closeEvent();
+
 }
 
 #endif
@@ -0,0 +1,134 @@
+#include <Arduino.h>
+#include "t400.h"
+#include "serial_out.h"
+
+#if SERIAL_TX_BUFFER & (SERIAL_TX_BUFFER - 1)
+#error SERIAL_TX_BUFFER must be a power of 2
+#endif
+static_assert(SERIAL_TX_BUFFER >= SCRATCH_SIZE, "Serial ring can't hold an output row");
+
+namespace SerialOut {
+
+Ring port;
+
+// The indexes run freely and wrap at 65536, which SERIAL_TX_BUFFER divides.
+// Bytes from tail to lineStart are complete lines waiting to go out, from
+// lineStart to head is the line still being written.
+uint8_t buffer[SERIAL_TX_BUFFER];
+uint16_t head = 0;
+uint16_t tail = 0;
+uint16_t lineStart = 0;
+bool discarding = false;          // Dropping the rest of the current line
+bool listening = false;           // The host took the last bytes sent
+
+uint16_t rowsDropped = 0;
+uint32_t bytesDropped = 0;
+uint16_t rowsReported = 0;
+
+static inline bool hostPresent()
+{
+  return USBSTA & _BV(VBUS);
+}
+
+// Throw away the complete lines waiting in the ring
+static void discardLines()
+{
+  for(; tail != lineStart; tail++) {
+    bytesDropped++;
+    if(buffer[tail % SERIAL_TX_BUFFER] == '\n') rowsDropped++;
+  }
+  return;
+}
+
+// Hand complete lines to the USB port, as much as it has room for. The
+// port sends a packet when its bank fills or at the next USB frame, so
+// queued lines go out in full packets instead of a packet per print.
+static void drain()
+{
+  if(!hostPresent()) {
+    listening = false;
+    discardLines();
+    return;
+  }
+
+  while(tail != lineStart) {
+    uint16_t index = tail % SERIAL_TX_BUFFER;
+    uint16_t count = lineStart - tail;
+    int space = Serial.availableForWrite();
+
+    if(space <= 0) break;
+    if(count > SERIAL_TX_BUFFER - index) count = SERIAL_TX_BUFFER - index;
+    if(count > space) count = space;
+
+    if(Serial.write(&buffer[index], count) == 0) {
+      // No terminal has the port open
+      listening = false;
+      discardLines();
+      break;
+    }
+    listening = true;
+    tail += count;
+  }
+  return;
+}
+
+size_t Ring::write(uint8_t c)
+{
+  if(!discarding && (uint16_t)(head - tail) == SERIAL_TX_BUFFER) {
+    drain();
+    if((uint16_t)(head - tail) == SERIAL_TX_BUFFER) {
+      // Drop the part of the line already queued, and the rest of it. This
+      // is also where a line longer than the whole ring ends up.
+      bytesDropped += (uint16_t)(head - lineStart);
+      head = lineStart;
+      discarding = true;
+    }
+  }
+
+  if(discarding) {
+    bytesDropped++;
+    if(c == '\n') {
+      rowsDropped++;
+      discarding = false;
+    }
+    return 1;
+  }
+
+  buffer[head % SERIAL_TX_BUFFER] = c;
+  head++;
+  if(c == '\n') lineStart = head;
+  return 1;
+}
+
+size_t Ring::write(const uint8_t* data, size_t size)
+{
+  for(size_t i = 0; i < size; i++) write(data[i]);
+  return size;
+}
+
+void task()
+{
+  drain();
+
+  // Tell the host what it missed, once there's room to
+  if(rowsDropped != rowsReported && head == tail && listening) {
+    char line[48];
+    rowsReported = rowsDropped;
+    sprintf(line, "# serial dropped %u rows, %lu bytes", rowsDropped, bytesDropped);
+    port.println(line);
+    drain();
+  }
+  return;
+}
+
+uint16_t droppedRows()
+{
+  return rowsDropped;
+}
+
+uint32_t droppedBytes()
+{
+  return bytesDropped;
+}
+
+} // namespace SerialOut
@@ -0,0 +1,41 @@
+/*
+ * Serial output through a transmit ring, so a slow or missing USB host
+ * never holds up loop()
+ */
+
+#ifndef SERIAL_OUT_H
+#define SERIAL_OUT_H
+
+#include <Arduino.h>
+#include "t400.h"
+
+namespace SerialOut {
+
+  // Queues whole lines for the USB port. Only complete lines are sent, and
+  // a line that doesn't fit is dropped whole, so the host never sees half
+  // a row. The ring holds at least an output row; a line longer than the
+  // whole ring is dropped and counted the same way. Use it like Serial:
+  // SerialOut::port.println(buf).
+  class Ring : public Print {
+  public:
+    virtual size_t write(uint8_t c);
+    virtual size_t write(const uint8_t* buffer, size_t size);
+    using Print::write;
+  };
+
+  extern Ring port;
+
+  // Send what the USB port will take without waiting, and report new drops
+  // as a '#' line. Call this once per loop() pass.
+  void task();
+
+  // @return Lines dropped since power on, because the ring was full or no
+  //         host was listening
+  uint16_t droppedRows();
+
+  // @return Bytes dropped since power on
+  uint32_t droppedBytes();
+
+}
+
+#endif
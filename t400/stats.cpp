@@ -0,0 +1,124 @@
+#include <Arduino.h>
+#include "t400.h"
+#include "stats.h"
+
+#if STATS_ENABLED
+
+namespace Stats {
+
+// Welford's running mean and sum of squared differences, in integers. The
+// mean is kept in 1/256 of a unit together with the remainder of its
+// division, so it is exact: a rounded mean stops following a slow drift
+// once the count is large. m2 is summed in 1/256 of a unit squared, which
+// holds a year of samples even at full scale.
+struct Accumulator {
+  uint32_t count;
+  int16_t min;
+  int16_t max;
+  int32_t mean;           // floor(256*Mean(x))
+  uint32_t remainder;     // 256*Sum(x) - count*mean, 0 to count-1
+  uint64_t m2;            // 256*Sum((x - mean)^2)
+  uint16_t bins[STATS_BINS];
+};
+
+// 256*x - mean stays under 2^24 either way, so the remainder and it fit an
+// int32 until the count gets this high, years of samples
+#define STATS_COUNT_MAX   0x7E000000UL
+
+Accumulator accumulators[SENSOR_COUNT];
+
+void reset()
+{
+  memset(accumulators, 0, sizeof(accumulators));
+  return;
+}
+
+void update(const int16_t* temperatures)
+{
+  for(uint8_t sensor = 0; sensor < SENSOR_COUNT; sensor++)
+  {
+    Accumulator* a = &accumulators[sensor];
+    int16_t x = temperatures[sensor];
+    int32_t scaled = (int32_t)x*256;
+    int32_t delta;
+    int32_t t;
+    int32_t n;
+    int32_t q;
+    int16_t b;
+
+    if(x == OUT_OF_RANGE_INT || a->count >= STATS_COUNT_MAX) continue;
+
+    if(a->count == 0) {
+      a->min = x;
+      a->max = x;
+    }
+    if(x < a->min) a->min = x;
+    if(x > a->max) a->max = x;
+
+    // 256*Sum(x) goes from count*mean + remainder to n*mean + t
+    delta = scaled - a->mean;
+    t = (int32_t)a->remainder + delta;
+    n = ++a->count;
+    q = t/n;
+    t -= q*n;
+    if(t < 0) {
+      q--;
+      t += n;
+    }
+    a->mean += q;
+    a->remainder = t;
+    a->m2 += ((int64_t)delta*(scaled - a->mean)) >> 8;   // Never negative
+
+    b = (x - STATS_BIN_MIN)/STATS_BIN_WIDTH;
+    if(x < STATS_BIN_MIN) b = 0;
+    if(b >= STATS_BINS) b = STATS_BINS - 1;
+    if(a->bins[b] == 0xFFFF) {
+      // Keep the shape, lose the oldest detail
+      for(uint8_t i = 0; i < STATS_BINS; i++) a->bins[i] >>= 1;
+    }
+    a->bins[b]++;
+  }
+  return;
+}
+
+// Integer square root, rounded down
+static uint16_t isqrt(uint32_t x)
+{
+  uint32_t root = 0;
+  uint32_t bit = 1UL << 30;
+
+  while(bit > x) bit >>= 2;
+  while(bit != 0) {
+    if(x >= root + bit) {
+      x -= root + bit;
+      root = (root >> 1) + bit;
+    }else{
+      root >>= 1;
+    }
+    bit >>= 2;
+  }
+  return root;
+}
+
+bool get(uint8_t sensor, Summary* summary)
+{
+  const Accumulator* a = &accumulators[sensor];
+
+  if(a->count == 0) return false;
+
+  summary->count = a->count;
+  summary->min = a->min;
+  summary->max = a->max;
+  summary->mean = (a->mean + 128) >> 8;   // Rounded, the shift floors
+  summary->stddev = isqrt((uint32_t)((a->m2/a->count) >> 8));
+  return true;
+}
+
+uint16_t bin(uint8_t sensor, uint8_t bin)
+{
+  return accumulators[sensor].bins[bin];
+}
+
+} // namespace Stats
+
+#endif
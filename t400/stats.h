@@ -0,0 +1,42 @@
+/*
+ * Running statistics for a logging session: min, max, mean, standard
+ * deviation and a coarse histogram of each channel
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <Arduino.h>
+#include "t400.h"
+
+namespace Stats {
+
+  struct Summary {
+    uint32_t count;       // Samples seen
+    int16_t min;          // All values in 1/10 C
+    int16_t max;
+    int16_t mean;
+    int16_t stddev;
+  };
+
+  // Start a new session
+  void reset();
+
+  // Add a row of samples. Out of range channels are skipped.
+  // @param temperatures SENSOR_COUNT values, in 1/10 C
+  void update(const int16_t* temperatures);
+
+  // Work out the summary of a channel. This does a 64 bit division and a
+  // square root, so call it once per channel rather than for every use.
+  // @return False if the channel has no samples
+  bool get(uint8_t sensor, Summary* summary);
+
+  // @param bin 0 to STATS_BINS-1. The first and last bins also hold
+  //        everything below and above the histogram range.
+  // @return Relative count of samples in the bin. Counts are halved
+  //         together when one fills up, so only the proportions are exact.
+  uint16_t bin(uint8_t sensor, uint8_t bin);
+
+}
+
+#endif
@@ -4,11 +4,31 @@
 // Hardware definitions for the t400
 #define __AVR_ATmega32U4__      1
 
-// Feature settings
-#define SD_LOGGING_ENABLED      1  // Enable/disable all SD card functionality. Saves 8,606 bytes
-#define SERIAL_OUTPUT_ENABLED   1 // Enable/disable serial output functionality. Saves 174 bytes
-
-// Calibration values
+// Feature settings. The default build has to fit 28,672 bytes of flash
+// and leave the stack room in 2.5 KB of SRAM, so the optional features
+// below are off until a build with them is shown to fit; tools/t400size.sh
+// reports what each flag costs.
+#define SD_LOGGING_ENABLED      1  // Enable/disable all SD card functionality. Saved 8,606 bytes of flash in the original firmware
+#define SERIAL_OUTPUT_ENABLED   1 // Enable/disable serial output functionality. Saved 174 bytes of flash in the original firmware
+#define LOW_POWER_ENABLED       0  // Enable/disable one-shot acquisition and LCD gating on battery at long log intervals
+#define INSTRUMENTATION_ENABLED 0  // Enable/disable debug counters, reported over serial as '#' lines
+#define SAMPLE_ALIGNMENT_ENABLED 0 // Enable/disable lining up all channels of a row with the sample time
+#define DERIVED_CHANNELS_ENABLED 0 // Enable/disable difference and rate of change channels
+#define DERIVED_LOGGING_ENABLED  0 // Enable/disable writing the derived channels as extra log columns
+#define ALARM_ENABLED            0 // Enable/disable alarm triggers and event capture files
+#define STATS_ENABLED            0 // Enable/disable session statistics, shown on the display and saved at the end of a log
+#define LIVE_READINGS_ENABLED    0 // Enable/disable updating the readings row from each conversion instead of each sample
+#define CONFIG_ENABLED           0 // Enable/disable keeping the settings in EEPROM, and starting to log at power up
+#define JOURNAL_ENABLED          0 // Enable/disable resuming the log file after an unexpected reset, needs SD_LOGGING_ENABLED
+#define RAM_REPORT_ENABLED       0 // Enable/disable stack painting, and a '#' report of the RAM map when the stack reaches a new depth
+#define DISPLAY_CACHE_ENABLED    0 // Enable/disable keeping the status bar and graph axis as bitmaps, redrawn only when they change. Uses about 300 bytes of SRAM
+#define CALIBRATION_COMMAND_ENABLED 0 // Enable/disable the serial 'cal' command, and keeping per channel calibration in EEPROM
+#define SPI_BUS_ENABLED          0 // Enable/disable setting each SPI device's clock and mode per transaction, and holding display pages back behind SD writes
+#define LOG_ROTATION_ENABLED     0 // Enable/disable preallocating the log file in parts, and starting a new part by size or time
+#define TIMING_HARNESS_ENABLED   0 // Enable/disable timing each sample from its tick to its row, reported over serial as '#' lines. Needs USB power, micros() stops in power down
+
+// Calibration values, y = (x*MUL + ADD)/10000 in microvolts. These are the
+// default for every channel, until one is set with the 'cal' command.
 //#define MCP3424_CALIBRATION_MULTIPLY    1.00713
 //#define MCP3424_CALIBRATION_ADD         5.826
 
@@ -23,12 +43,113 @@
 
 // Compile-time settings. Some of these should be set by the user during operation.
 #define SYNC_INTERVAL           1000       // millis between calls to sync()
-#define SENSOR_COUNT            4          // Number of sensors on the board (fixed)
+#define LOG_PART_BYTES          1048576UL  // Size each log file part is preallocated to, and rotated at
+#define LOG_PART_SECONDS        86400UL    // Log time after which a new part is started, whatever its size
+#define LOG_ERASE_BLOCKS        128        // 512 byte blocks of a new part erased per loop() pass, well inside the watchdog
+#define MCP3424_COUNT           1          // Number of MCP3424 ADCs on the I2C bus (1-4)
+#define MCP3424_CHANNELS        4          // Thermocouple inputs per MCP3424
+#define SENSOR_COUNT            (MCP3424_COUNT*MCP3424_CHANNELS)  // Number of thermocouple channels
+#define SENSOR_BANK_SIZE        4          // Channels shown at once in the readings row
+#define SENSOR_BANKS            ((SENSOR_COUNT+SENSOR_BANK_SIZE-1)/SENSOR_BANK_SIZE)
 #define OUT_OF_RANGE_INT        32760      // Int value representing an invalid temp. measurement
+#define MCP3424_CONVERSION_MS   67         // Time for one 16 bit conversion (15 SPS)
+
+#define SAMPLE_ALIGN_MAX_MS     6000       // Readings further apart than this aren't used to line up a channel. On battery a channel is read every MCP3424_CHANNELS seconds
+
+// Channel health settings
+#define CHANNEL_OPEN_UV         200000     // |uV| beyond this is a floating input (full scale is 256000 at x8 gain)
+#define CHANNEL_SHORT_UV        8          // |uV| within this (1 LSB) is flagged as shorted
+#define CHANNEL_DEAD_STREAK     3          // Bad readings in a row before a channel is skipped
+#define CHANNEL_REPROBE_SKIPS   30         // Skipped slots between re-probes of a dead channel
+
+// Low power acquisition settings
+#define LOW_POWER_MIN_INTERVAL      5      // Shortest log interval (s) that uses low power acquisition
+#define LOW_POWER_DISPLAY_TIMEOUT   30     // Seconds without a button press before the LCD is turned off
+
+#define INSTRUMENT_REPORT_SECONDS   60     // Seconds between instrumentation reports
+
+// Sample timing harness
+#define TIMING_REPORT_SAMPLES   120        // Samples in each timing report
+#define TIMING_INJECT_SD_MS     0          // Delay added to each log row write, to play a slow card
+#define TIMING_INJECT_LCD_MS    0          // Delay added to each display page, to play a slow display
+
+#define SERIAL_TX_BUFFER        (SCRATCH_SIZE > 128 ? 256 : 128)  // Bytes queued for the USB serial port, a power of 2 that holds an output row
+
+#define BUTTON_LONG_PRESS_MS    1000       // Hold time before a button reports a long press
+
+#define LIVE_READINGS_MS        250        // Fastest refresh of the live readings row, on USB power; on battery at most once per wake up
+
+// SPI clock of each device on the shared bus, both run in mode 0
+#define SD_SPI_CLOCK            4000000    // F_CPU/2, the same as SdFat's SPI_FULL_SPEED
+#define LCD_SPI_CLOCK           4000000    // F_CPU/2
+
+// Settings kept in EEPROM
+#define CONFIG_EEPROM_ADDRESS   0          // Start of the settings record
+#define CONFIG_VERSION          1          // Layout of the settings record
+#define CONFIG_SAVE_DELAY_SECONDS 5        // Wait this many RTC ticks after a change before writing, so a run of presses is one write
+
+// Log file journal, also in EEPROM
+#define JOURNAL_EEPROM_ADDRESS  16         // Start of the journal record, after the settings
+#define JOURNAL_VERSION         1          // Layout of the journal record, never 0
+#define JOURNAL_COMMIT_SECONDS  300        // Seconds between updates of the committed size, each one an EEPROM write
+
+// Per channel calibration, also in EEPROM
+#define CALIBRATION_EEPROM_ADDRESS  64     // Start of the calibration record, after the journal
+#define CALIBRATION_VERSION     1          // Layout of the calibration record
+
+// Derived channels, computed from each row of samples
+#define DERIVED_DIFFERENCE      0          // T[a] - T[b]
+#define DERIVED_SLOPE           1          // Rate of change of T[a], in degrees per minute
+#if DERIVED_CHANNELS_ENABLED
+// {type, a, b} for each derived channel. Channels are numbered from 0.
+#define DERIVED_CHANNEL_LIST    {DERIVED_DIFFERENCE, 0, 1}, \
+                                {DERIVED_SLOPE, 0, 0}
+#define DERIVED_COUNT           2          // Entries in DERIVED_CHANNEL_LIST
+#else
+#define DERIVED_COUNT           0
+#endif
+#define DERIVED_SLOPE_WINDOW    16         // Samples the rate of change is fitted over
+
+// Alarm triggers
+#define ALARM_ABOVE             0          // T[channel] > a
+#define ALARM_BELOW             1          // T[channel] < a
+#define ALARM_OUTSIDE           2          // T[channel] < a or T[channel] > b
+#define ALARM_RATE              3          // |dT/dt| > a, in 1/10 degree per second
+#if ALARM_ENABLED
+// {type, channel, a, b} for each trigger, temperatures in 1/10 C. Channels are numbered from 0.
+#define ALARM_TRIGGER_LIST      {ALARM_ABOVE, 0, 2500, 0}, \
+                                {ALARM_RATE, 0, 50, 0}
+#define ALARM_COUNT             2          // Entries in ALARM_TRIGGER_LIST, at most 8
+#endif
+#define ALARM_HYSTERESIS        20         // A trigger clears once the value is this far back inside its limit
+#define ALARM_PRE_SECONDS       5          // Seconds of readings written from before a trigger, kept in SRAM
+#define ALARM_POST_SECONDS      10         // Seconds of readings written after the last trigger
+#define ALARM_ROW_MS            (MCP3424_CHANNELS*MCP3424_CONVERSION_MS)  // Time between capture rows: a sweep, so each row has a new reading of every channel
+
+// Session statistics histogram, in 1/10 C. Values outside the range go in the end bins.
+#define STATS_BINS              8
+#define STATS_BIN_MIN           0          // Bottom of the first bin
+#define STATS_BIN_WIDTH         500        // Width of each bin
+
+// Columns in each output row: the thermocouples, then optionally the derived channels
+#if DERIVED_LOGGING_ENABLED
+#define LOG_COLUMNS             (SENSOR_COUNT+DERIVED_COUNT)
+#else
+#define LOG_COLUMNS             SENSOR_COUNT
+#endif
+// Shared scratch buffer, sized for an output row: time + ", -1234.5" per column
+#define SCRATCH_SIZE            (12 + LOG_COLUMNS*9)
 //#define OUT_OF_RANGE            3276.0     // Double value representing an invalid temp. measurement
 
 // Graph display settings
-#define MAXIMUM_GRAPH_POINTS    100
+#define MAXIMUM_GRAPH_POINTS    100   // Width of the graph, in pixels
+#define GRAPH_BUFFER_POINTS     400   // Points stored across all channels, 800 bytes of SRAM
+// Graph rows: the thermocouple channels followed by the derived channels
+#define GRAPH_ROWS              (SENSOR_COUNT+DERIVED_COUNT)
+// Points stored per row. With more rows each point covers more pixels.
+#define GRAPH_POINTS            (GRAPH_BUFFER_POINTS/GRAPH_ROWS < MAXIMUM_GRAPH_POINTS ? \
+                                 GRAPH_BUFFER_POINTS/GRAPH_ROWS : MAXIMUM_GRAPH_POINTS)
+#define GRAPH_POINT_WIDTH       (MAXIMUM_GRAPH_POINTS/GRAPH_POINTS)
 #define DISPLAY_HEIGHT          64    // Height of the display
 #define CHARACTER_SPACING       5   // Width of a character+space to next character
 
@@ -37,10 +158,24 @@
 #define TEMPERATURE_UNITS_K     2
 #define TEMPERATURE_UNITS_COUNT 3
 
-#define GRAPH_CHANNELS_COUNT    5
+#define THERMOCOUPLE_TYPE_K     0
+#define THERMOCOUPLE_TYPE       THERMOCOUPLE_TYPE_K  // Linearization table to use
+
+// Graph views: one per channel, then one per bank showing all of its channels,
+// then one per derived channel, then a statistics page per bank
+#define GRAPH_DERIVED_VIEW      (SENSOR_COUNT+SENSOR_BANKS)
+#define GRAPH_STATS_VIEW        (GRAPH_DERIVED_VIEW+DERIVED_COUNT)
+#if STATS_ENABLED
+#define GRAPH_CHANNELS_COUNT    (GRAPH_STATS_VIEW+SENSOR_BANKS)
+#else
+#define GRAPH_CHANNELS_COUNT    GRAPH_STATS_VIEW
+#endif
 
 /// I2C addresses
 #define MCP3424_ADDR        0x69
+#define MCP3424_ADDR_2      0x6A  // Additional ADCs, used when MCP3424_COUNT > 1
+#define MCP3424_ADDR_3      0x6B
+#define MCP3424_ADDR_4      0x6C
 
 // Pin definitions for Electronics version 0.13
 #define pcbVersion          ".13" // Electronics version 0.12 milestone.
@@ -66,6 +201,14 @@
 // MOSI                     16
 #define BUTTON_POWER_PIN    11
 
+// Port bits of the buttons, for reading them all straight from PINB/PIND/PINE
+#define BUTTON_A_MASK       _BV(6)  // PE6
+#define BUTTON_B_MASK       _BV(3)  // PD3
+#define BUTTON_C_MASK       _BV(4)  // PB4
+#define BUTTON_D_MASK       _BV(5)  // PB5
+#define BUTTON_E_MASK       _BV(6)  // PB6
+#define BUTTON_POWER_MASK   _BV(7)  // PB7
+
 // DATA2                    A0
 #define DATA1               A1
 #define LCD_A0              A2
@@ -73,5 +216,9 @@
 #define LCD_CS              A4
 #define LCD_BACKLIGHT_PIN   A5   // LCD backlight on pin
 
+// ADC mux channels for the analog pins, used when sampling them from the ADC interrupt
+#define BATT_STAT_ADC_CHANNEL   10  // A7 = ADC10
+#define VBAT_SENSE_ADC_CHANNEL  9   // A11 = ADC9
+
 
 #endif
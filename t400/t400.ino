@@ -35,30 +35,80 @@ Firmware for the Pax Instruments T400 temperature datalogger
 #include "buttons.h"          // User buttons
 #include "typek_constant.h"   // Thermocouple calibration table
 #include "functions.h"        // Misc. functions
+#include "convert.h"          // Temperature conversion chain
+#include "calibration.h"      // Per channel calibration
+#include "channel_health.h"   // Unplugged probe detection
+#include "derived.h"          // Difference and rate of change channels
+#include "alarm.h"            // Alarm triggers and event capture
+#include "stats.h"            // Session statistics
 #include "sd_log.h"           // SD card utilities
+#include "instrument.h"       // Debug counters
+#include "row_format.h"       // Output row format
+#include "serial_out.h"       // Non-blocking USB serial output
+#include "config.h"           // Settings kept in EEPROM
+#include "journal.h"          // Resume logging after a reset
+#include "memory.h"           // Scratch buffer and RAM report
+#include "bus.h"              // Shared SPI bus
+#include "timing.h"           // Sample timing harness
 
 #include <avr/wdt.h>
 
-#define BUFF_MAX         40   // Size of the character buffer
-
 char fileName[] =        "LD0001.CSV";
 
-// MCP3424 for thermocouple measurements
-MCP3424 thermocoupleAdc(MCP3424_ADDR, MCP342X_GAIN_X8, MCP342X_16_BIT);  // address, gain, resolution
+// MCP3424s for thermocouple measurements. Sensors 0-3 are on the first
+// one, 4-7 on the second, and so on.
+MCP3424 thermocoupleAdc[MCP3424_COUNT] = {
+  MCP3424(MCP3424_ADDR, MCP342X_GAIN_X8, MCP342X_16_BIT),  // address, gain, resolution
+#if MCP3424_COUNT > 1
+  MCP3424(MCP3424_ADDR_2, MCP342X_GAIN_X8, MCP342X_16_BIT),
+#endif
+#if MCP3424_COUNT > 2
+  MCP3424(MCP3424_ADDR_3, MCP342X_GAIN_X8, MCP342X_16_BIT),
+#endif
+#if MCP3424_COUNT > 3
+  MCP3424(MCP3424_ADDR_4, MCP342X_GAIN_X8, MCP342X_16_BIT),
+#endif
+};
 
 MCP980X ambientSensor(0);      // Ambient temperature sensor
 
-// Map of ADC inputs to thermocouple channels
-const uint8_t temperatureChannels[SENSOR_COUNT] = {1, 0, 3, 2};
-
-int16_t temperatures_int[SENSOR_COUNT] = {OUT_OF_RANGE_INT,OUT_OF_RANGE_INT,
-                                          OUT_OF_RANGE_INT,OUT_OF_RANGE_INT};
+// Map of ADC inputs to thermocouple channels, the same on every MCP3424
+const uint8_t temperatureChannels[MCP3424_CHANNELS] = {1, 0, 3, 2};
+
+int16_t temperatures_int[SENSOR_COUNT];
+
+uint8_t m_channel_index[MCP3424_COUNT];    // Input each ADC is converting
+uint8_t m_adc_running = 0;                  // Bit per ADC, set while a conversion is in flight
+uint16_t m_adc_start_ms[MCP3424_COUNT];     // millis() when each conversion was started
+
+#if SAMPLE_ALIGNMENT_ENABLED
+// Previous reading of each channel, and when the last two completed. Used to
+// line all the channels of a row up with the sample time. All these times
+// are alignClockMs(), not millis().
+int16_t previousTemperatures[SENSOR_COUNT];
+uint16_t previousReadingMs[SENSOR_COUNT];
+uint16_t lastReadingMs[SENSOR_COUNT];
+uint16_t adcStartClockMs[MCP3424_COUNT];    // When each conversion was started
+uint16_t rtcTickMs;                         // millis() at the last RTC interrupt
+
+// Skew of the last row, for the log header
+uint16_t rowSkewMs = 0;             // Spread in time of the channels' readings
+uint16_t rowResidualSkewMs = 0;     // Spread left after alignment
+uint8_t rowChannels = 0;            // Channels with a reading
+uint8_t rowAlignedChannels = 0;     // Of those, the ones moved to the sample time
+#endif
 
 // Ambient temperature
 int16_t ambient =  0;
 
 boolean backlightEnabled = true;
 
+// Low power acquisition state
+bool lowPower = false;          // True while converting one sweep per sample instead of continuously
+bool m_sweep_flag = false;      // Set one second before a sample, to start the low power sweep
+bool displayGated = false;      // True while the LCD and backlight are off to save power
+uint8_t displayIdleSeconds = 0; // Seconds since the last button press
+
 // Available log intervals, in seconds
 #define LOG_INTERVAL_COUNT  7
 const uint8_t logIntervals[LOG_INTERVAL_COUNT] = {0, 1, 2, 5, 10, 30, 60};
@@ -75,22 +125,166 @@ uint8_t m_logInterval    = 0;
 bool flag_halfsecond = true;   // If true we are doing 1/2 second
 
 boolean logging = false;    // True if we are currently logging to a file
+bool logStarting = false;   // True while sd::startTask() is still bringing the file up
 
 bool m_sample_flag = false;     // If true, the display should be redrawn
+uint16_t m_sample_ms;           // alignClockMs() when m_sample_flag was set
+
+#if LIVE_READINGS_ENABLED
+bool liveReadingsFlag = false;  // A conversion has finished since the readings row was drawn
+uint16_t liveReadingsMs = 0;    // millis() when the readings row was last drawn
+bool liveReadingsWake = false;  // The last pass ended in power down, which millis() doesn't count
+#endif
 
 uint8_t isrTick = 0;        // Number of 1-second tics that have elapsed since the last sample
 uint8_t lastIsrTick = 0;    // Last tick that we redrew the screen
 uint32_t logTimeSeconds;    // Number of seconds that have elapsed since logging began
+volatile uint32_t rtcTicks = 0; // 1 Hz RTC interrupts since power up, see rtcTickCount()
+#if LOG_ROTATION_ENABLED
+uint32_t partStartSeconds;  // logTimeSeconds when the current part of the log was started
+#endif
 
 struct ts rtcTime;          // Buffer to read RTC time into
 
 uint8_t temperatureUnit;    // Measurement unit for temperature
 
-uint8_t graphChannel = 4;
+uint8_t graphChannel = SENSOR_COUNT;   // All channels of the first bank
 
 uint8_t btn_disable_count = 0;
 uint8_t sd_full_count = 0;
 
+uint8_t lastButton = BUTTON_COUNT;  // Last button press that was acted on
+
+// The first sample is taken as soon as every channel has a reading, instead
+// of waiting for the next tick
+bool firstSamplePending = true;
+uint16_t firstSweepChannels = 0;    // Bit per channel read since power up
+
+// Seconds counted by the RTC interrupt. Use this rather than millis() for
+// anything timed in seconds: on battery loop() sleeps in power down, where
+// Timer 0 stops and millis() falls behind by most of each second. Unlike
+// logTimeSeconds it also runs at the half second interval.
+static uint32_t rtcTickCount()
+{
+  uint32_t ticks;
+
+  noInterrupts();
+  ticks = rtcTicks;
+  interrupts();
+  return ticks;
+}
+
+#if SAMPLE_ALIGNMENT_ENABLED
+// Time in ms for lining readings up with the sample time. millis() stops in
+// power down, so the seconds come from the RTC interrupt and only the time
+// since the last one from millis(). It wraps, like a uint16_t millis().
+// Call with interrupts off.
+static inline uint16_t alignClockMs()
+{
+  uint16_t sinceTick = (uint16_t)millis() - rtcTickMs;
+
+  if(sinceTick > 999) sinceTick = 999;
+  return (uint16_t)((uint16_t)rtcTicks*1000U) + sinceTick;
+}
+#endif
+
+#if CONFIG_ENABLED
+bool autoStart = false;             // Start logging at power up
+bool configChanged = false;         // Settings changed since they were last saved
+uint32_t configChangedTick;         // rtcTickCount() at the last change
+uint8_t autoStartNotice = 0;        // Seconds left showing the auto start setting
+
+// Pick up the settings saved before the last power down. Anything out of
+// range for this build keeps its default.
+static void loadConfig()
+{
+  Config::Settings settings;
+
+  if(!Config::load(&settings)) return;
+  if(settings.logInterval < LOG_INTERVAL_COUNT) m_logInterval = settings.logInterval;
+  if(settings.temperatureUnit < TEMPERATURE_UNITS_COUNT) temperatureUnit = settings.temperatureUnit;
+  if(settings.graphChannel < GRAPH_CHANNELS_COUNT) graphChannel = settings.graphChannel;
+  autoStart = settings.autoStart;
+  return;
+}
+
+static void saveConfig()
+{
+  Config::Settings settings;
+
+  settings.logInterval = m_logInterval;
+  settings.temperatureUnit = temperatureUnit;
+  settings.graphChannel = graphChannel;
+  settings.autoStart = autoStart;
+  Config::save(&settings);
+  configChanged = false;
+  return;
+}
+
+// Note a settings change, saveConfig() runs once they settle
+static void configTouched()
+{
+  configChanged = true;
+  configChangedTick = rtcTickCount();
+  return;
+}
+#endif
+
+#if JOURNAL_ENABLED
+Journal::Entry journal;             // The open log session, as kept in EEPROM
+bool resumePending = false;         // A session was open when the board reset
+bool resuming = false;              // The file being brought up is a resumed one
+bool resumeGapKnown;                // The RTC covers the time the board was down
+uint32_t journalCommitTick;         // rtcTickCount() at the last journal commit
+
+// Seconds since 2000 from the RTC. Only differences are used, so the RTC
+// doesn't have to be set to the right time, just kept running.
+static uint32_t rtcSeconds()
+{
+  static const uint16_t monthDays[12] = {0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334};
+  uint8_t year;
+  uint32_t days;
+
+  DS3231_get(&rtcTime);
+  year = rtcTime.year - 2000;
+  days = 365UL*year + (year + 3)/4 + monthDays[(rtcTime.mon + 11)%12] + rtcTime.mday - 1;
+  if(year%4 == 0 && rtcTime.mon > 2) days++;
+  return ((days*24 + rtcTime.hour)*60 + rtcTime.min)*60 + rtcTime.sec;
+}
+
+// Look for a session left open by a reset, and take its settings
+static void loadJournal()
+{
+  if(!Journal::load(&journal)) return;
+  if(journal.logInterval >= LOG_INTERVAL_COUNT || journal.temperatureUnit >= TEMPERATURE_UNITS_COUNT) return;
+  m_logInterval = journal.logInterval;
+  temperatureUnit = journal.temperatureUnit;
+  resumePending = true;
+  return;
+}
+
+// Move the committed size up to everything written so far
+static void commitJournal()
+{
+  sd::sync(true);
+  journal.committedSize = sd::fileSize();
+  journal.committedTime = logTimeSeconds;
+  Journal::write(&journal);
+  journalCommitTick = rtcTickCount();
+  return;
+}
+#endif
+
+// Samples taken while the log file is still being opened. They are written
+// to the file as soon as it is ready, so the first rows are not lost.
+#define PENDING_ROWS_MAX    (32/SENSOR_COUNT)
+struct PendingRow {
+  uint32_t time;
+  int16_t temperatures[LOG_COLUMNS];
+};
+PendingRow pendingRows[PENDING_ROWS_MAX];
+uint8_t pendingRowCount = 0;
+
 void rotateTemperatureUnit() {
   // Rotate the unit
   temperatureUnit = (temperatureUnit + 1) % TEMPERATURE_UNITS_COUNT;
@@ -102,39 +296,50 @@ void rotateTemperatureUnit() {
   return;
 }
 
-int16_t convertTemperatureInt(int16_t celcius) {
-  switch(temperatureUnit){
-  case TEMPERATURE_UNITS_F:
-      celcius = celcius*18;
-      celcius = celcius/10;
-      celcius = celcius + 320;
-      return celcius;
-  case TEMPERATURE_UNITS_K:
-    return celcius + 2732;
-  default: break;
-  }
-  return celcius;
-}
-
 // This function runs once. Use it for setting up the program state.
 void setup(void) {
   uint8_t x;
 
   Power::setup();
   ChargeStatus::setup();
+
+  #if CONFIG_ENABLED
+  loadConfig();
+  #endif
+  #if JOURNAL_ENABLED
+  loadJournal();
+  #endif
+  Calibration::load();
+
+  Wire.begin(); // Start using the Wire library; does the i2c communication.
+
+  for(x = 0; x < SENSOR_COUNT; x++) {
+    temperatures_int[x] = OUT_OF_RANGE_INT;
+    #if SAMPLE_ALIGNMENT_ENABLED
+    previousTemperatures[x] = OUT_OF_RANGE_INT;
+    #endif
+  }
+
+  // Kick off the ADC sampling loop first, all ADCs convert in parallel
+  // while the rest of the board is set up
+  for(x = 0; x < MCP3424_COUNT; x++) {
+    thermocoupleAdc[x].begin();
+    m_channel_index[x] = MCP3424_CHANNELS - 1;
+    adc_start_conversion(x, adc_next_channel(x, true));
+  }
+
   //#if SERIAL_OUTPUT_ENABLED
   Serial.begin(9600);
   //#endif
 
-  Wire.begin(); // Start using the Wire library; does the i2c communication.
-
   Backlight::setup();
   Backlight::set(backlightEnabled);
 
   setupDisplay();
   resetGraph();
-
-  thermocoupleAdc.begin();
+  #if DERIVED_CHANNELS_ENABLED
+  Derived::reset(logIntervals[m_logInterval]);
+  #endif
 
   ambientSensor.begin();
   ambientSensor.writeConfig(ADC_RES_12BITS);
@@ -150,34 +355,108 @@ void setup(void) {
   setupButtons();
 
   timer1_reset();
+  resetTicks();     // The saved interval may not be the default
 
   wdt_enable(WDTO_2S);
 
-  // Kick off the ADC sampling loop
-  adc_start_next_conversion();
+  #if JOURNAL_ENABLED
+  // Comes first, auto start does nothing once logging
+  if(resumePending) resumeLogging();
+  #endif
+
+  #if CONFIG_ENABLED && SD_LOGGING_ENABLED
+  // The card is brought up from loop() a step at a time, and the samples
+  // taken meanwhile are held for it
+  if(autoStart) startLogging();
+  #endif
 
   return;
 }
 
+#if LOG_ROTATION_ENABLED
+// Carry on in a new part of the log. It is opened a step at a time like the
+// first one, and the samples taken meanwhile are held for it.
+static void rotateLog()
+{
+  sd::rotate();
+  partStartSeconds = logTimeSeconds;
+  pendingRowCount = 0;
+  #if JOURNAL_ENABLED
+  resuming = false;
+  #endif
+  logStarting = true;
+  return;
+}
+#endif
+
+// Kick off the SD start-up. The card is brought up a step at a time by
+// serviceLogStart(), while measurements keep running.
 void startLogging()
 {
-  bool result;
   if(logging) return;
-  sd::init();
-  result = sd::open(fileName);
-  if(!result)
-  {
-      sd_full_count = 3;
-  }
-  logging = result;
+  sd::start(fileName);
+  pendingRowCount = 0;
+  #if LOG_ROTATION_ENABLED
+  partStartSeconds = 0;   // resetTicks() restarts the log time with the log
+  #endif
+  #if STATS_ENABLED
+  Stats::reset();
+  #endif
+  #if JOURNAL_ENABLED
+  resuming = false;
+  journal.startSeconds = rtcSeconds();
+  journal.logInterval = m_logInterval;
+  journal.temperatureUnit = temperatureUnit;
+  #endif
+  logStarting = true;
+  logging = true;
+  return;
+}
+
+#if JOURNAL_ENABLED
+// Pick the journal's file back up, with the log time carried on from the RTC
+// so the time column runs on across the reset. Call after resetTicks().
+static void resumeLogging()
+{
+  uint8_t sec = logIntervals[m_logInterval];
+  uint32_t now = rtcSeconds();
+  uint32_t elapsed = now - journal.startSeconds;
+
+  // If the RTC went back, it lost power too. Carry on from the last commit.
+  resumeGapKnown = (now >= journal.startSeconds && elapsed >= journal.committedTime);
+  if(!resumeGapKnown) elapsed = journal.committedTime;
+
+  // Samples fall where they would have without the reset
+  noInterrupts();
+  logTimeSeconds = elapsed;
+  if(sec > 0) isrTick = (elapsed + sec - 1)%sec;
+  interrupts();
+
+  sprintf(fileName, "LD%04u.CSV", journal.fileIndex);
+  sd::resume(fileName, journal.committedSize);
+  pendingRowCount = 0;
+  #if LOG_ROTATION_ENABLED
+  partStartSeconds = logTimeSeconds;
+  #endif
+  #if STATS_ENABLED
+  Stats::reset();
+  #endif
+  resuming = true;
+  logStarting = true;
+  logging = true;
   return;
 }
+#endif
 
 void stopLogging() {
   if(!logging) return;
 
   logging = false;
+  logStarting = false;
   sd::close();
+  #if JOURNAL_ENABLED
+  Journal::clear();
+  #endif
   return;
 }
 
@@ -226,25 +505,64 @@ void fake_data(){
     #endif
 
 #if 0
-    temperatures_int[0] = convertTemperatureInt(temperatures_int[0]);
-    temperatures_int[1] = convertTemperatureInt(temperatures_int[1]);
-    temperatures_int[2] = convertTemperatureInt(temperatures_int[2]);
-    temperatures_int[3] = convertTemperatureInt(temperatures_int[3]);
+    temperatures_int[0] = convertTemperatureInt(temperatureUnit, temperatures_int[0]);
+    temperatures_int[1] = convertTemperatureInt(temperatureUnit, temperatures_int[1]);
+    temperatures_int[2] = convertTemperatureInt(temperatureUnit, temperatures_int[2]);
+    temperatures_int[3] = convertTemperatureInt(temperatureUnit, temperatures_int[3]);
 #endif
 
     return;
 }
 #endif
 
-uint8_t m_channel_index = SENSOR_COUNT;
-static void adc_start_next_conversion()
+// Pick the next input for an ADC in the round-robin, skipping dead channels
+// so their conversion slots go to the live ones
+// @param wrap If false, stop after the last input instead of wrapping around
+// @return Input to convert, or MCP3424_CHANNELS if there isn't one
+static uint8_t adc_next_channel(uint8_t adc, bool wrap)
 {
-    m_channel_index = (m_channel_index+1);
-    if(m_channel_index>=SENSOR_COUNT) m_channel_index=0;
-    thermocoupleAdc.startMeasurement(temperatureChannels[m_channel_index]);
+    uint8_t channel = m_channel_index[adc];
+
+    for(uint8_t i = 0; i < MCP3424_CHANNELS; i++) {
+        channel++;
+        if(channel>=MCP3424_CHANNELS) {
+            if(!wrap) return MCP3424_CHANNELS;
+            channel=0;
+        }
+        if(ChannelHealth::wanted(adc*MCP3424_CHANNELS + channel)) return channel;
+    }
+
+    // Nothing is plugged in, keep cycling so probes are found when attached
+    channel = m_channel_index[adc] + 1;
+    if(channel>=MCP3424_CHANNELS) channel=0;
+    return channel;
+}
+
+static void adc_start_conversion(uint8_t adc, uint8_t channel)
+{
+    m_channel_index[adc] = channel;
+    thermocoupleAdc[adc].startMeasurement(temperatureChannels[channel]);
+    m_adc_running |= _BV(adc);
+    m_adc_start_ms[adc] = millis();
+    #if SAMPLE_ALIGNMENT_ENABLED
+    noInterrupts();
+    adcStartClockMs[adc] = alignClockMs();
+    interrupts();
+    #endif
+    Instrument::countI2c(1);
+    Instrument::countAdcConversion();
     return;
 }
 
+// True if it's worth asking the ADC whether its conversion is done. In low
+// power mode, don't poll until the conversion should be finished.
+static inline bool adc_conversion_due(uint8_t adc)
+{
+    if(!(m_adc_running & _BV(adc))) return false;
+    if(!lowPower) return true;
+    return (uint16_t)((uint16_t)millis() - m_adc_start_ms[adc]) >= MCP3424_CONVERSION_MS;
+}
+
 static int16_t adc_read_ambient()
 {
     int32_t tmpint32;
@@ -256,94 +574,222 @@ static int16_t adc_read_ambient()
     return tmpint16;
 }
 
-static void readTemperatures()
+static void readTemperatures(uint8_t adc)
 {
-    int32_t measuredVoltageUv;
-    int32_t compensatedVoltage;
     int32_t tmpint32;
     int16_t tmpint16=0;
-    //float tmpflt;
+    uint8_t channel = m_channel_index[adc];
+    uint8_t sensor = adc*MCP3424_CHANNELS + channel;
 
     // Skip if we don't have a temperature to measure?
-    //if(!thermocoupleAdc.measurementReady()) return;
-
-    // This gets the temperature as an integer
-    ambient = adc_read_ambient();
+    //if(!thermocoupleAdc[adc].measurementReady()) return;
+
+    // This gets the temperature as an integer. All the ADCs share one
+    // junction sensor, so only read it once per round.
+    if(adc == 0) {
+        ambient = adc_read_ambient();
+        // Pointer write + read
+        Instrument::countI2c(2);
+    }
 
     // This function should be called when there is a measurement ready
     // to be read.  This value is the temperature for channel stored
-    // in m_channel_index
+    // in m_channel_index[adc]
 
 
     // getMeasurementUv returns an int32_t which is the value in micro volts for this channel
-    tmpint32 = thermocoupleAdc.getMeasurementUv();
+    tmpint32 = thermocoupleAdc[adc].getMeasurementUv();
+    Instrument::countI2c(1);
 
-#if 0
-    /******************* Float Math Start ********************/
-    // Now we need to calibrate things.  This is y=mx+b
-    // Calibration value: MCP3424_OFFSET_CALIBRATION
-    tmpflt =  (((float)tmpint32)* MCP3424_CALIBRATION_MULTIPLY) + MCP3424_CALIBRATION_ADD;
-    measuredVoltageUv = (uint32_t)tmpflt;
-    /******************* Float Math End ********************/
-    //(61277 * 1.00713) + 5.826 = 61719.73101 -> 61719
-    //(7458 * 1.00713) + 5.826 = 7517.00154 -> 7517
-#else
-    // max microvolts is 61277
-    // max could be (61277*10071)+58260 = 617178927
-    //25C (7458*10071)+58260 = 75167778
-    tmpint32 =  (tmpint32*MCP3424_CALIBRATION_MUL_INT) + MCP3424_CALIBRATION_ADD_INT;
-    // max could be 617178927 / 10000 = 61717
-    // 25C 75167778/10000 = 7516
-    tmpint32 = tmpint32 / 10000;
-#endif
+    // Calibrate, compensate for the junction temperature and linearize
+    tmpint16 = BoardAcquisition::convert(sensor, tmpint32, ambient);
 
-    // Get the measured voltage, removing the ambient junction temperature
-    //compensatedVoltage = measuredVoltageUv + celcius_to_microvolts( (((float)(ambient))/10.0) );
-    compensatedVoltage = measuredVoltageUv + celcius_to_microvolts(ambient);
 
+    #if !DEBUG_FAKE_DATA
+    #if SAMPLE_ALIGNMENT_ENABLED
+    // Timestamp the conversion when it completed. On battery it can sit in
+    // the ADC until the next wake up, a second later.
+    previousTemperatures[sensor] = temperatures_int[sensor];
+    previousReadingMs[sensor] = lastReadingMs[sensor];
+    lastReadingMs[sensor] = adcStartClockMs[adc] + MCP3424_CONVERSION_MS;
+    #endif
+    temperatures_int[sensor] = tmpint16;
+    #endif
+    Timing::conversion();
+
+    #if LIVE_READINGS_ENABLED
+    liveReadingsFlag = true;
+    #endif
 
-    // Given a voltage, get the temperature
-    tmpint16 = microvolts_to_celcius(compensatedVoltage);
+    if(firstSamplePending) {
+      firstSweepChannels |= (uint16_t)1 << sensor;
+      if(firstSweepChannels == (uint16_t)((1UL << SENSOR_COUNT) - 1)) {
+        firstSamplePending = false;
+        m_sample_flag = true;
+        #if SAMPLE_ALIGNMENT_ENABLED
+        noInterrupts();
+        m_sample_ms = alignClockMs();
+        interrupts();
+        #endif
+        Timing::tick(0);    // Not on the tick grid, kept out of the jitter
+        Instrument::firstSample();
+      }
+    }
 
+    ChannelHealth::update(sensor, tmpint32, tmpint16);
 
-    #if !DEBUG_FAKE_DATA
-    temperatures_int[m_channel_index] = tmpint16;
+    #if ALARM_ENABLED
+    Alarm::check(sensor, tmpint16);
     #endif
 
-    // We are done with this channel, kick off the next one
-    adc_start_next_conversion();
+    // We are done with this channel, kick off the next one. In low power
+    // mode, stop after the last channel and wait for the next sweep.
+    channel = adc_next_channel(adc, !lowPower);
+    if(channel >= MCP3424_CHANNELS) {
+        m_adc_running &= ~_BV(adc);
+    }else{
+        adc_start_conversion(adc, channel);
+    }
 
     return;
 }
 
-static void writeOutputs()
+static char* const updateBuffer = Memory::scratch;  // Buffer to write serial/sd output into, only valid until it is written
+
+// Format one output row into updateBuffer
+static void formatOutputs(uint32_t time, int16_t* temperatures)
 {
+  formatRow(updateBuffer, time, temperatures, LOG_COLUMNS);
+  return;
+}
 
-  static char updateBuffer[BUFF_MAX];      // Scratch buffer to write serial/sd output into
-  uint8_t index=0;
+#if SAMPLE_ALIGNMENT_ENABLED
+// The channels of an ADC are converted one after another, so their latest
+// readings can be a few hundred ms apart, or seconds on battery where they
+// are read a wake up at a time. Move each one along the line through its
+// last two readings to the time the sample tick fired, and keep the skew of
+// the row before and after for the log header.
+static void alignSamples(int16_t* aligned)
+{
+  uint16_t sampleMs;
+  int16_t rawMin = 0, rawMax = 0;             // Reading times less the sample time
+  int16_t residualMin = 0, residualMax = 0;   // The same after alignment
+  uint8_t channels = 0;
+  uint8_t alignedChannels = 0;
 
-  index += sprintf(&(updateBuffer[index]),"%d",logTimeSeconds);
+  noInterrupts();
+  sampleMs = m_sample_ms;
+  interrupts();
 
-  for(uint8_t i = 0; i < SENSOR_COUNT; i++)
+  for(uint8_t sensor = 0; sensor < SENSOR_COUNT; sensor++)
   {
-    if(temperatures_int[i] == OUT_OF_RANGE_INT)
-    {
-        index += sprintf(&(updateBuffer[index]), ", -");
-    }else {
-      index+=sprintf(&(updateBuffer[index]), ", %d.%d",temperatures_int[i]/10,temperatures_int[i]%10);
+    int16_t last = temperatures_int[sensor];
+    int16_t previous = previousTemperatures[sensor];
+    int16_t period = lastReadingMs[sensor] - previousReadingMs[sensor];
+    int16_t age = sampleMs - lastReadingMs[sensor];
+    int16_t moved = 0;
+
+    aligned[sensor] = last;
+    if(last == OUT_OF_RANGE_INT) continue;
+
+    if(previous != OUT_OF_RANGE_INT && period > 0 && period <= SAMPLE_ALIGN_MAX_MS) {
+      // Don't extrapolate more than one conversion period
+      moved = age;
+      if(moved > period) moved = period;
+      if(moved < -period) moved = -period;
+
+      aligned[sensor] = last + ((int32_t)(last - previous)*moved)/period;
+      alignedChannels++;
     }
+
+    if(channels == 0 || -age < rawMin) rawMin = -age;
+    if(channels == 0 || -age > rawMax) rawMax = -age;
+    if(channels == 0 || moved - age < residualMin) residualMin = moved - age;
+    if(channels == 0 || moved - age > residualMax) residualMax = moved - age;
+    channels++;
   }
 
+  rowSkewMs = rawMax - rawMin;
+  rowResidualSkewMs = residualMax - residualMin;
+  rowChannels = channels;
+  rowAlignedChannels = alignedChannels;
+  return;
+}
+#endif
+
+static void writeOutputs(int16_t* temperatures)
+{
+  formatOutputs(logTimeSeconds, temperatures);
+
   #if SERIAL_OUTPUT_ENABLED
-  Serial.println(updateBuffer);
+  SerialOut::port.println(updateBuffer);
   #endif
 
-  if(logging) {
+  if(logStarting) {
+    // File isn't open yet, hold on to the sample. If start-up takes longer
+    // than the buffer, the newest samples are dropped.
+    if(pendingRowCount < PENDING_ROWS_MAX) {
+      PendingRow* row = &pendingRows[pendingRowCount++];
+      row->time = logTimeSeconds;
+      memcpy(row->temperatures, temperatures, sizeof(row->temperatures));
+    }
+  }else if(logging) {
     logging = sd::log(updateBuffer);
+    #if JOURNAL_ENABLED
+    if(!logging) Journal::clear();
+    else if(rtcTickCount() - journalCommitTick >= JOURNAL_COMMIT_SECONDS) commitJournal();
+    #endif
+    #if LOG_ROTATION_ENABLED
+    if(logging && (sd::partFull() || logTimeSeconds - partStartSeconds >= LOG_PART_SECONDS)) rotateLog();
+    #endif
   }
   return;
 }
 
+// Advance the SD start-up by one step
+// @return True if the display should be redrawn
+static bool serviceLogStart()
+{
+  switch(sd::startTask()) {
+  case sd::START_DONE:
+    logStarting = false;
+    #if JOURNAL_ENABLED
+    if(resuming) {
+      // The time column shows how long the board was down, unless the RTC lost it
+      char* note = (char*)(resumeGapKnown ? "# resumed after a reset"
+                                          : "# resumed after a reset, RTC lost, gap unknown");
+      logging = sd::log(note);
+      #if SERIAL_OUTPUT_ENABLED
+      SerialOut::port.println(note);
+      #endif
+    }else{
+      journal.fileIndex = atoi(fileName + 2);
+    }
+    #endif
+    // Catch the file up with the samples taken while it was opening
+    for(uint8_t i = 0; i < pendingRowCount && logging; i++) {
+      formatOutputs(pendingRows[i].time, pendingRows[i].temperatures);
+      logging = sd::log(updateBuffer);
+    }
+    pendingRowCount = 0;
+    #if JOURNAL_ENABLED
+    if(logging) commitJournal();
+    else Journal::clear();
+    #endif
+    return true;
+  case sd::START_FAILED:
+    logStarting = false;
+    logging = false;
+    sd_full_count = 3;
+    #if JOURNAL_ENABLED
+    Journal::clear();
+    #endif
+    return true;
+  default: break;
+  }
+  return false;
+}
+
 // Reset the tick counter, so that a new measurement takes place within 1 second
 void resetTicks()
 {
@@ -360,9 +806,64 @@ void resetTicks()
   }
   logTimeSeconds = 0;
   interrupts();
+  Timing::restart();
   return;
 }
 
+#if LOW_POWER_ENABLED
+// Turn the LCD and backlight off, or restore them
+static void setDisplayGated(bool gated)
+{
+  displayGated = gated;
+  Backlight::set(gated ? false : backlightEnabled);
+  displaySleep(gated);
+  return;
+}
+
+// Pick the acquisition mode. On battery at long log intervals the ADC
+// converts a single sweep just before each sample and then stays idle, and
+// the LCD is turned off when nobody is using it.
+// @return True if the display should be redrawn
+static bool updatePowerMode()
+{
+  lowPower = (ChargeStatus::get() == ChargeStatus::DISCHARGING)
+             && (logIntervals[m_logInterval] >= LOW_POWER_MIN_INTERVAL)
+             #if ALARM_ENABLED
+             && !Alarm::capturing()    // Keep every channel converting, the capture takes a row a sweep
+             #endif
+             ;
+  Instrument::setMode(lowPower ? "low" : "normal");
+
+  if(lowPower) {
+    if(m_sweep_flag) {
+      m_sweep_flag = false;
+      // Sweep every ADC from its first input, in parallel
+      for(uint8_t adc = 0; adc < MCP3424_COUNT; adc++) {
+        if(!(m_adc_running & _BV(adc))) {
+          m_channel_index[adc] = MCP3424_CHANNELS - 1;
+          adc_start_conversion(adc, adc_next_channel(adc, true));
+        }
+      }
+    }
+    if(!displayGated && displayIdleSeconds >= LOW_POWER_DISPLAY_TIMEOUT) {
+      setDisplayGated(true);
+    }
+    return false;
+  }
+
+  // Back to continuous conversions
+  m_sweep_flag = false;
+  for(uint8_t adc = 0; adc < MCP3424_COUNT; adc++) {
+    if(!(m_adc_running & _BV(adc))) adc_start_conversion(adc, adc_next_channel(adc, true));
+  }
+  if(displayGated) {
+    setDisplayGated(false);
+    return true;
+  }
+  return false;
+}
+#endif
+
 // This function is called periodically, and performs slow tasks:
 // Taking measurements
 // Updating the screen
@@ -372,17 +873,35 @@ void loop()
   bool refresh_display_flag = false;
 
   wdt_reset();
+  Bus::pass();
+
+  #if LOW_POWER_ENABLED
+  if(updatePowerMode())
+      refresh_display_flag = true;
+  #endif
 
   // This will read temperatures as fast as we can, this decouples the
   // slow reading from blocking the rest of the system
-  if(thermocoupleAdc.measurementReady())
-      readTemperatures();
+  for(uint8_t adc = 0; adc < MCP3424_COUNT; adc++) {
+    if(adc_conversion_due(adc)) {
+      Instrument::countI2c(1);
+      if(thermocoupleAdc[adc].measurementReady())
+          readTemperatures(adc);
+    }
+  }
+
+  // Bring the log file up a piece at a time
+  if(logStarting && serviceLogStart())
+      refresh_display_flag = true;
 
   // This locks in the samples into the array and does some other stuff. This
   // controls the sample rate of the data
   if(m_sample_flag)
   {
+    int16_t sampleTemperatures[GRAPH_ROWS];   // Thermocouples, then derived channels
+
     m_sample_flag = false;
+    Timing::notice();
 
     // DEBUG, force fake values for testing
     #if DEBUG_FAKE_DATA
@@ -391,25 +910,56 @@ void loop()
 
     //DS3231_get(&rtcTime);
 
+    #if SAMPLE_ALIGNMENT_ENABLED
+    alignSamples(sampleTemperatures);
+    #else
+    memcpy(sampleTemperatures, temperatures_int, sizeof(temperatures_int));
+    #endif
+
+    #if DERIVED_CHANNELS_ENABLED
+    Derived::update(sampleTemperatures);
+    #endif
+
     // Write the data to serial AND the SD card
-    writeOutputs();
+    writeOutputs(sampleTemperatures);
+    Timing::commit();
+
+    #if STATS_ENABLED
+    // Statistics cover the rows that go into the log
+    if(logging) Stats::update(sampleTemperatures);
+    #endif
 
     // Update some graph data.
-    updateGraphData(temperatures_int);
-    updateGraphScaling();
+    updateGraphData(sampleTemperatures);
+    updateGraphScaling(graphChannel);
 
     // Indicate we want to redraw the display
     refresh_display_flag = true;
   }
 
   // Check for button presses
-  if(buttonPending()) {
-    uint8_t button = buttonGetPending();
+  ButtonEvent event = {BUTTON_COUNT, BUTTON_RELEASED, 0};
+  if(buttonGetEvent(&event) && event.action == BUTTON_PRESSED) {
+    uint8_t button = event.button;
+
+    displayIdleSeconds = 0;
+    #if LOW_POWER_ENABLED
+    // The first press only wakes the display up
+    if(displayGated) {
+      setDisplayGated(false);
+      refresh_display_flag = true;
+      button = BUTTON_COUNT;
+    }
+    #endif
+    lastButton = button;
 
     switch(button){
     case BUTTON_POWER:
       // Disable power
       if(!logging) {
+        #if CONFIG_ENABLED
+        if(configChanged) saveConfig();
+        #endif
         clear();
         Backlight::set(0);
         Power::shutdown();
@@ -424,7 +974,6 @@ void loop()
       #if SD_LOGGING_ENABLED
       // NOTE: Logging takes up 30% of the flash!!!
       if(!logging) {
-          // This will block for a bit
           startLogging();
       } else {
           stopLogging();
@@ -440,6 +989,12 @@ void loop()
         m_logInterval = (m_logInterval + 1) % LOG_INTERVAL_COUNT;
         resetTicks();
         resetGraph();  // Reset the graph, to keep the x axis consistent
+        #if DERIVED_CHANNELS_ENABLED
+        Derived::reset(logIntervals[m_logInterval]);
+        #endif
+        #if CONFIG_ENABLED
+        configTouched();
+        #endif
       }else{
           btn_disable_count = 3;
       }
@@ -450,6 +1005,9 @@ void loop()
       if(!logging) {
         rotateTemperatureUnit();
         resetTicks();
+        #if CONFIG_ENABLED
+        configTouched();
+        #endif
       }else{
           btn_disable_count = 3;
       }
@@ -462,6 +1020,11 @@ void loop()
       {
         graphChannel = (graphChannel + 1) % GRAPH_CHANNELS_COUNT;
       }
+      // Derived channels have their own scale
+      updateGraphScaling(graphChannel);
+      #if CONFIG_ENABLED
+      configTouched();
+      #endif
       refresh_display_flag = true;
       break;
     case BUTTON_E:
@@ -473,7 +1036,23 @@ void loop()
     default: break;
     } // end button select
 
-  } // end if button pending
+  } // end if button pressed
+  #if CONFIG_ENABLED && SD_LOGGING_ENABLED
+  else if(event.button == BUTTON_A && event.action == BUTTON_LONG_PRESSED
+          && lastButton == BUTTON_A) {
+    // Holding A makes the logging state it just set stick across power
+    // cycles: auto start on if logging was started, off if it was stopped
+    autoStart = logging;
+    autoStartNotice = 3;
+    configTouched();
+    refresh_display_flag = true;
+  }
+  #endif
+
+  #if CONFIG_ENABLED
+  if(configChanged && rtcTickCount() - configChangedTick >= CONFIG_SAVE_DELAY_SECONDS)
+    saveConfig();
+  #endif
 
   // If we are charging, refresh the display every second to make the charging animation
   if(ChargeStatus::get() == ChargeStatus::CHARGING) {
@@ -483,31 +1062,102 @@ void loop()
     }
   }
 
+  #if ALARM_ENABLED
+  // Capture rows around alarm triggers, and show trigger changes
+  {
+    static uint8_t lastAlarm = 0;
+    static bool lastCapturing = false;
+    Alarm::task(temperatures_int, logStarting);
+    if(Alarm::active() != lastAlarm || Alarm::capturing() != lastCapturing) {
+      lastAlarm = Alarm::active();
+      lastCapturing = Alarm::capturing();
+      refresh_display_flag = true;
+    }
+  }
+  #endif
+
+  // Send queued serial output, without waiting on the host
+  SerialOut::task();
+  Calibration::task();
+
   // Draw the display
-  if(refresh_display_flag)
+  if(refresh_display_flag && !displayGated)
   {
     char * ptr = NULL;
-    if(logging) ptr = fileName;
+    #if CONFIG_ENABLED
+    if(autoStartNotice > 0) ptr = (char*)(autoStart ? "Autolog on" : "Autolog off");
+    else
+    #endif
+    if(logStarting) ptr = (char*)"Starting...";
+    #if ALARM_ENABLED
+    else if(Alarm::active()) ptr = (char*)"ALARM";
+    else if(Alarm::eventFileName() != NULL) ptr = Alarm::eventFileName();
+    #endif
+    else if(logging) ptr = fileName;
 
     refresh_display_flag = false;
+    #if LIVE_READINGS_ENABLED
+    // The readings row is drawn with the rest of the frame
+    liveReadingsFlag = false;
+    liveReadingsMs = millis();
+    #endif
 
-    // Actual draw of display, takes a bit of time
-    draw(graphChannel,
+    // Start the frame. Its pages go out one per pass of loop(), so sampling
+    // and the buttons are not held up for the whole frame. A frame still
+    // being sent is dropped, this one has the newer data.
+    drawStart(graphChannel,
       temperatureUnit,
       ptr,
       logIntervals[m_logInterval],
       ChargeStatus::get(),
-      ChargeStatus::getBatteryLevel()
+      ChargeStatus::getBatteryLevel(),
+      ChargeStatus::getRemainingMinutes()
     );
 
   }
+  #if LIVE_READINGS_ENABLED
+  // Between samples, keep the readings row up to date with the conversions.
+  // Only its page is sent, the graph waits for the next sample. millis()
+  // stops in power down, so on battery it would take many seconds of wake
+  // ups to reach LIVE_READINGS_MS; there the sleep between wake ups spaces
+  // the rows out instead, one per wake up at most.
+  else if(liveReadingsFlag && !displayGated && !drawing()
+          && (liveReadingsWake || (uint16_t)(millis() - liveReadingsMs) >= LIVE_READINGS_MS)
+          && Bus::available(Bus::DEVICE_LCD))
+  {
+    liveReadingsFlag = false;
+    liveReadingsWake = false;
+    liveReadingsMs = millis();
+    drawReadings(graphChannel);
+  }
+  #endif
+
+  // Send the next page of the frame, unless the SD card had the bus this pass
+  if(drawing() && Bus::available(Bus::DEVICE_LCD)) drawTask();
 
   // Sleep if we are on battery power
   // Note: Don't sleep if there is power, in case we need to communicate over USB
-  if(ChargeStatus::get() == ChargeStatus::DISCHARGING) {
-    Power::sleep();
+  // Note: Don't sleep while the log file is starting, so it finishes promptly
+  // Note: Don't sleep under a battery measurement, power down would abort it
+  // Note: While a low power sweep is converting, only idle so millis() keeps counting
+  // Note: Don't sleep part way through a frame, the rest would wait for a wake up
+  #if LIVE_READINGS_ENABLED
+  liveReadingsWake = false;
+  #endif
+  if(!logStarting && !ChargeStatus::sampling() && !drawing()
+     && ChargeStatus::get() == ChargeStatus::DISCHARGING) {
+    uint8_t mode = (lowPower && m_adc_running) ? SLEEP_MODE_IDLE : SLEEP_MODE_PWR_DOWN;
+
+    Power::sleep(mode);
+    #if LIVE_READINGS_ENABLED
+    liveReadingsWake = (mode == SLEEP_MODE_PWR_DOWN);
+    #endif
   }
 
+  Instrument::task();
+  Timing::task();
+  Memory::task();
+
 
   return;
 }
@@ -517,9 +1167,18 @@ void loop()
 // TODO: Why not use a timer?
 ISR(INT2_vect)
 {
+  rtcTicks++;
+  #if SAMPLE_ALIGNMENT_ENABLED
+  rtcTickMs = millis();
+  #endif
+
   if(flag_halfsecond)
   {
       m_sample_flag = true;
+      #if SAMPLE_ALIGNMENT_ENABLED
+      m_sample_ms = alignClockMs();
+      #endif
+      Timing::tick(500);
       // If half second processing, kick off the timer
       config_sample_time_ms(500);
   }else{
@@ -528,11 +1187,32 @@ ISR(INT2_vect)
       if(isrTick == 0)
       {
         m_sample_flag = true;
+        #if SAMPLE_ALIGNMENT_ENABLED
+        m_sample_ms = alignClockMs();
+        #endif
+        Timing::tick(logIntervals[m_logInterval]*1000U);
+      }else if(isrTick == logIntervals[m_logInterval]-1)
+      {
+        // A low power sweep of all channels finishes well within a second
+        m_sweep_flag = true;
       }
   }
 
+  if(displayIdleSeconds<255) displayIdleSeconds++;
   if(btn_disable_count>0) btn_disable_count--;
   if(sd_full_count>0) sd_full_count--;
+  #if CONFIG_ENABLED
+  if(autoStartNotice>0) autoStartNotice--;
+  #endif
+
+  // Refresh the battery state in the background
+  ChargeStatus::sample();
+
+  #if ALARM_ENABLED
+  Alarm::tick();
+  #endif
+
+  Instrument::tick();
 
   return;
 }
@@ -640,6 +1320,10 @@ ISR(TIMER1_COMPA_vect)
         TCCR1B &= 0B11111000;
 
         m_sample_flag = true;
+        #if SAMPLE_ALIGNMENT_ENABLED
+        m_sample_ms = alignClockMs();
+        #endif
+        Timing::tick(500);
     }
     return;
 }
@@ -0,0 +1,102 @@
+#include <Arduino.h>
+#include "t400.h"
+#include "timing.h"
+#include "sample_timing.h"
+#include "serial_out.h"
+
+#if TIMING_HARNESS_ENABLED
+
+namespace Timing {
+
+SampleTiming stats;
+SampleTiming report;            // The last full set, printed a line per pass
+uint8_t reportLine = 0;         // Next line of report to print, 0 = none due
+SampleTimes sample;
+
+volatile uint32_t tickUs;       // Set by the interrupt, copied when loop() takes the sample
+volatile uint32_t nominalUs;
+volatile bool restarted = false;
+uint32_t conversionUs;
+
+void tick(uint16_t nominalMs)
+{
+  tickUs = micros();
+  nominalUs = nominalMs*1000UL;
+  return;
+}
+
+void restart()
+{
+  restarted = true;
+  return;
+}
+
+void conversion()
+{
+  conversionUs = micros();
+  return;
+}
+
+void notice()
+{
+  sample.noticeUs = micros();
+  noInterrupts();
+  sample.tickUs = tickUs;
+  sample.nominalUs = nominalUs;
+  interrupts();
+  sample.adcUs = conversionUs;
+
+  if(restarted) {
+    restarted = false;
+    timingRestart(&stats);
+  }
+  return;
+}
+
+void commit()
+{
+  sample.commitUs = micros();
+  timingRecord(&stats, &sample);
+
+  if(stats.samples >= TIMING_REPORT_SAMPLES) {
+    report = stats;
+    reportLine = 1;
+    timingReset(&stats);
+  }
+  return;
+}
+
+void task()
+{
+  char buf[TIMING_LINE_SIZE];
+
+  // One line per pass, so the serial ring has drained the last one
+  if(reportLine == 0) return;
+  if(timingReportLine(&report, reportLine - 1, buf)) {
+    SerialOut::port.println(buf);
+    reportLine++;
+  }else{
+    reportLine = 0;
+  }
+  return;
+}
+
+void injectSd()
+{
+  #if TIMING_INJECT_SD_MS > 0
+  delay(TIMING_INJECT_SD_MS);
+  #endif
+  return;
+}
+
+void injectLcd()
+{
+  #if TIMING_INJECT_LCD_MS > 0
+  delay(TIMING_INJECT_LCD_MS);
+  #endif
+  return;
+}
+
+}
+
+#endif
@@ -0,0 +1,53 @@
+/*
+ * Sample timing harness: stamps each sample from its tick to its row being
+ * written, and reports the spread over serial as lines starting with '#'
+ */
+
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <Arduino.h>
+#include "t400.h"
+
+namespace Timing {
+
+#if TIMING_HARNESS_ENABLED
+
+// Note a sample tick. Call from the interrupt that sets m_sample_flag.
+// @param nominalMs Sample interval the tick is meant to keep
+void tick(uint16_t nominalMs);
+
+// Drop the interval to the next tick, when the ticks were restarted on purpose
+void restart();
+
+// Note that a conversion has been read
+void conversion();
+
+// loop() has taken the sample, and has written its row
+void notice();
+void commit();
+
+// Print the report after every TIMING_REPORT_SAMPLES samples, a line at a
+// time. Call from loop().
+void task();
+
+// Hold loop() up as a slow card or display would, see TIMING_INJECT_SD_MS
+void injectSd();
+void injectLcd();
+
+#else
+
+inline void tick(uint16_t) {}
+inline void restart() {}
+inline void conversion() {}
+inline void notice() {}
+inline void commit() {}
+inline void task() {}
+inline void injectSd() {}
+inline void injectLcd() {}
+
+#endif
+
+}
+
+#endif
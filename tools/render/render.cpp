@@ -0,0 +1,771 @@
+/*
+ * t400render - draw every screen of the firmware on a PC
+ *
+ * Builds the firmware's own display code (functions.cpp) against a frame
+ * buffer stand-in for u8glib, fills the graph with fixed data sets and
+ * renders every graph view in every unit, plus the status bar variations.
+ * Each frame is written as a PBM image, with a metrics.csv listing the draw
+ * calls it took. Render the tree before and after a change and compare the
+ * two directories to see exactly which screens it moved. tools/render/golden
+ * holds the frames of the default t400.h, and check fails if any of them
+ * changes.
+ *
+ * Draw calls are not time. Where the kernel allows it, count also records
+ * the host instructions each frame took, which compare one version of the
+ * display code with another. The board's own frame and page times come
+ * from its '# lcd' lines, in a build with INSTRUMENTATION_ENABLED.
+ *
+ * Text is drawn with a small 3x5 font in the 5x8 character cells, so the
+ * images show layout and clipping, not the real glyphs.
+ *
+ * Build:
+ *   g++ -std=gnu++11 -O2 -Itools/render/stub -It400 -o t400render \
+ *       tools/render/render.cpp t400/functions.cpp t400/stats.cpp t400/derived.cpp
+ *
+ * Usage:
+ *   t400render DIR                 Render every frame into DIR (which must exist)
+ *   t400render count DIR           The same, plus instructions.csv with the host
+ *                                  instructions each frame took
+ *   t400render compare DIR_A DIR_B List the frames that differ, exit status 1 if any do
+ *   t400render check GOLDEN_DIR    Render and compare with GOLDEN_DIR, exit status 1
+ *                                  if any frame changed
+ *   t400render bench               Draw calls per frame while logging, with and
+ *                                  without the display cache
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <cmath>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include <Arduino.h>
+#include "PaxInstruments-U8glib.h"
+#include "t400.h"
+#include "functions.h"
+#include "derived.h"
+#include "stats.h"
+#include "bus.h"
+#include "timing.h"
+
+// Hardware the display code touches
+volatile uint8_t ADCSRA, ADCSRB, ADMUX, USBCON, USBSTA;
+volatile uint16_t ADC;
+
+void pinMode(uint8_t pin, uint8_t mode) {}
+int digitalRead(uint8_t pin) { return LOW; }
+void digitalWrite(uint8_t pin, uint8_t value) {}
+unsigned long millis() { return 0; }
+
+#if SPI_BUS_ENABLED
+namespace Bus {
+void begin(Device device) {}
+void end() {}
+}
+#endif
+
+#if TIMING_HARNESS_ENABLED
+namespace Timing {
+void injectLcd() {}
+}
+#endif
+
+// Globals the display code shares with the sketch
+uint8_t btn_disable_count = 0;
+uint8_t sd_full_count = 0;
+uint8_t temperatureUnit = TEMPERATURE_UNITS_C;
+int16_t temperatures_int[SENSOR_COUNT];
+
+extern U8GLIB_PI13264 u8g;
+
+const uint8_t u8g_font_5x8r[] = { 0 };
+
+// 3x5 font, one byte per row, bit 2 is the left column
+struct Glyph {
+  char c;
+  uint8_t rows[5];
+};
+
+static const Glyph font[] = {
+  {'0', {7,5,5,5,7}}, {'1', {2,6,2,2,7}}, {'2', {7,1,7,4,7}}, {'3', {7,1,3,1,7}},
+  {'4', {5,5,7,1,1}}, {'5', {7,4,7,1,7}}, {'6', {7,4,7,5,7}}, {'7', {7,1,1,2,2}},
+  {'8', {7,5,7,5,7}}, {'9', {7,5,7,1,7}},
+  {'A', {2,5,7,5,5}}, {'B', {6,5,6,5,6}}, {'C', {3,4,4,4,3}}, {'D', {6,5,5,5,6}},
+  {'E', {7,4,6,4,7}}, {'F', {7,4,6,4,4}}, {'G', {3,4,5,5,3}}, {'H', {5,5,7,5,5}},
+  {'I', {7,2,2,2,7}}, {'J', {1,1,1,5,2}}, {'K', {5,5,6,5,5}}, {'L', {4,4,4,4,7}},
+  {'M', {5,7,7,5,5}}, {'N', {6,5,5,5,5}}, {'O', {2,5,5,5,2}}, {'P', {6,5,6,4,4}},
+  {'Q', {2,5,5,6,3}}, {'R', {6,5,6,5,5}}, {'S', {3,4,2,1,6}}, {'T', {7,2,2,2,2}},
+  {'U', {5,5,5,5,7}}, {'V', {5,5,5,5,2}}, {'W', {5,5,7,7,5}}, {'X', {5,5,2,5,5}},
+  {'Y', {5,5,2,2,2}}, {'Z', {7,1,2,4,7}},
+  {'o', {2,5,2,0,0}}, {' ', {0,0,0,0,0}}, {'-', {0,0,7,0,0}}, {'.', {0,0,0,0,2}},
+  {':', {0,2,0,2,0}}, {'/', {1,1,2,4,4}}, {'#', {5,7,5,7,5}}, {'!', {2,2,2,0,2}},
+  {'(', {1,2,2,2,1}}, {')', {4,2,2,2,4}}, {'+', {0,2,7,2,0}}, {'%', {5,1,2,4,5}},
+};
+
+static const Glyph* findGlyph(char c)
+{
+  static const Glyph unknown = {'?', {7,5,5,5,7}};
+
+  if(c >= 'a' && c <= 'z' && c != 'o') c -= 'a' - 'A';
+  for(const Glyph& g : font)
+    if(g.c == c) return &g;
+  return &unknown;
+}
+
+U8GLIB_PI13264::U8GLIB_PI13264(uint8_t cs, uint8_t a0, uint8_t reset)
+{
+  memset(frame, 0, sizeof(frame));
+  memset(&counters, 0, sizeof(counters));
+  memset(buffer, 0, sizeof(buffer));
+  memset(&pb, 0, sizeof(pb));
+  pb.p.page_height = 8;
+  pb.p.total_height = U8G_DISPLAY_HEIGHT;
+  pb.width = U8G_DISPLAY_WIDTH;
+  pb.buf = buffer;
+  panel.dev_fn = NULL;
+  panel.dev_mem = &pb;
+  rotation.dev_fn = NULL;
+  rotation.dev_mem = &panel;
+  u8g.width = U8G_DISPLAY_WIDTH;
+  u8g.height = U8G_DISPLAY_HEIGHT;
+  u8g.dev = &rotation;
+}
+
+uint8_t u8g_call_dev_fn(u8g_t* u8g, u8g_dev_t* dev, uint8_t msg, void* arg)
+{
+  return 0;
+}
+
+void U8GLIB_PI13264::firstPage()
+{
+  memset(buffer, 0, sizeof(buffer));
+  pb.p.page = 0;
+  pb.p.page_y0 = 0;
+  pb.p.page_y1 = pb.p.page_height - 1;
+  counters.pages++;
+}
+
+// Send the page buffer to the panel, then move on to the next page
+uint8_t U8GLIB_PI13264::nextPage()
+{
+  for(int row = 0; row < 8; row++)
+    for(int column = 0; column < U8G_DISPLAY_WIDTH; column++)
+      frame[U8G_DISPLAY_HEIGHT - 1 - (pb.p.page_y0 + row)][U8G_DISPLAY_WIDTH - 1 - column] =
+        (buffer[column] >> row) & 1;
+  memset(buffer, 0, sizeof(buffer));
+
+  pb.p.page_y0 += pb.p.page_height;
+  if(pb.p.page_y0 >= pb.p.total_height) return 0;
+  pb.p.page_y1 += pb.p.page_height;
+  pb.p.page++;
+  counters.pages++;
+  return 1;
+}
+
+// The screen is rotated 180 degrees, so page 0 is its bottom band and
+// column 0 its right edge. Each byte holds a column of the page, top row
+// in bit 0, as in u8glib's pb8v1 buffers.
+void U8GLIB_PI13264::plot(int x, int y)
+{
+  int row = (U8G_DISPLAY_HEIGHT - 1 - y) - pb.p.page_y0;
+
+  if(x < 0 || x >= U8G_DISPLAY_WIDTH) return;
+  if(row < 0 || row >= 8) return;
+  buffer[U8G_DISPLAY_WIDTH - 1 - x] |= 1 << row;
+  counters.plotted++;
+}
+
+void U8GLIB_PI13264::drawPixel(uint8_t x, uint8_t y)
+{
+  counters.pixels++;
+  plot(x, y);
+}
+
+void U8GLIB_PI13264::drawLine(uint8_t x1, uint8_t y1, uint8_t x2, uint8_t y2)
+{
+  int x = x1, y = y1;
+  int dx = abs(x2 - x1), sx = (x1 < x2) ? 1 : -1;
+  int dy = -abs(y2 - y1), sy = (y1 < y2) ? 1 : -1;
+  int error = dx + dy;
+
+  counters.lines++;
+  for(;;) {
+    plot(x, y);
+    if(x == x2 && y == y2) break;
+    if(2*error >= dy) { error += dy; x += sx; }
+    if(2*error <= dx) { error += dx; y += sy; }
+  }
+}
+
+uint8_t U8GLIB_PI13264::drawStr(uint8_t x, uint8_t y, const char* s)
+{
+  uint8_t width = 0;
+
+  counters.strings++;
+  for(; *s; s++, width += CHARACTER_SPACING) {
+    const Glyph* g = findGlyph(*s);
+    counters.characters++;
+    for(int row = 0; row < 5; row++)
+      for(int column = 0; column < 3; column++)
+        if(g->rows[row] & (4 >> column))
+          plot(x + width + 1 + column, y - 5 + row);
+  }
+  return width;
+}
+
+// Data sets. Each fills the graph with rows of SENSOR_COUNT readings in 1/10 C.
+struct DataSet {
+  const char* name;
+  void (*row)(uint16_t n, int16_t* values);
+};
+
+// Around room temperature, two digit axis labels
+static void roomRow(uint16_t n, int16_t* values)
+{
+  for(uint8_t s = 0; s < SENSOR_COUNT; s++)
+    values[s] = 215 + 10*s + (int16_t)(15*sin((n + 7*s)/9.0));
+  if(SENSOR_COUNT > 3) values[3] = OUT_OF_RANGE_INT;
+  return;
+}
+
+// Heating up to a few hundred degrees, three digit labels
+static void ovenRow(uint16_t n, int16_t* values)
+{
+  for(uint8_t s = 0; s < SENSOR_COUNT; s++)
+    values[s] = 200 + n*(25 - 4*s) + (int16_t)(20*sin(n/5.0));
+  return;
+}
+
+// The ends of the thermocouple range and a channel dropping in and out
+static void extremesRow(uint16_t n, int16_t* values)
+{
+  for(uint8_t s = 0; s < SENSOR_COUNT; s++) values[s] = 250;
+  values[0] = (n < 60) ? -2732 : 30000;
+  if(SENSOR_COUNT > 1) values[1] = (n % 20 < 10) ? 30000 : -2732;
+  if(SENSOR_COUNT > 2) values[2] = (n % 7 == 0) ? OUT_OF_RANGE_INT : 1000 + 20*n;
+  return;
+}
+
+static const DataSet dataSets[] = {
+  {"room", roomRow},
+  {"oven", ovenRow},
+  {"extremes", extremesRow},
+};
+
+#define DATA_ROWS   120
+
+// Take row n of a data set as a sample
+static void addRow(const DataSet& set, uint16_t n)
+{
+  int16_t values[GRAPH_ROWS];
+
+  set.row(n, values);
+  #if DERIVED_CHANNELS_ENABLED
+  Derived::update(values);
+  #endif
+  #if STATS_ENABLED
+  Stats::update(values);
+  #endif
+  updateGraphData(values);
+  memcpy(temperatures_int, values, sizeof(temperatures_int));
+  return;
+}
+
+static void loadDataSet(const DataSet& set)
+{
+  resetGraph();
+  #if DERIVED_CHANNELS_ENABLED
+  Derived::reset(1);
+  #endif
+  #if STATS_ENABLED
+  Stats::reset();
+  #endif
+  for(uint16_t n = 0; n < DATA_ROWS; n++) addRow(set, n);
+  return;
+}
+
+// One screen to render
+struct Frame {
+  std::string name;
+  uint8_t graphChannel;
+  uint8_t unit;
+  const char* fileName;
+  uint8_t logInterval;
+  ChargeStatus::State battery;
+  uint8_t batteryLevel;
+  uint16_t batteryMinutes;
+  uint8_t btnDisable;
+  uint8_t sdFull;
+  bool live;                // Then redraw only the readings row, with new conversions
+};
+
+static const char* unitNames[TEMPERATURE_UNITS_COUNT] = {"C", "F", "K"};
+
+static bool writeFrame(const std::string& path)
+{
+  FILE* f = fopen(path.c_str(), "wb");
+
+  if(!f) {
+    perror(path.c_str());
+    return false;
+  }
+  fprintf(f, "P1\n%d %d\n", U8G_DISPLAY_WIDTH, U8G_DISPLAY_HEIGHT);
+  for(int y = 0; y < U8G_DISPLAY_HEIGHT; y++) {
+    for(int x = 0; x < U8G_DISPLAY_WIDTH; x++)
+      fputc(u8g.frame[y][x] ? '1' : '0', f);
+    fputc('\n', f);
+  }
+  return fclose(f) == 0;
+}
+
+static double now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec/1e9;
+}
+
+// Host instructions spent drawing, from the CPU's own counter where the
+// kernel lets us have it. These are x86 or ARM instructions, not AVR
+// cycles, so they only compare one version of the display code with
+// another. The board reports its real frame time as '# lcd' lines when it
+// is built with INSTRUMENTATION_ENABLED.
+static int instructionCounter = -1;
+
+static bool openInstructionCounter()
+{
+  #ifdef __linux__
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  instructionCounter = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  #endif
+  return instructionCounter >= 0;
+}
+
+static void startInstructions()
+{
+  #ifdef __linux__
+  if(instructionCounter < 0) return;
+  ioctl(instructionCounter, PERF_EVENT_IOC_RESET, 0);
+  ioctl(instructionCounter, PERF_EVENT_IOC_ENABLE, 0);
+  #endif
+  return;
+}
+
+static uint64_t stopInstructions()
+{
+  uint64_t count = 0;
+
+  #ifdef __linux__
+  if(instructionCounter < 0) return 0;
+  ioctl(instructionCounter, PERF_EVENT_IOC_DISABLE, 0);
+  if(read(instructionCounter, &count, sizeof(count)) != sizeof(count)) count = 0;
+  #endif
+  return count;
+}
+
+// Draw a frame and record what it took
+// @param instructions Where the host instruction counts go, or NULL
+static bool render(const char* dir, const Frame& frame, FILE* metrics, FILE* instructions)
+{
+  uint32_t lit = 0;
+  uint64_t count;
+  char fileName[16];
+  char* name = NULL;
+
+  temperatureUnit = frame.unit;
+  btn_disable_count = frame.btnDisable;
+  sd_full_count = frame.sdFull;
+  if(frame.fileName) {
+    strcpy(fileName, frame.fileName);
+    name = fileName;
+  }
+
+  updateGraphScaling(frame.graphChannel);
+  memset(&u8g.counters, 0, sizeof(u8g.counters));
+  startInstructions();
+  draw(frame.graphChannel, frame.unit, name, frame.logInterval,
+       frame.battery, frame.batteryLevel, frame.batteryMinutes);
+  count = stopInstructions();
+
+  #if LIVE_READINGS_ENABLED
+  if(frame.live) {
+    int16_t saved[SENSOR_COUNT];
+
+    // The metrics are for the partial redraw alone
+    memcpy(saved, temperatures_int, sizeof(saved));
+    for(uint8_t s = 0; s < SENSOR_COUNT; s++)
+      if(temperatures_int[s] != OUT_OF_RANGE_INT) temperatures_int[s] += 123;
+    memset(&u8g.counters, 0, sizeof(u8g.counters));
+    startInstructions();
+    drawReadings(frame.graphChannel);
+    count = stopInstructions();
+    memcpy(temperatures_int, saved, sizeof(saved));
+  }
+  #endif
+
+  for(int y = 0; y < U8G_DISPLAY_HEIGHT; y++)
+    for(int x = 0; x < U8G_DISPLAY_WIDTH; x++)
+      lit += u8g.frame[y][x];
+
+  fprintf(metrics, "%s, %u, %u, %u, %u, %u, %u, %u\n", frame.name.c_str(),
+          u8g.counters.pages, u8g.counters.lines, u8g.counters.pixels,
+          u8g.counters.strings, u8g.counters.characters, u8g.counters.plotted, lit);
+  if(instructions) fprintf(instructions, "%s, %llu\n", frame.name.c_str(), (unsigned long long)count);
+  return writeFrame(std::string(dir) + "/" + frame.name + ".pbm");
+}
+
+// Render every frame into dir
+// @param countInstructions Also write instructions.csv, with the host
+//        instructions each frame took
+static int renderAll(const char* dir, bool countInstructions)
+{
+  std::vector<Frame> frames;
+  std::string path = std::string(dir) + "/metrics.csv";
+  FILE* metrics = fopen(path.c_str(), "w");
+  FILE* instructions = NULL;
+  Frame base = {"", 0, TEMPERATURE_UNITS_C, "LD0001.CSV", 1, ChargeStatus::CHARGED, 4, RUNTIME_UNKNOWN, 0, 0, false};
+  double drawTime = 0;
+  uint32_t count = 0;
+
+  if(!metrics) {
+    perror(path.c_str());
+    return 1;
+  }
+  fprintf(metrics, "frame, pages, lines, pixels, strings, characters, plotted, lit\n");
+
+  if(countInstructions) {
+    std::string countPath = std::string(dir) + "/instructions.csv";
+
+    if(!openInstructionCounter()) {
+      fprintf(stderr, "no instruction counter on this host, see perf_event_paranoid\n");
+      fclose(metrics);
+      return 1;
+    }
+    instructions = fopen(countPath.c_str(), "w");
+    if(!instructions) {
+      perror(countPath.c_str());
+      fclose(metrics);
+      return 1;
+    }
+    fprintf(instructions, "frame, host instructions\n");
+  }
+
+  for(const DataSet& set : dataSets) {
+    loadDataSet(set);
+    frames.clear();
+
+    // Every view in every unit
+    for(uint8_t view = 0; view < GRAPH_CHANNELS_COUNT; view++) {
+      for(uint8_t unit = 0; unit < TEMPERATURE_UNITS_COUNT; unit++) {
+        Frame f = base;
+        f.name = std::string(set.name) + "-view" + std::to_string(view) + "-" + unitNames[unit];
+        f.graphChannel = view;
+        f.unit = unit;
+        frames.push_back(f);
+      }
+    }
+
+    // Status bar variations, on the first view only
+    if(&set == &dataSets[0]) {
+      static const struct {
+        const char* name;
+        ChargeStatus::State state;
+        uint8_t level;
+        uint16_t minutes;
+      } batteries[] = {
+        {"discharging", ChargeStatus::DISCHARGING, 2, RUNTIME_UNKNOWN},
+        {"runtime", ChargeStatus::DISCHARGING, 3, 135},
+        {"runtime-long", ChargeStatus::DISCHARGING, 4, 1500},
+        {"empty", ChargeStatus::DISCHARGING, 0, 4},
+        {"charging", ChargeStatus::CHARGING, 0, RUNTIME_UNKNOWN},
+        {"charged", ChargeStatus::CHARGED, 4, RUNTIME_UNKNOWN},
+        {"no-battery", ChargeStatus::NO_BATTERY, 0, RUNTIME_UNKNOWN},
+      };
+      static const uint8_t intervals[] = {0, 1, 60};
+
+      for(const auto& b : batteries) {
+        Frame f = base;
+        f.name = std::string("status-battery-") + b.name;
+        f.battery = b.state;
+        f.batteryLevel = b.level;
+        f.batteryMinutes = b.minutes;
+        frames.push_back(f);
+      }
+      for(uint8_t interval : intervals) {
+        Frame f = base;
+        f.name = "status-interval-" + std::to_string(interval);
+        f.logInterval = interval;
+        frames.push_back(f);
+      }
+      {
+        Frame f = base;
+        f.name = "status-not-logging";
+        f.fileName = NULL;
+        frames.push_back(f);
+        f = base;
+        f.name = "status-disabled";
+        f.btnDisable = 1;
+        frames.push_back(f);
+        f = base;
+        f.name = "status-sd-full";
+        f.sdFull = 1;
+        frames.push_back(f);
+      }
+      #if LIVE_READINGS_ENABLED
+      // Readings row updated between samples, over a bank and a derived view
+      {
+        Frame f = base;
+        f.name = "live-readings-bank";
+        f.graphChannel = SENSOR_COUNT;
+        f.live = true;
+        frames.push_back(f);
+        #if DERIVED_COUNT > 0
+        f.name = "live-readings-derived";
+        f.graphChannel = GRAPH_DERIVED_VIEW;
+        frames.push_back(f);
+        #endif
+      }
+      #endif
+    }
+
+    for(const Frame& f : frames) {
+      double start = now();
+      if(!render(dir, f, metrics, instructions)) {
+        fclose(metrics);
+        if(instructions) fclose(instructions);
+        return 1;
+      }
+      drawTime += now() - start;
+      count++;
+    }
+  }
+
+  if(instructions && fclose(instructions) != 0) {
+    perror(dir);
+    fclose(metrics);
+    return 1;
+  }
+  if(fclose(metrics) != 0) {
+    perror(path.c_str());
+    return 1;
+  }
+  // Host timing says little about the AVR, so keep it out of the files
+  fprintf(stderr, "%u frames, %.1f us per frame on this host\n", count, 1e6*drawTime/count);
+  return 0;
+}
+
+#if DISPLAY_CACHE_ENABLED
+#define BENCH_SAMPLES   60
+
+// Draw BENCH_SAMPLES frames of the first bank while samples come in, as the
+// sketch does when logging, and total their draw calls
+static U8gCounters benchRun(const DataSet& set, bool cached)
+{
+  U8gCounters total;
+
+  memset(&total, 0, sizeof(total));
+  loadDataSet(set);
+  resetDisplayCache();
+  for(uint16_t n = 0; n < BENCH_SAMPLES; n++) {
+    addRow(set, DATA_ROWS + n);
+    updateGraphScaling(SENSOR_COUNT);
+    if(!cached) resetDisplayCache();
+    memset(&u8g.counters, 0, sizeof(u8g.counters));
+    draw(SENSOR_COUNT, TEMPERATURE_UNITS_C, (char*)"LD0001.CSV", 1,
+         ChargeStatus::DISCHARGING, 3, 135);
+    total.lines += u8g.counters.lines;
+    total.pixels += u8g.counters.pixels;
+    total.strings += u8g.counters.strings;
+    total.characters += u8g.counters.characters;
+  }
+  return total;
+}
+
+static int bench()
+{
+  printf("data set, cache, lines, pixels, strings, characters per frame\n");
+  for(const DataSet& set : dataSets) {
+    U8gCounters before = benchRun(set, false);
+    U8gCounters after = benchRun(set, true);
+
+    printf("%s, off, %.1f, %.1f, %.1f, %.1f\n", set.name, (double)before.lines/BENCH_SAMPLES,
+           (double)before.pixels/BENCH_SAMPLES, (double)before.strings/BENCH_SAMPLES,
+           (double)before.characters/BENCH_SAMPLES);
+    printf("%s, on, %.1f, %.1f, %.1f, %.1f\n", set.name, (double)after.lines/BENCH_SAMPLES,
+           (double)after.pixels/BENCH_SAMPLES, (double)after.strings/BENCH_SAMPLES,
+           (double)after.characters/BENCH_SAMPLES);
+  }
+  return 0;
+}
+#endif
+
+// Read a PBM written by writeFrame()
+static bool readFrame(const std::string& path, std::vector<uint8_t>* pixels)
+{
+  FILE* f = fopen(path.c_str(), "rb");
+  int width, height;
+  int c;
+
+  if(!f) return false;
+  if(fscanf(f, "P1 %d %d", &width, &height) != 2) {
+    fclose(f);
+    return false;
+  }
+  pixels->clear();
+  while((c = fgetc(f)) != EOF)
+    if(c == '0' || c == '1') pixels->push_back(c == '1');
+  fclose(f);
+  return pixels->size() == (size_t)(width*height);
+}
+
+// Metrics rows by frame name, without the name
+static std::map<std::string, std::string> readMetrics(const std::string& dir)
+{
+  std::map<std::string, std::string> rows;
+  FILE* f = fopen((dir + "/metrics.csv").c_str(), "r");
+  char line[256];
+
+  if(!f) return rows;
+  while(fgets(line, sizeof(line), f)) {
+    char* comma = strchr(line, ',');
+    if(!comma) continue;
+    line[strcspn(line, "\r\n")] = 0;
+    rows[std::string(line, comma - line)] = comma + 1;
+  }
+  fclose(f);
+  return rows;
+}
+
+// @return The frame names of the PBMs in dir, sorted
+static std::vector<std::string> frameNames(const char* dir)
+{
+  std::vector<std::string> names;
+  DIR* d = opendir(dir);
+  struct dirent* entry;
+
+  if(!d) return names;
+  while((entry = readdir(d)) != NULL) {
+    std::string name = entry->d_name;
+    if(name.size() > 4 && name.compare(name.size() - 4, 4, ".pbm") == 0)
+      names.push_back(name.substr(0, name.size() - 4));
+  }
+  closedir(d);
+  std::sort(names.begin(), names.end());
+  return names;
+}
+
+static int compare(const char* a, const char* b)
+{
+  std::map<std::string, std::string> metricsA = readMetrics(a);
+  std::map<std::string, std::string> metricsB = readMetrics(b);
+  std::vector<uint8_t> pixelsA, pixelsB;
+  std::vector<std::string> names = frameNames(a);
+  std::vector<std::string> namesB = frameNames(b);
+  uint32_t changed = 0;
+  uint32_t callsChanged = 0;
+
+  if(names.empty()) {
+    fprintf(stderr, "%s: no frames\n", a);
+    return 2;
+  }
+
+  for(const std::string& name : names) {
+    uint32_t diff = 0;
+
+    if(!readFrame(std::string(a) + "/" + name + ".pbm", &pixelsA)) {
+      fprintf(stderr, "%s/%s.pbm: unreadable\n", a, name.c_str());
+      return 2;
+    }
+    if(!readFrame(std::string(b) + "/" + name + ".pbm", &pixelsB)) {
+      printf("%s: missing from %s\n", name.c_str(), b);
+      changed++;
+      continue;
+    }
+    for(size_t i = 0; i < pixelsA.size() && i < pixelsB.size(); i++)
+      diff += pixelsA[i] != pixelsB[i];
+    if(diff) {
+      printf("%s: %u pixels differ\n", name.c_str(), diff);
+      changed++;
+    }
+    if(metricsA[name] != metricsB[name]) {
+      printf("%s: draw calls%s ->%s\n", name.c_str(), metricsA[name].c_str(), metricsB[name].c_str());
+      callsChanged++;
+    }
+  }
+
+  // Frames that are new in b
+  for(const std::string& name : namesB) {
+    if(std::binary_search(names.begin(), names.end(), name)) continue;
+    printf("%s: missing from %s\n", name.c_str(), a);
+    changed++;
+  }
+
+  printf("%zu frames, %u differ, %u changed draw calls\n", names.size(), changed, callsChanged);
+  return changed ? 1 : 0;
+}
+
+// Render into a scratch directory and compare it with the golden frames.
+// Only the images decide the result, a change of draw calls is listed.
+static int check(const char* golden)
+{
+  char dir[] = "/tmp/t400render.XXXXXX";
+  int result;
+
+  if(!mkdtemp(dir)) {
+    perror("mkdtemp");
+    return 2;
+  }
+  result = renderAll(dir, false);
+  if(result == 0) result = compare(golden, dir);
+  if(result == 1)
+    printf("If the change is meant, render into %s again and commit the frames with it\n", golden);
+
+  for(const std::string& name : frameNames(dir)) unlink((std::string(dir) + "/" + name + ".pbm").c_str());
+  unlink((std::string(dir) + "/metrics.csv").c_str());
+  rmdir(dir);
+  return result;
+}
+
+static int usage()
+{
+  fprintf(stderr,
+    "usage: t400render DIR\n"
+    "       t400render count DIR\n"
+    "       t400render compare DIR_A DIR_B\n"
+    "       t400render check GOLDEN_DIR\n"
+    "       t400render bench\n");
+  return 2;
+}
+
+int main(int argc, char** argv)
+{
+  if(argc == 4 && strcmp(argv[1], "compare") == 0) return compare(argv[2], argv[3]);
+  if(argc == 3 && strcmp(argv[1], "check") == 0) return check(argv[2]);
+  if(argc == 3 && strcmp(argv[1], "count") == 0) return renderAll(argv[2], true);
+  #if DISPLAY_CACHE_ENABLED
+  if(argc == 2 && strcmp(argv[1], "bench") == 0) return bench();
+  #endif
+  if(argc == 2) return renderAll(argv[1], false);
+  return usage();
+}
@@ -0,0 +1,62 @@
+/*
+ * Just enough of the Arduino core to build the display code and the
+ * calibration on a PC
+ */
+
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <avr/interrupt.h>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH    1
+#define LOW     0
+#define INPUT   0
+#define OUTPUT  1
+#define DEC     10
+
+// Leonardo pin numbers of the analog inputs
+#define A0      18
+#define A1      19
+#define A2      20
+#define A3      21
+#define A4      22
+#define A5      23
+#define A7      25
+#define A11     29
+
+#define noInterrupts()  cli()
+#define interrupts()    sei()
+
+// The serial port and the transmit ring, for the calibration command
+class Print {
+public:
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t* buffer, size_t size);
+  size_t println(const char* s);
+};
+
+class Serial_ : public Print {
+public:
+  virtual size_t write(uint8_t c);
+  using Print::write;
+  int available();
+  int read();
+};
+
+extern Serial_ Serial;
+
+void pinMode(uint8_t pin, uint8_t mode);
+int digitalRead(uint8_t pin);
+void digitalWrite(uint8_t pin, uint8_t value);
+unsigned long millis();
+
+#endif
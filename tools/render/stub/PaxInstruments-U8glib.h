@@ -0,0 +1,104 @@
+/*
+ * Frame buffer stand-in for the PI13264 LCD driver. It keeps u8glib's
+ * picture loop: the screen is drawn as 8 pages of 8 rows, each pass only
+ * keeps what falls on the current page, and each page is copied to the
+ * panel as it ends. The page buffer is laid out like u8glib's, a byte per
+ * column of the page with the rotation applied, for code that moves the
+ * loop to a single page or copies bands in and out. Text uses a 3x5 font on
+ * the 5x8 cell of u8g_font_5x8r, so positions match but glyphs don't.
+ */
+
+#ifndef PAXINSTRUMENTS_U8GLIB_H
+#define PAXINSTRUMENTS_U8GLIB_H
+
+#include <stdint.h>
+
+#define U8G_DISPLAY_WIDTH     132
+#define U8G_DISPLAY_HEIGHT    64
+#define U8G_DISPLAY_PAGES     8
+
+extern const uint8_t u8g_font_5x8r[];
+
+typedef uint8_t u8g_uint_t;
+
+typedef struct _u8g_page_t {
+  u8g_uint_t page_height;
+  u8g_uint_t total_height;
+  u8g_uint_t page_y0;
+  u8g_uint_t page_y1;
+  uint8_t page;
+} u8g_page_t;
+
+typedef struct _u8g_pb_t {
+  u8g_page_t p;
+  u8g_uint_t width;
+  void* buf;
+} u8g_pb_t;
+
+typedef struct _u8g_box_t {
+  u8g_uint_t x0, y0, x1, y1;
+} u8g_box_t;
+
+typedef struct _u8g_dev_t {
+  uint8_t (*dev_fn)(void* u8g, void* dev, uint8_t msg, void* arg);
+  void* dev_mem;
+  void* com_fn;
+} u8g_dev_t;
+
+typedef struct _u8g_t {
+  u8g_uint_t width;
+  u8g_uint_t height;
+  u8g_dev_t* dev;
+  u8g_box_t current_page;
+} u8g_t;
+
+#define U8G_DEV_MSG_GET_PAGE_BOX    23
+
+uint8_t u8g_call_dev_fn(u8g_t* u8g, u8g_dev_t* dev, uint8_t msg, void* arg);
+
+// Counts of what a frame did, a rough stand-in for its cost on the device
+struct U8gCounters {
+  uint32_t pages;           // Passes of the picture loop
+  uint32_t lines;           // drawLine() calls
+  uint32_t pixels;          // drawPixel() calls
+  uint32_t strings;         // drawStr() calls
+  uint32_t characters;      // Characters in those strings
+  uint32_t plotted;         // Pixels that landed on the page being drawn
+};
+
+class U8GLIB_PI13264 {
+public:
+  U8GLIB_PI13264(uint8_t cs, uint8_t a0, uint8_t reset);
+
+  void setContrast(uint8_t contrast) {}
+  void setRot180() {}
+  void setColorIndex(uint8_t index) {}
+  void setFont(const uint8_t* font) {}
+  void sleepOn() {}
+  void sleepOff() {}
+
+  void firstPage();
+  uint8_t nextPage();
+
+  void drawPixel(uint8_t x, uint8_t y);
+  void drawLine(uint8_t x1, uint8_t y1, uint8_t x2, uint8_t y2);
+  uint8_t drawStr(uint8_t x, uint8_t y, const char* s);
+
+  u8g_t* getU8g() { return &u8g; }
+
+  // What the panel shows, one byte per pixel, and what it took to draw it
+  uint8_t frame[U8G_DISPLAY_HEIGHT][U8G_DISPLAY_WIDTH];
+  U8gCounters counters;
+
+private:
+  void plot(int x, int y);
+
+  // The rotation wraps the panel, whose memory is the page buffer
+  u8g_t u8g;
+  u8g_dev_t rotation;
+  u8g_dev_t panel;
+  u8g_pb_t pb;
+  uint8_t buffer[U8G_DISPLAY_WIDTH];
+};
+
+#endif
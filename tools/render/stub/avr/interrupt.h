@@ -0,0 +1,9 @@
+#ifndef AVR_INTERRUPT_H
+#define AVR_INTERRUPT_H
+
+inline void cli() {}
+inline void sei() {}
+
+#define ISR(vector) extern "C" void vector(void)
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef AVR_IO_H
+#define AVR_IO_H
+
+#include <stdint.h>
+
+#define _BV(b) (1 << (b))
+
+// Registers touched by the battery measurement, as plain variables
+extern volatile uint8_t ADCSRA, ADCSRB, ADMUX, USBCON, USBSTA;
+extern volatile uint16_t ADC;
+
+#define ADSC    6
+#define ADIE    3
+#define MUX5    5
+#define REFS0   6
+#define VBUS    0
+#define OTGPADE 4
+
+#endif
@@ -0,0 +1,427 @@
+/*
+ * t400agg - merge the serial output of many T400s into one timeline
+ *
+ * Reads every port from a single thread with epoll. Lines are split in
+ * place in each port's receive buffer. Rows are tagged with the port and
+ * the host time they were received, then written out in time order. Each
+ * row is timed from when its first character was sent. That is the receive
+ * time less the line's transmission time at the port's baud rate, so a
+ * short line can overtake a long one. Rows are held for a short reorder
+ * window to put them back in order. The window is bounded in both time and
+ * row count, so memory stays fixed however many ports there are.
+ *
+ * Linux only. Build:
+ *   g++ -O2 -std=c++17 -o t400agg tools/t400agg.cpp
+ *
+ * Usage:
+ *   t400agg [-o FILE] [-w MS] [-b BAUD] PORT...   Aggregate ports (Ctrl-C to stop)
+ *   t400agg sim DEVICES [INTERVAL_MS]             Simulate devices on pseudo-terminals,
+ *                                                 printing the port names
+ *   t400agg bench DEVICES SECONDS [BAUD]          Time the aggregator against simulated
+ *                                                 devices, BAUD 0 sends as fast as possible
+ *
+ * Output lines:
+ *   <host time>, <port>, <device row as sent>
+ *   # <port>: <header or message line from the device>
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../t400/row_format.h"   // The logger's own row formatter
+
+#define RECEIVE_BUFFER      1024      // Longest line kept from a port, the logger's are < 200
+#define MAX_PENDING         65536     // Rows held for reordering, across all ports
+#define DEFAULT_WINDOW_MS   250
+#define DEFAULT_BAUD        9600
+
+static volatile sig_atomic_t stopping = 0;
+
+static void onSignal(int) { stopping = 1; }
+
+static uint64_t nowMicros()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+// Raw mode, so the line discipline doesn't echo, buffer or translate
+static void makeRaw(int fd, int baud)
+{
+  struct termios tio;
+  if(tcgetattr(fd, &tio) != 0) return;
+  cfmakeraw(&tio);
+  if(baud == 9600) { cfsetispeed(&tio, B9600); cfsetospeed(&tio, B9600); }
+  else if(baud == 115200) { cfsetispeed(&tio, B115200); cfsetospeed(&tio, B115200); }
+  tcsetattr(fd, TCSANOW, &tio);
+}
+
+struct Port {
+  int fd;
+  std::string name;
+  char buffer[RECEIVE_BUFFER];
+  size_t used = 0;
+  uint64_t rows = 0;
+  uint64_t overlong = 0;      // Lines cut because they didn't fit the buffer
+};
+
+struct Pending {
+  uint64_t sentMicros;        // Estimated time the device started sending the line
+  uint64_t receivedMicros;
+  uint64_t sequence;          // Arrival order, to keep ties stable
+  uint32_t port;
+  std::string text;
+
+  bool operator>(const Pending& o) const {
+    if(sentMicros != o.sentMicros) return sentMicros > o.sentMicros;
+    return sequence > o.sequence;
+  }
+};
+
+class Aggregator {
+public:
+  Aggregator(FILE* out, uint32_t windowMicros, int baud)
+    : out_(out), windowMicros_(windowMicros), baud_(baud) {
+    epoll_ = epoll_create1(0);
+  }
+  ~Aggregator() {
+    for(Port* p : ports_) { close(p->fd); delete p; }
+    close(epoll_);
+  }
+
+  bool add(int fd, const std::string& name) {
+    struct epoll_event ev;
+    Port* p = new Port();
+    p->fd = fd;
+    p->name = name;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    ev.events = EPOLLIN;
+    ev.data.u32 = ports_.size();
+    if(epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &ev) != 0) { delete p; return false; }
+    ports_.push_back(p);
+    open_++;
+    return true;
+  }
+
+  // Run until stopped or every port has closed
+  void run() {
+    struct epoll_event events[64];
+    while(!stopping && open_ > 0) {
+      int n = epoll_wait(epoll_, events, 64, windowMicros_/2000 + 1);
+      if(n < 0 && errno != EINTR) break;
+      for(int i = 0; i < n; i++) service(events[i].data.u32);
+      flush(false);
+    }
+    flush(true);
+  }
+
+  uint64_t rows() const { return rows_; }
+  uint64_t bytes() const { return bytes_; }
+  size_t peakPending() const { return peakPending_; }
+
+private:
+  void service(uint32_t index) {
+    Port* p = ports_[index];
+    for(;;) {
+      ssize_t n = read(p->fd, p->buffer + p->used, RECEIVE_BUFFER - p->used);
+      if(n > 0) {
+        bytes_ += n;
+        p->used += n;
+        split(index, nowMicros());
+        continue;
+      }
+      if(n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+      // EOF, or EIO once the other end of a pty has gone
+      fprintf(stderr, "%s: closed after %llu rows\n", p->name.c_str(), (unsigned long long)p->rows);
+      epoll_ctl(epoll_, EPOLL_CTL_DEL, p->fd, nullptr);
+      open_--;
+      return;
+    }
+  }
+
+  // Hand each complete line in the buffer to queue(), then move the partial
+  // line that's left to the front
+  void split(uint32_t index, uint64_t received) {
+    Port* p = ports_[index];
+    char* start = p->buffer;
+    char* end = p->buffer + p->used;
+    char* eol;
+
+    while((eol = static_cast<char*>(memchr(start, '\n', end - start))) != nullptr) {
+      char* lineEnd = eol;
+      if(lineEnd > start && lineEnd[-1] == '\r') lineEnd--;
+      if(lineEnd > start) queue(index, start, lineEnd - start, received);
+      start = eol + 1;
+    }
+
+    if(start == p->buffer && p->used == RECEIVE_BUFFER) {
+      // No end of line in a full buffer, the port isn't sending rows
+      p->overlong++;
+      p->used = 0;
+      return;
+    }
+    p->used = end - start;
+    memmove(p->buffer, start, p->used);
+  }
+
+  void queue(uint32_t index, const char* line, size_t length, uint64_t received) {
+    Pending row;
+    // 10 bits per character on the wire
+    uint64_t sending = baud_ ? (uint64_t)(length + 1)*10*1000000/baud_ : 0;
+
+    row.receivedMicros = received;
+    row.sentMicros = received - std::min(received, sending);
+    row.sequence = sequence_++;
+    row.port = index;
+    row.text.assign(line, length);
+    pending_.push(std::move(row));
+    peakPending_ = std::max(peakPending_, pending_.size());
+
+    // Over the bound, the oldest row goes out early rather than growing
+    while(pending_.size() > MAX_PENDING) emit();
+  }
+
+  void flush(bool all) {
+    uint64_t limit = nowMicros() - windowMicros_;
+    while(!pending_.empty() && (all || pending_.top().sentMicros <= limit)) emit();
+    fflush(out_);
+  }
+
+  void emit() {
+    const Pending& row = pending_.top();
+    Port* p = ports_[row.port];
+    char c = row.text[0];
+
+    if(c >= '0' && c <= '9') {
+      fprintf(out_, "%llu.%06llu, %s, %s\n",
+              (unsigned long long)(row.receivedMicros/1000000),
+              (unsigned long long)(row.receivedMicros%1000000),
+              p->name.c_str(), row.text.c_str());
+      p->rows++;
+      rows_++;
+    }else{
+      fprintf(out_, "# %s: %s\n", p->name.c_str(), row.text.c_str());
+    }
+    pending_.pop();
+  }
+
+  FILE* out_;
+  uint32_t windowMicros_;
+  int baud_;
+  int epoll_;
+  int open_ = 0;
+  std::vector<Port*> ports_;
+  std::priority_queue<Pending, std::vector<Pending>, std::greater<Pending>> pending_;
+  uint64_t sequence_ = 0;
+  uint64_t rows_ = 0;
+  uint64_t bytes_ = 0;
+  size_t peakPending_ = 0;
+};
+
+// Simulated devices on pseudo-terminal pairs. The masters are written
+// here, the slave names are what the aggregator opens.
+struct SimDevice {
+  int master;
+  std::string slave;
+  int32_t level[4];
+  uint32_t time = 0;
+  uint64_t nextMicros = 0;
+  std::string pending;        // Part of a row the pty didn't take yet
+};
+
+static bool openPty(SimDevice& d)
+{
+  d.master = posix_openpt(O_RDWR | O_NOCTTY);
+  if(d.master < 0 || grantpt(d.master) != 0 || unlockpt(d.master) != 0) return false;
+  d.slave = ptsname(d.master);
+  makeRaw(d.master, 0);
+  fcntl(d.master, F_SETFL, fcntl(d.master, F_GETFL) | O_NONBLOCK);
+  return true;
+}
+
+// Next row from a simulated device, formatted as the logger does
+static std::string simRow(SimDevice& d, unsigned seed)
+{
+  int16_t values[4];
+  char buf[12 + 4*9];
+
+  for(int c = 0; c < 4; c++) {
+    seed = seed*1103515245 + 12345 + c;
+    d.level[c] += (int32_t)((seed >> 16) % 21) - 10;
+    d.level[c] = std::max<int32_t>(-2000, std::min<int32_t>(d.level[c], 13000));
+    values[c] = (c == 3) ? (int16_t)OUT_OF_RANGE_INT : (int16_t)d.level[c];
+  }
+  formatRow(buf, d.time++, values, 4);
+  return std::string(buf) + "\n";
+}
+
+// Drive the simulated devices until stopped. A row goes out every interval,
+// or as fast as the ptys take them if the interval is 0.
+static void simulate(std::vector<SimDevice>& devices, uint32_t intervalMicros)
+{
+  static const char header[] = "time (s), temp_0 (C), temp_1 (C), temp_2 (C), temp_3 (C)\n";
+  uint64_t start = nowMicros();
+
+  for(size_t i = 0; i < devices.size(); i++) {
+    devices[i].pending = header;
+    for(int c = 0; c < 4; c++) devices[i].level[c] = 200 + (i*37 + c*500) % 2000;
+    // Spread the devices over the interval
+    devices[i].nextMicros = start + (intervalMicros ? (i*intervalMicros)/devices.size() : 0);
+  }
+
+  while(!stopping) {
+    uint64_t now = nowMicros();
+    uint64_t next = now + 100000;
+    for(size_t i = 0; i < devices.size(); i++) {
+      SimDevice& d = devices[i];
+      if(d.pending.empty() && now >= d.nextMicros) {
+        d.pending = simRow(d, (unsigned)(i*7919 + d.time));
+        d.nextMicros += intervalMicros;
+      }
+      if(!d.pending.empty()) {
+        ssize_t n = write(d.master, d.pending.data(), d.pending.size());
+        if(n > 0) d.pending.erase(0, n);
+        else if(n < 0 && errno == EIO) return;    // Reader went away
+      }
+      next = std::min(next, d.pending.empty() ? d.nextMicros : now);
+    }
+    if(next > now) usleep(std::min<uint64_t>(next - now, 100000));
+    else if(intervalMicros == 0) usleep(50);     // Let the reader drain the ptys
+  }
+}
+
+static int usage()
+{
+  fprintf(stderr,
+    "usage: t400agg [-o FILE] [-w MS] [-b BAUD] PORT...\n"
+    "       t400agg sim DEVICES [INTERVAL_MS]\n"
+    "       t400agg bench DEVICES SECONDS [BAUD]\n");
+  return 2;
+}
+
+static int runSim(int argc, char** argv)
+{
+  std::vector<SimDevice> devices(argc > 0 ? atoi(argv[0]) : 0);
+  uint32_t interval = (argc > 1 ? atoi(argv[1]) : 500)*1000;
+
+  if(devices.empty()) return usage();
+  for(SimDevice& d : devices) {
+    if(!openPty(d)) { perror("posix_openpt"); return 1; }
+    printf("%s\n", d.slave.c_str());
+  }
+  fflush(stdout);
+  simulate(devices, interval);
+  return 0;
+}
+
+static int runBench(int argc, char** argv)
+{
+  std::vector<SimDevice> devices(argc > 1 ? atoi(argv[0]) : 0);
+  int seconds = argc > 1 ? atoi(argv[1]) : 0;
+  int baud = argc > 2 ? atoi(argv[2]) : DEFAULT_BAUD;
+  // A 4 channel row is ~40 characters, so 9600 baud carries ~24 rows/s
+  uint32_t interval = baud ? 40*10*1000000/baud : 0;
+  std::vector<int> slaves;
+  struct rusage usage;
+  uint64_t start;
+  double elapsed;
+  pid_t child;
+
+  if(devices.empty() || seconds <= 0) return ::usage();
+
+  for(SimDevice& d : devices) {
+    int fd;
+    if(!openPty(d)) { perror("posix_openpt"); return 1; }
+    fd = open(d.slave.c_str(), O_RDWR | O_NOCTTY);
+    if(fd < 0) { perror(d.slave.c_str()); return 1; }
+    makeRaw(fd, 0);
+    slaves.push_back(fd);
+  }
+
+  child = fork();
+  if(child == 0) {
+    for(int fd : slaves) close(fd);
+    simulate(devices, interval);
+    _exit(0);
+  }
+  for(SimDevice& d : devices) close(d.master);
+
+  FILE* sink = fopen("/dev/null", "w");
+  Aggregator aggregator(sink, DEFAULT_WINDOW_MS*1000, baud);
+  for(size_t i = 0; i < slaves.size(); i++) aggregator.add(slaves[i], devices[i].slave);
+
+  alarm(seconds);
+  start = nowMicros();
+  aggregator.run();
+  elapsed = (nowMicros() - start)/1e6;
+
+  kill(child, SIGTERM);
+  waitpid(child, nullptr, 0);
+  getrusage(RUSAGE_SELF, &usage);
+
+  fprintf(stderr, "%zu devices at %s: %llu rows, %.0f rows/s, %.2f MB/s, %.1f%% CPU, peak %zu rows queued\n",
+          devices.size(), baud ? (std::to_string(baud) + " baud").c_str() : "full speed",
+          (unsigned long long)aggregator.rows(), aggregator.rows()/elapsed,
+          aggregator.bytes()/1e6/elapsed,
+          100.0*(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+                 (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec)/1e6)/elapsed,
+          aggregator.peakPending());
+  fclose(sink);
+  return 0;
+}
+
+int main(int argc, char** argv)
+{
+  FILE* out = stdout;
+  uint32_t window = DEFAULT_WINDOW_MS;
+  int baud = DEFAULT_BAUD;
+  int opt;
+
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+  signal(SIGALRM, onSignal);
+  signal(SIGPIPE, SIG_IGN);
+
+  if(argc > 1 && strcmp(argv[1], "sim") == 0) return runSim(argc - 2, argv + 2);
+  if(argc > 1 && strcmp(argv[1], "bench") == 0) return runBench(argc - 2, argv + 2);
+
+  while((opt = getopt(argc, argv, "o:w:b:")) != -1) {
+    switch(opt) {
+    case 'o':
+      out = fopen(optarg, "a");
+      if(!out) { perror(optarg); return 1; }
+      break;
+    case 'w': window = atoi(optarg); break;
+    case 'b': baud = atoi(optarg); break;
+    default: return usage();
+    }
+  }
+  if(optind >= argc) return usage();
+
+  Aggregator aggregator(out, window*1000, baud);
+  for(int i = optind; i < argc; i++) {
+    int fd = open(argv[i], O_RDONLY | O_NOCTTY | O_NONBLOCK);
+    if(fd < 0) { perror(argv[i]); continue; }
+    if(isatty(fd)) makeRaw(fd, baud);
+    aggregator.add(fd, argv[i]);
+  }
+  aggregator.run();
+  fprintf(stderr, "%llu rows\n", (unsigned long long)aggregator.rows());
+  return 0;
+}
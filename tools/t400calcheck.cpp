@@ -0,0 +1,244 @@
+/*
+ * t400calcheck - check the firmware's calibration math on a PC
+ *
+ * Builds the firmware's own calibration (calibration.cpp) and checks:
+ *   - apply(), one multiply and a shift, against the same transform done
+ *     exactly in 64 bits, for every reading from -300000 to 300000 uV
+ *     under extreme coefficients. This has to be bit-exact.
+ *   - set() and get() against the gain and offset they were given, and
+ *     apply() against the transform in ppm and nV it stands for
+ *   - the default calibration against the firmware's original math,
+ *     (x*MCP3424_CALIBRATION_MUL_INT + MCP3424_CALIBRATION_ADD_INT)/10000
+ *   - that set() and, when it is built in, the 'cal' command refuse
+ *     channels and values out of range
+ *
+ * Build:
+ *   g++ -std=gnu++11 -O2 -Itools/render/stub -It400 -o t400calcheck \
+ *       tools/t400calcheck.cpp t400/calibration.cpp
+ *
+ * Usage:
+ *   t400calcheck        Exit status 1 if any check fails
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <Arduino.h>
+#include <avr/eeprom.h>
+#include "t400.h"
+#include "calibration.h"
+#include "serial_out.h"
+
+#define READING_MIN     -300000L    // Past the input clamp both ways
+#define READING_MAX     300000L
+#define ROUND_TRIPS     200000
+
+// What the calibration code needs from the sketch and the core
+boolean logging = false;
+
+static uint8_t eeprom[1024];
+
+void eeprom_read_block(void* dst, const void* src, size_t n)
+{
+  memcpy(dst, &eeprom[(size_t)src], n);
+}
+
+void eeprom_update_block(const void* src, void* dst, size_t n)
+{
+  memcpy(&eeprom[(size_t)dst], src, n);
+}
+
+size_t Print::write(const uint8_t* buffer, size_t size)
+{
+  for(size_t i = 0; i < size; i++) write(buffer[i]);
+  return size;
+}
+
+size_t Print::println(const char* s)
+{
+  return write((const uint8_t*)s, strlen(s)) + write((const uint8_t*)"\n", 1);
+}
+
+// The serial port reads commands from input and nothing is written to it
+static std::string input;
+static std::string output;
+
+Serial_ Serial;
+
+size_t Serial_::write(uint8_t c) { return 1; }
+int Serial_::available() { return input.size(); }
+int Serial_::read()
+{
+  int c = (uint8_t)input[0];
+  input.erase(0, 1);
+  return c;
+}
+
+namespace SerialOut {
+Ring port;
+size_t Ring::write(uint8_t c) { output += (char)c; return 1; }
+size_t Ring::write(const uint8_t* buffer, size_t size) { output.append((const char*)buffer, size); return size; }
+}
+
+static int failures = 0;
+
+static void check(bool ok, const char* what)
+{
+  printf("%-60s %s\n", what, ok ? "ok" : "FAILED");
+  if(!ok) failures++;
+  return;
+}
+
+static int64_t floorDiv(int64_t n, int64_t d)
+{
+  return (n >= 0) ? n/d : -((d - 1 - n)/d);
+}
+
+static int32_t clampReading(int32_t x)
+{
+  if(x > CALIBRATION_INPUT_LIMIT) return CALIBRATION_INPUT_LIMIT;
+  if(x < -CALIBRATION_INPUT_LIMIT) return -CALIBRATION_INPUT_LIMIT;
+  return x;
+}
+
+// y = floor(x*(1 + gain/65536) + offset + fraction/65536), done exactly
+static int32_t foldedReference(const Calibration::Coefficients& c, int32_t x)
+{
+  int64_t v = clampReading(x);
+
+  return floorDiv(v*(65536 + c.gain) + (int64_t)c.offset*65536 + c.fraction, 65536);
+}
+
+// y = floor(x*gainPpm/1e6 + offsetNv/1000), done exactly
+static int32_t ppmReference(int32_t gainPpm, int32_t offsetNv, int32_t x)
+{
+  int64_t v = clampReading(x);
+
+  return floorDiv(v*gainPpm + (int64_t)offsetNv*1000, 1000000);
+}
+
+static void checkFolded()
+{
+  static const int16_t gains[] = {-32768, -32767, -1, 0, 1, 465, 32767};
+  static const int16_t offsets[] = {-32768, -1, 0, 5, 32767};
+  static const uint16_t fractions[] = {0, 1, 54133, 65535};
+  long mismatches = 0;
+
+  for(int16_t g : gains)
+    for(int16_t o : offsets)
+      for(uint16_t f : fractions) {
+        Calibration::channels[0] = {g, o, f};
+        for(int32_t x = READING_MIN; x <= READING_MAX; x++)
+          if(Calibration::apply(0, x) != foldedReference(Calibration::channels[0], x)) mismatches++;
+      }
+  printf("apply() mismatches: %ld\n", mismatches);
+  check(mismatches == 0, "apply() is bit-exact against the folded transform");
+  return;
+}
+
+static void checkSetGet()
+{
+  long roundTrips = 0;
+  long applied = 0;
+  int32_t worstPpm = 0;
+  int32_t worstNv = 0;
+  int32_t worstUv = 0;
+
+  srand(1);
+  for(int i = 0; i < ROUND_TRIPS; i++) {
+    int32_t gainPpm = 500000 + rand()%999985;
+    int32_t offsetNv = rand()%65536000 - 32768000;
+    int32_t gainBack, offsetBack;
+
+    if(!Calibration::set(1, gainPpm, offsetNv)) continue;
+    Calibration::get(1, &gainBack, &offsetBack);
+    if(abs(gainBack - gainPpm) > worstPpm) worstPpm = abs(gainBack - gainPpm);
+    if(abs(offsetBack - offsetNv) > worstNv) worstNv = abs(offsetBack - offsetNv);
+    roundTrips++;
+
+    // Gain is kept in 1/65536, so the result can be a microvolt off
+    for(int32_t x = -CALIBRATION_INPUT_LIMIT; x <= CALIBRATION_INPUT_LIMIT; x += 977) {
+      int32_t error = abs(Calibration::apply(1, x) - ppmReference(gainPpm, offsetNv, x));
+      if(error > worstUv) worstUv = error;
+    }
+    applied++;
+  }
+  printf("set()/get() round trips: %ld, worst %d ppm, %d nV, apply() vs ppm math %d uV\n",
+         roundTrips, worstPpm, worstNv, worstUv);
+  check(roundTrips == ROUND_TRIPS && worstPpm <= 8 && worstNv <= 1,
+        "get() gives back what set() was given, to 8 ppm and 1 nV");
+  check(applied > 0 && worstUv <= 1, "apply() is within 1 uV of the ppm and nV transform");
+  return;
+}
+
+static void checkDefaults()
+{
+  int32_t worst = 0;
+
+  Calibration::load();    // Blank EEPROM, so the defaults
+  for(uint8_t sensor = 0; sensor < SENSOR_COUNT; sensor++)
+    for(int32_t x = -CALIBRATION_INPUT_LIMIT; x <= CALIBRATION_INPUT_LIMIT; x++) {
+      int32_t original = (x*(int64_t)MCP3424_CALIBRATION_MUL_INT + MCP3424_CALIBRATION_ADD_INT)/10000;
+      int32_t error = abs(Calibration::apply(sensor, x) - original);
+      if(error > worst) worst = error;
+    }
+  printf("default calibration vs the original math: %d uV\n", worst);
+  check(worst <= 1, "the default calibration is within 1 uV of the original math");
+  return;
+}
+
+static void checkLimits()
+{
+  Calibration::Coefficients before = Calibration::channels[0];
+
+  check(!Calibration::set(SENSOR_COUNT, 1000000, 0), "set() refuses a channel past SENSOR_COUNT");
+  check(!Calibration::set(0, 499999, 0) && !Calibration::set(0, 1499985, 0),
+        "set() refuses a gain out of range");
+  check(!Calibration::set(0, 1000000, -32768001) && !Calibration::set(0, 1000000, 32768000),
+        "set() refuses an offset out of range");
+  check(memcmp(&before, &Calibration::channels[0], sizeof(before)) == 0,
+        "a refused set() leaves the channel alone");
+  return;
+}
+
+#if CALIBRATION_COMMAND_ENABLED
+// Run one command line and return what it printed
+static std::string command(const char* line)
+{
+  input = std::string(line) + "\n";
+  output.clear();
+  Calibration::task();
+  return output;
+}
+
+static void checkCommand()
+{
+  Calibration::Coefficients before = Calibration::channels[0];
+  char line[48];
+
+  check(command("cal 256 1007130 5826").find("# cal error") == 0, "'cal 256' is refused");
+  check(memcmp(&before, &Calibration::channels[0], sizeof(before)) == 0, "'cal 256' leaves channel 0 alone");
+  sprintf(line, "cal %d 1007130 5826", SENSOR_COUNT);
+  check(command(line).find("# cal error") == 0, "'cal SENSOR_COUNT' is refused");
+  check(command("cal -1 1007130 5826").find("# cal error") == 0, "'cal -1' is refused");
+  check(command("cal 0 1000000 5826").find("# cal 0 1000000 5826\n") == 0, "'cal 0' sets channel 0");
+  command("cal reset");
+  return;
+}
+#endif
+
+int main()
+{
+  checkFolded();
+  checkSetGet();
+  checkDefaults();
+  checkLimits();
+  #if CALIBRATION_COMMAND_ENABLED
+  checkCommand();
+  #endif
+
+  if(failures) printf("%d checks failed\n", failures);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,229 @@
+/*
+ * t400convbench - time the temperature conversion chain on a PC
+ *
+ * Compares the templated conversion (t400/convert.h) with the code it
+ * replaced, which is copied here:
+ *   - graph scan: the min and max of every graph point in a unit. The old
+ *     code called convertTemperatureInt() for every point, which switched
+ *     on the global temperatureUnit in another file. The new code picks the
+ *     unit once and runs a loop specialized for it.
+ *   - acquisition: ADC microvolts to 1/10 C. The old code calibrated with
+ *     (x*MUL + ADD)/10000 from t400.h, the new one uses the per channel
+ *     multiply and shift of calibration.h.
+ * Both sides of each pair are checked to give the same results, or as
+ * close as the calibration allows, before they are timed.
+ *
+ * The thermocouple table isn't built here: both sides use the same stand-in
+ * for it, so only the code that changed is timed. Host times only show
+ * which way a change goes, an AVR has no divide instruction and no cache,
+ * so the sizes of the differences there are not the same.
+ *
+ * Build:
+ *   g++ -std=gnu++11 -O2 -Itools/render/stub -It400 -o t400convbench \
+ *       tools/t400convbench.cpp t400/calibration.cpp
+ *
+ * Usage:
+ *   t400convbench [ROUNDS]     ROUNDS of each test (default 20000)
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <Arduino.h>
+#include <avr/eeprom.h>
+#include "t400.h"
+#include "calibration.h"
+#include "serial_out.h"
+#include "convert.h"
+
+// What the calibration code needs from the sketch and the core. Nothing is
+// read from EEPROM or the serial port.
+boolean logging = false;
+
+void eeprom_read_block(void* dst, const void* src, size_t n) { memset(dst, 0xFF, n); }
+void eeprom_update_block(const void* src, void* dst, size_t n) {}
+size_t Print::write(const uint8_t* buffer, size_t size) { return size; }
+size_t Print::println(const char* s) { return 0; }
+Serial_ Serial;
+size_t Serial_::write(uint8_t c) { return 1; }
+int Serial_::available() { return 0; }
+int Serial_::read() { return -1; }
+namespace SerialOut {
+Ring port;
+size_t Ring::write(uint8_t c) { return 1; }
+size_t Ring::write(const uint8_t* buffer, size_t size) { return size; }
+}
+
+// Stand-ins for the thermocouple table, the same for both sides: about 40
+// uV per degree, as a type K is near room temperature
+int32_t celcius_to_microvolts(int16_t celcius) { return (int32_t)celcius*4; }
+int16_t microvolts_to_celcius(int32_t microVolts) { return microVolts/4; }
+
+#define ADC_READINGS    1024
+
+// The same as functions.cpp
+#define TEMP_MAX_VALUE_I    (32760)
+#define TEMP_MIN_VALUE_I    (-32760)
+
+int16_t graphData[GRAPH_ROWS][GRAPH_POINTS];
+int32_t readings[ADC_READINGS];
+
+// The old code, as it was in t400.ino and functions.cpp. The unit lived in
+// t400.ino and the conversion was called from functions.cpp, so it was
+// never inlined into the scan.
+uint8_t temperatureUnit = TEMPERATURE_UNITS_C;
+
+__attribute__((noinline)) int16_t oldConvertTemperatureInt(int16_t celcius)
+{
+  switch(temperatureUnit){
+  case TEMPERATURE_UNITS_F:
+      celcius = celcius*18;
+      celcius = celcius/10;
+      celcius = celcius + 320;
+      return celcius;
+  case TEMPERATURE_UNITS_K:
+    return celcius + 2732;
+  default: break;
+  }
+  return celcius;
+}
+
+static void oldGraphRange(int16_t* minPtr, int16_t* maxPtr)
+{
+  int16_t max = TEMP_MIN_VALUE_I;
+  int16_t min = TEMP_MAX_VALUE_I;
+
+  for(uint8_t x = 0; x < GRAPH_ROWS; x++)
+    for(uint8_t y = 0; y < GRAPH_POINTS; y++) {
+      int16_t p = graphData[x][y];
+      if(p == OUT_OF_RANGE_INT) continue;
+      p = oldConvertTemperatureInt(p);
+      if(p > max) max = p;
+      if(p < min) min = p;
+    }
+  *minPtr = min;
+  *maxPtr = max;
+  return;
+}
+
+// avr-gcc doesn't turn a 32 bit division by a constant into a multiply the
+// way a host compiler does, it calls the division routine. Dividing by a
+// variable keeps the host doing a real division too.
+volatile int32_t divisor = 10000;
+
+__attribute__((noinline)) int16_t oldConvert(int32_t microvolts, int16_t ambient)
+{
+  int32_t calibrated = (microvolts*MCP3424_CALIBRATION_MUL_INT + MCP3424_CALIBRATION_ADD_INT)/divisor;
+
+  return microvolts_to_celcius(calibrated + celcius_to_microvolts(ambient));
+}
+
+// The new code: the unit picked once, as updateGraphScaling() does
+template<uint8_t UNIT>
+static void newGraphRangeUnit(int16_t* minPtr, int16_t* maxPtr)
+{
+  int16_t max = TEMP_MIN_VALUE_I;
+  int16_t min = TEMP_MAX_VALUE_I;
+
+  for(uint8_t x = 0; x < GRAPH_ROWS; x++)
+    for(uint8_t y = 0; y < GRAPH_POINTS; y++) {
+      int16_t p = graphData[x][y];
+      if(p == OUT_OF_RANGE_INT) continue;
+      p = Unit<UNIT>::fromCelcius(p);
+      if(p > max) max = p;
+      if(p < min) min = p;
+    }
+  *minPtr = min;
+  *maxPtr = max;
+  return;
+}
+
+static void newGraphRange(int16_t* minPtr, int16_t* maxPtr)
+{
+  switch(temperatureUnit){
+  case TEMPERATURE_UNITS_F: newGraphRangeUnit<TEMPERATURE_UNITS_F>(minPtr, maxPtr); break;
+  case TEMPERATURE_UNITS_K: newGraphRangeUnit<TEMPERATURE_UNITS_K>(minPtr, maxPtr); break;
+  default:                  newGraphRangeUnit<TEMPERATURE_UNITS_C>(minPtr, maxPtr); break;
+  }
+  return;
+}
+
+// Keeps the optimizer from dropping the work
+volatile int32_t sink;
+
+template<class F>
+static double nsPer(long rounds, long items, F f)
+{
+  auto start = std::chrono::steady_clock::now();
+  for(long r = 0; r < rounds; r++) f();
+  std::chrono::duration<double, std::nano> took = std::chrono::steady_clock::now() - start;
+  return took.count()/rounds/items;
+}
+
+int main(int argc, char** argv)
+{
+  long rounds = (argc > 1) ? atol(argv[1]) : 20000;
+  static const char* unitNames[] = {"C", "F", "K"};
+  int failures = 0;
+
+  // Up to 180 C, where the old Fahrenheit conversion still fit in 16 bits
+  srand(1);
+  for(uint8_t x = 0; x < GRAPH_ROWS; x++)
+    for(uint8_t y = 0; y < GRAPH_POINTS; y++)
+      graphData[x][y] = (rand()%32 == 0) ? OUT_OF_RANGE_INT : rand()%2300 - 500;
+  for(uint16_t i = 0; i < ADC_READINGS; i++) readings[i] = rand()%60000 - 5000;
+
+  Calibration::load();    // The default calibration on every channel
+
+  printf("test, unit, old ns, new ns, speedup\n");
+  for(uint8_t unit = TEMPERATURE_UNITS_C; unit <= TEMPERATURE_UNITS_K; unit++) {
+    int16_t oldMin, oldMax, newMin, newMax;
+    double oldNs, newNs;
+
+    temperatureUnit = unit;
+    oldGraphRange(&oldMin, &oldMax);
+    newGraphRange(&newMin, &newMax);
+    if(oldMin != newMin || oldMax != newMax) {
+      printf("graph scan in %s differs: %d..%d against %d..%d\n",
+             unitNames[unit], oldMin, oldMax, newMin, newMax);
+      failures++;
+    }
+
+    oldNs = nsPer(rounds, GRAPH_ROWS*GRAPH_POINTS, [&]{ oldGraphRange(&oldMin, &oldMax); sink = oldMin + oldMax; });
+    newNs = nsPer(rounds, GRAPH_ROWS*GRAPH_POINTS, [&]{ newGraphRange(&newMin, &newMax); sink = newMin + newMax; });
+    printf("graph scan, %s, %.2f, %.2f, %.2f\n", unitNames[unit], oldNs, newNs, oldNs/newNs);
+  }
+
+  {
+    const int16_t ambient = 235;
+    int32_t worst = 0;
+    double oldNs, newNs;
+
+    for(uint16_t i = 0; i < ADC_READINGS; i++) {
+      int32_t error = abs(oldConvert(readings[i], ambient) - BoardAcquisition::convert(0, readings[i], ambient));
+      if(error > worst) worst = error;
+    }
+    // The calibration can be a microvolt off the old math, which the
+    // stand-in table divides down to at most one step
+    if(worst > 1) {
+      printf("acquisition differs by up to %d\n", worst);
+      failures++;
+    }
+
+    oldNs = nsPer(rounds/10, ADC_READINGS, [&]{
+      int32_t sum = 0;
+      for(uint16_t i = 0; i < ADC_READINGS; i++) sum += oldConvert(readings[i], ambient);
+      sink = sum;
+    });
+    newNs = nsPer(rounds/10, ADC_READINGS, [&]{
+      int32_t sum = 0;
+      for(uint16_t i = 0; i < ADC_READINGS; i++) sum += BoardAcquisition::convert(0, readings[i], ambient);
+      sink = sum;
+    });
+    printf("acquisition, C, %.2f, %.2f, %.2f\n", oldNs, newNs, oldNs/newNs);
+  }
+
+  return failures ? 1 : 0;
+}
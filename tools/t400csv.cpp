@@ -0,0 +1,623 @@
+/*
+ * t400csv - batch statistics, resampling and conversion of T400 log files
+ *
+ * Reads LDxxxx.CSV files as written by the logger: an optional '#' comment
+ * block, a "time (s), temp_0 (C), ..." header, then one row per sample with
+ * "-" for channels that had no reading. The erased end of a preallocated
+ * part left open by a reset, and the torn row before it, are skipped.
+ * Files are memory mapped and spread across worker threads, one file per
+ * thread at a time.
+ *
+ * Build on Linux or macOS:
+ *   g++ -O2 -std=c++17 -pthread -o t400csv tools/t400csv.cpp
+ *
+ * Usage:
+ *   t400csv [-j N] stats FILE...                   Per-file and combined statistics, as CSV
+ *   t400csv [-j N] resample SECONDS OUTDIR FILE... Average into SECONDS wide buckets
+ *   t400csv [-j N] convert OUTDIR FILE...          Convert to the columnar .T4B format
+ *   t400csv generate OUTDIR FILES MEGABYTES        Write a synthetic corpus
+ *   t400csv [-j N] bench OUTDIR MEGABYTES          Generate a corpus and time the stats pass
+ *
+ * .T4B format, little endian:
+ *   char[4]  "T4B1"
+ *   uint16   columns, not counting time
+ *   uint32   rows
+ *   columns x (uint8 length, name)
+ *   uint32   time[rows]
+ *   columns x int16 value[rows], in 1/10 degree, 32760 for no reading
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../t400/row_format.h"   // The logger's own row formatter
+
+// A memory mapped input file
+class MappedFile {
+public:
+  explicit MappedFile(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if(fd < 0) return;
+    if(fstat(fd, &st) == 0 && st.st_size > 0) {
+      void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(p != MAP_FAILED) {
+        data_ = static_cast<const char*>(p);
+        size_ = st.st_size;
+        madvise(p, size_, MADV_SEQUENTIAL);
+      }
+    }else if(st.st_size == 0) {
+      empty_ = true;
+    }
+    close(fd);
+  }
+  ~MappedFile() {
+    if(data_) munmap(const_cast<char*>(data_), size_);
+  }
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  bool ok() const { return data_ != nullptr || empty_; }
+  const char* begin() const { return data_; }
+  const char* end() const { return data_ + size_; }
+  size_t size() const { return size_; }
+
+private:
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+  bool empty_ = false;
+};
+
+static inline bool isDigit(char c) { return (unsigned char)(c - '0') < 10; }
+
+// Parse a value in 1/10 degree, eg "-12.3". Files from firmware before the
+// shared row formatter wrote negatives as "-12.-3" or "0.-5", so a '-'
+// after the point also makes the value negative.
+static inline bool parseTenths(const char*& p, const char* end, int32_t& out)
+{
+  bool negative = false;
+  uint32_t whole = 0;
+  uint32_t tenths = 0;
+  const char* start;
+
+  if(p < end && *p == '-') { negative = true; p++; }
+  start = p;
+  while(p < end && isDigit(*p)) whole = whole*10 + (*p++ - '0');
+  if(p == start) return false;
+
+  if(p < end && *p == '.') {
+    p++;
+    if(p < end && *p == '-') { negative = true; p++; }
+    if(p < end && isDigit(*p)) tenths = *p++ - '0';
+    while(p < end && isDigit(*p)) p++;    // Finer digits aren't written by the logger
+  }
+
+  out = (int32_t)(whole*10 + tenths);
+  if(negative) out = -out;
+  return true;
+}
+
+// Parse the time column. Older firmware printed it as a 16 bit signed
+// value, so it runs 32767, -32768, ... and has to be unwrapped.
+class TimeParser {
+public:
+  bool parse(const char*& p, const char* end, uint32_t& out) {
+    bool negative = false;
+    int64_t t = 0;
+    const char* start;
+
+    if(p < end && *p == '-') { negative = true; p++; }
+    start = p;
+    while(p < end && isDigit(*p)) t = t*10 + (*p++ - '0');
+    if(p == start) return false;
+    if(negative) t = 65536 - t;
+
+    t += offset_;
+    if(t + 32768 < last_) {
+      offset_ += 65536;
+      t += 65536;
+    }
+    last_ = t;
+    out = (uint32_t)t;
+    return true;
+  }
+private:
+  int64_t offset_ = 0;
+  int64_t last_ = 0;
+};
+
+static inline const char* skipSeparator(const char* p, const char* end)
+{
+  while(p < end && (*p == ',' || *p == ' ' || *p == '\t')) p++;
+  return p;
+}
+
+// Walk a log file. onHeader gets the column names (without time), onRow
+// gets the time and one value per column, OUT_OF_RANGE_INT for "-".
+// @return Number of lines that were neither rows, headers nor comments
+template<class Header, class Row>
+static size_t parseLog(const char* p, const char* end, Header onHeader, Row onRow)
+{
+  std::vector<int32_t> values;
+  TimeParser timeParser;
+  size_t rejected = 0;
+  size_t columns = 0;
+
+  // A preallocated part that a reset left open ends in erased blocks, with
+  // the row the reset tore just before them
+  if(end > p && (end[-1] == '\0' || end[-1] == '\xff')) {
+    while(end > p && (end[-1] == '\0' || end[-1] == '\xff')) end--;
+    while(end > p && end[-1] != '\n') end--;
+  }
+
+  while(p < end)
+  {
+    const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+    const char* lineEnd = eol ? eol : end;
+    const char* q = p;
+    uint32_t time;
+
+    if(lineEnd > p && lineEnd[-1] == '\r') lineEnd--;
+
+    if(q == lineEnd || *q == '#') {
+      // Blank line or comment
+    }else if(lineEnd - q >= 4 && memcmp(q, "time", 4) == 0) {
+      std::vector<std::string> names;
+      const char* field = static_cast<const char*>(memchr(q, ',', lineEnd - q));
+      while(field) {
+        const char* next;
+        field = skipSeparator(field, lineEnd);
+        next = static_cast<const char*>(memchr(field, ',', lineEnd - field));
+        names.emplace_back(field, next ? next : lineEnd);
+        field = next;
+      }
+      columns = names.size();
+      onHeader(names);
+    }else if(timeParser.parse(q, lineEnd, time)) {
+      bool ok = true;
+      values.clear();
+      while(ok) {
+        int32_t v;
+        q = skipSeparator(q, lineEnd);
+        if(q >= lineEnd) break;
+        if(*q == '-' && (q + 1 == lineEnd || q[1] == ',')) {
+          values.push_back(OUT_OF_RANGE_INT);
+          q++;
+        }else if(parseTenths(q, lineEnd, v)) {
+          values.push_back(v);
+        }else{
+          ok = false;
+        }
+      }
+      if(ok && (columns == 0 || values.size() == columns)) onRow(time, values);
+      else rejected++;
+    }else{
+      // Serial captures also carry "vX.Y" and "File:" lines
+      rejected++;
+    }
+
+    p = eol ? eol + 1 : end;
+  }
+  return rejected;
+}
+
+// Running statistics for one column. Welford's update in doubles, merged
+// with Chan's formula when combining files.
+struct Accumulator {
+  uint64_t count = 0;
+  uint64_t missing = 0;
+  int32_t min = INT32_MAX;
+  int32_t max = INT32_MIN;
+  double mean = 0;
+  double m2 = 0;
+
+  void add(int32_t x) {
+    double delta;
+    if(x == OUT_OF_RANGE_INT) { missing++; return; }
+    count++;
+    if(x < min) min = x;
+    if(x > max) max = x;
+    delta = x - mean;
+    mean += delta/count;
+    m2 += delta*(x - mean);
+  }
+
+  void merge(const Accumulator& o) {
+    uint64_t n = count + o.count;
+    double delta = o.mean - mean;
+    if(o.count == 0) { missing += o.missing; return; }
+    if(count == 0) { uint64_t m = missing; *this = o; missing += m; return; }
+    mean += delta*o.count/n;
+    m2 += o.m2 + delta*delta*((double)count*o.count/n);
+    count = n;
+    missing += o.missing;
+    min = std::min(min, o.min);
+    max = std::max(max, o.max);
+  }
+
+  double stddev() const { return count ? std::sqrt(m2/count) : 0; }
+};
+
+struct FileResult {
+  std::string path;
+  bool ok = false;
+  size_t bytes = 0;
+  uint64_t rows = 0;
+  size_t rejected = 0;
+  std::vector<std::string> names;
+  std::vector<Accumulator> columns;
+};
+
+// Run job(i) for i in [0, count) on a pool of threads
+template<class Job>
+static void parallelFor(size_t count, unsigned threads, Job job)
+{
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> pool;
+
+  threads = std::max(1u, std::min<unsigned>(threads, count));
+  for(unsigned t = 0; t < threads; t++) {
+    pool.emplace_back([&]() {
+      for(size_t i = next++; i < count; i = next++) job(i);
+    });
+  }
+  for(auto& th : pool) th.join();
+}
+
+static FileResult statsFile(const std::string& path)
+{
+  FileResult r;
+  MappedFile file(path);
+
+  r.path = path;
+  if(!file.ok()) return r;
+  r.ok = true;
+  r.bytes = file.size();
+  if(file.size() == 0) return r;
+
+  r.rejected = parseLog(file.begin(), file.end(),
+    [&](const std::vector<std::string>& names) {
+      r.names = names;
+      r.columns.assign(names.size(), Accumulator());
+    },
+    [&](uint32_t, const std::vector<int32_t>& values) {
+      if(r.columns.size() < values.size()) {
+        // No header, name the columns by position
+        for(size_t i = r.columns.size(); i < values.size(); i++) {
+          r.names.push_back("temp_" + std::to_string(i));
+          r.columns.emplace_back();
+        }
+      }
+      for(size_t i = 0; i < values.size(); i++) r.columns[i].add(values[i]);
+      r.rows++;
+    });
+  return r;
+}
+
+static void printStatsRow(const std::string& file, const std::string& column, const Accumulator& a)
+{
+  if(a.count == 0) {
+    printf("%s, %s, 0, %llu, -, -, -, -\n", file.c_str(), column.c_str(),
+           (unsigned long long)a.missing);
+    return;
+  }
+  printf("%s, %s, %llu, %llu, %.1f, %.1f, %.2f, %.2f\n", file.c_str(), column.c_str(),
+         (unsigned long long)a.count, (unsigned long long)a.missing,
+         a.min/10.0, a.max/10.0, a.mean/10.0, a.stddev()/10.0);
+}
+
+static int runStats(const std::vector<std::string>& paths, unsigned threads, bool quiet)
+{
+  std::vector<FileResult> results(paths.size());
+  std::map<std::string, Accumulator> combined;
+  std::vector<std::string> order;
+  auto start = std::chrono::steady_clock::now();
+  double seconds;
+  size_t bytes = 0;
+  uint64_t rows = 0;
+  int failed = 0;
+
+  parallelFor(paths.size(), threads, [&](size_t i) { results[i] = statsFile(paths[i]); });
+  seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  if(!quiet) printf("file, column, samples, missing, min, max, mean, stddev\n");
+  for(const FileResult& r : results) {
+    if(!r.ok) {
+      fprintf(stderr, "%s: can't read\n", r.path.c_str());
+      failed++;
+      continue;
+    }
+    if(r.rejected) fprintf(stderr, "%s: %zu lines skipped\n", r.path.c_str(), r.rejected);
+    bytes += r.bytes;
+    rows += r.rows;
+    for(size_t i = 0; i < r.columns.size(); i++) {
+      if(!quiet) printStatsRow(r.path, r.names[i], r.columns[i]);
+      if(combined.find(r.names[i]) == combined.end()) order.push_back(r.names[i]);
+      combined[r.names[i]].merge(r.columns[i]);
+    }
+  }
+  if(!quiet) {
+    for(const std::string& name : order) printStatsRow("*", name, combined[name]);
+  }
+
+  fprintf(stderr, "%zu files, %.1f MB, %llu rows in %.3f s, %.1f MB/s\n",
+          paths.size(), bytes/1e6, (unsigned long long)rows, seconds,
+          seconds > 0 ? bytes/1e6/seconds : 0.0);
+  return failed ? 1 : 0;
+}
+
+// A whole file held in columns
+struct Table {
+  std::vector<std::string> names;
+  std::vector<uint32_t> time;
+  std::vector<std::vector<int16_t>> columns;
+};
+
+static bool loadTable(const std::string& path, Table& t)
+{
+  MappedFile file(path);
+  if(!file.ok()) return false;
+  if(file.size() == 0) return true;
+
+  parseLog(file.begin(), file.end(),
+    [&](const std::vector<std::string>& names) {
+      t.names = names;
+      t.columns.assign(names.size(), std::vector<int16_t>());
+    },
+    [&](uint32_t time, const std::vector<int32_t>& values) {
+      while(t.columns.size() < values.size()) {
+        t.names.push_back("temp_" + std::to_string(t.columns.size()));
+        t.columns.emplace_back(t.time.size(), (int16_t)OUT_OF_RANGE_INT);
+      }
+      t.time.push_back(time);
+      for(size_t i = 0; i < t.columns.size(); i++) {
+        int32_t v = (i < values.size()) ? values[i] : OUT_OF_RANGE_INT;
+        t.columns[i].push_back((int16_t)std::max(-32767, std::min<int32_t>(v, OUT_OF_RANGE_INT)));
+      }
+    });
+  return true;
+}
+
+static std::string outputPath(const std::string& dir, const std::string& path, const char* extension)
+{
+  size_t slash = path.find_last_of('/');
+  std::string name = (slash == std::string::npos) ? path : path.substr(slash + 1);
+  size_t dot = name.find_last_of('.');
+  if(extension && dot != std::string::npos) name = name.substr(0, dot);
+  return dir + "/" + name + (extension ? extension : "");
+}
+
+static bool resampleFile(const std::string& path, const std::string& dir, uint32_t step)
+{
+  Table t;
+  FILE* out;
+  std::vector<int64_t> sums;
+  std::vector<uint32_t> counts;
+  std::vector<int16_t> row;
+  std::vector<char> buf;
+
+  if(!loadTable(path, t)) return false;
+  out = fopen(outputPath(dir, path, nullptr).c_str(), "w");
+  if(!out) return false;
+
+  fprintf(out, "time (s)");
+  for(const std::string& name : t.names) fprintf(out, ", %s", name.c_str());
+  fprintf(out, "\n");
+
+  sums.assign(t.columns.size(), 0);
+  counts.assign(t.columns.size(), 0);
+  row.resize(t.columns.size());
+
+  for(size_t r = 0; r < t.time.size(); )
+  {
+    uint32_t bucket = t.time[r]/step;
+    for(; r < t.time.size() && t.time[r]/step == bucket; r++) {
+      for(size_t c = 0; c < t.columns.size(); c++) {
+        if(t.columns[c][r] == OUT_OF_RANGE_INT) continue;
+        sums[c] += t.columns[c][r];
+        counts[c]++;
+      }
+    }
+    for(size_t c = 0; c < t.columns.size(); c++) {
+      row[c] = counts[c] ? (int16_t)std::lround((double)sums[c]/counts[c]) : OUT_OF_RANGE_INT;
+      sums[c] = 0;
+      counts[c] = 0;
+    }
+    buf.resize(12 + row.size()*9);
+    formatRow(buf.data(), bucket*step, row.data(), (uint8_t)row.size());
+    fprintf(out, "%s\n", buf.data());
+  }
+  return fclose(out) == 0;
+}
+
+template<class T>
+static void writeLe(FILE* f, T value)
+{
+  unsigned char b[sizeof(T)];
+  for(size_t i = 0; i < sizeof(T); i++) b[i] = (unsigned char)((uint64_t)value >> (8*i));
+  fwrite(b, 1, sizeof(T), f);
+}
+
+static bool convertFile(const std::string& path, const std::string& dir)
+{
+  Table t;
+  FILE* out;
+
+  if(!loadTable(path, t)) return false;
+  out = fopen(outputPath(dir, path, ".T4B").c_str(), "wb");
+  if(!out) return false;
+
+  fwrite("T4B1", 1, 4, out);
+  writeLe<uint16_t>(out, (uint16_t)t.columns.size());
+  writeLe<uint32_t>(out, (uint32_t)t.time.size());
+  for(const std::string& name : t.names) {
+    uint8_t length = (uint8_t)std::min<size_t>(name.size(), 255);
+    writeLe<uint8_t>(out, length);
+    fwrite(name.data(), 1, length, out);
+  }
+  for(uint32_t time : t.time) writeLe<uint32_t>(out, time);
+  for(const std::vector<int16_t>& column : t.columns) {
+    for(int16_t v : column) writeLe<uint16_t>(out, (uint16_t)v);
+  }
+  return fclose(out) == 0;
+}
+
+// Write a corpus of files that look like a 4 channel logger at 500ms-60s
+// intervals, using the same row formatter as the firmware
+static int generate(const std::string& dir, unsigned files, double megabytes)
+{
+  const uint8_t channels = 4;
+  const uint32_t intervals[] = {1, 1, 2, 5, 10, 30, 60};
+  size_t perFile = (size_t)(megabytes*1e6/files);
+  std::mt19937 rng(400);
+
+  for(unsigned f = 0; f < files; f++)
+  {
+    char name[32];
+    FILE* out;
+    size_t written = 0;
+    uint32_t interval = intervals[rng() % 7];
+    int16_t values[channels];
+    int32_t level[channels];
+    char buf[12 + channels*9];
+
+    snprintf(name, sizeof(name), "LD%04u.CSV", f + 1);
+    out = fopen((dir + "/" + name).c_str(), "w");
+    if(!out) {
+      fprintf(stderr, "%s/%s: can't write\n", dir.c_str(), name);
+      return 1;
+    }
+
+    written += fprintf(out, "# channel skew 210 ms, 3 ms after aligning %u of %u channels\ntime (s)", channels, channels);
+    for(uint8_t c = 0; c < channels; c++) written += fprintf(out, ", temp_%u (C)", c);
+    written += fprintf(out, "\n");
+
+    for(uint8_t c = 0; c < channels; c++) level[c] = 200 + rng() % 2000;
+    for(uint32_t time = 0; written < perFile; time += interval)
+    {
+      for(uint8_t c = 0; c < channels; c++) {
+        // Random walk, with the odd unplugged probe
+        level[c] += (int32_t)(rng() % 21) - 10;
+        level[c] = std::max<int32_t>(-2000, std::min<int32_t>(level[c], 13000));
+        values[c] = (c == 3 && (time/600) % 4 == 0) ? (int16_t)OUT_OF_RANGE_INT : (int16_t)level[c];
+      }
+      written += formatRow(buf, time, values, channels) + 1;
+      fputs(buf, out);
+      fputc('\n', out);
+    }
+    fclose(out);
+  }
+  return 0;
+}
+
+static std::vector<std::string> corpusFiles(const std::string& dir, unsigned files)
+{
+  std::vector<std::string> paths;
+  for(unsigned f = 0; f < files; f++) {
+    char name[32];
+    snprintf(name, sizeof(name), "/LD%04u.CSV", f + 1);
+    paths.push_back(dir + name);
+  }
+  return paths;
+}
+
+static int usage()
+{
+  fprintf(stderr,
+    "usage: t400csv [-j N] stats FILE...\n"
+    "       t400csv [-j N] resample SECONDS OUTDIR FILE...\n"
+    "       t400csv [-j N] convert OUTDIR FILE...\n"
+    "       t400csv generate OUTDIR FILES MEGABYTES\n"
+    "       t400csv [-j N] bench OUTDIR MEGABYTES\n");
+  return 2;
+}
+
+int main(int argc, char** argv)
+{
+  unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<std::string> args(argv + 1, argv + argc);
+  std::string command;
+
+  if(args.size() >= 2 && args[0] == "-j") {
+    threads = std::max(1, atoi(args[1].c_str()));
+    args.erase(args.begin(), args.begin() + 2);
+  }
+  if(args.empty()) return usage();
+  command = args[0];
+  args.erase(args.begin());
+
+  if(command == "stats" && !args.empty()) {
+    return runStats(args, threads, false);
+  }
+
+  if(command == "resample" && args.size() >= 3) {
+    uint32_t step = (uint32_t)atoi(args[0].c_str());
+    std::string dir = args[1];
+    std::vector<std::string> paths(args.begin() + 2, args.end());
+    std::atomic<int> failed(0);
+    if(step == 0) return usage();
+    parallelFor(paths.size(), threads, [&](size_t i) {
+      if(!resampleFile(paths[i], dir, step)) {
+        fprintf(stderr, "%s: failed\n", paths[i].c_str());
+        failed++;
+      }
+    });
+    return failed ? 1 : 0;
+  }
+
+  if(command == "convert" && args.size() >= 2) {
+    std::string dir = args[0];
+    std::vector<std::string> paths(args.begin() + 1, args.end());
+    std::atomic<int> failed(0);
+    parallelFor(paths.size(), threads, [&](size_t i) {
+      if(!convertFile(paths[i], dir)) {
+        fprintf(stderr, "%s: failed\n", paths[i].c_str());
+        failed++;
+      }
+    });
+    return failed ? 1 : 0;
+  }
+
+  if(command == "generate" && args.size() == 3) {
+    unsigned files = (unsigned)atoi(args[1].c_str());
+    if(files == 0) return usage();
+    return generate(args[0], files, atof(args[2].c_str()));
+  }
+
+  if(command == "bench" && args.size() == 2) {
+    double megabytes = atof(args[1].c_str());
+    unsigned files = std::max(1u, (unsigned)(megabytes/64));   // ~64 MB per file
+    std::vector<std::string> paths = corpusFiles(args[0], files);
+    auto start = std::chrono::steady_clock::now();
+    int result;
+
+    if(generate(args[0], files, megabytes)) return 1;
+    fprintf(stderr, "generated %u files in %.1f s\n", files,
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+
+    fprintf(stderr, "1 thread: ");
+    result = runStats(paths, 1, true);
+    if(threads > 1) {
+      fprintf(stderr, "%u threads: ", threads);
+      result |= runStats(paths, threads, true);
+    }
+    return result;
+  }
+
+  return usage();
+}
@@ -0,0 +1,173 @@
+/*
+ * t400energy - battery life per mode from the logger's energy counters
+ *
+ * Reads a serial capture from a board built with INSTRUMENTATION_ENABLED and
+ * runs its energy reports through the logger's own model (t400/energy.h).
+ * Each report is a group of '#' lines:
+ *   # energy <mode> t=<s> act=<ms> idle=<ms>
+ *   # adc=<n> i2c=<n> sd=<n> lcd=<n>
+ *   # on lcd=<s> bl=<s>
+ * Every other line is skipped. The counters count from the last mode change,
+ * so the last report of a run of one mode covers the whole run. A run ends
+ * when the mode changes or the counters start again, after a reset.
+ *
+ * One row is printed per report, then one per mode with the runs of that
+ * mode added up. Change the currents in energy.h and build again to see what
+ * a tuned model says about a capture that has already been taken.
+ *
+ * Build:
+ *   g++ -O2 -std=c++17 -o t400energy tools/t400energy.cpp
+ *
+ * Usage:
+ *   t400energy [-q] [FILE]     Read FILE, or standard input
+ *     -q      Only print the rows per mode
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+
+#include <unistd.h>
+
+#include "../t400/energy.h"   // The logger's own model
+
+#define LINE_SIZE   256
+
+struct Report {
+  std::string mode;
+  EnergyCounters counters;
+  bool haveOn;                // The capture has the "# on" line
+};
+
+static bool quiet = false;
+static std::map<std::string, EnergyCounters> modes;
+static bool missingOn = false;
+
+static void add(EnergyCounters* total, const EnergyCounters& c)
+{
+  total->seconds += c.seconds;
+  total->activeMs += c.activeMs;
+  total->idleMs += c.idleMs;
+  total->adcConversions += c.adcConversions;
+  total->i2cTransactions += c.i2cTransactions;
+  total->sdBlocks += c.sdBlocks;
+  total->lcdPages += c.lcdPages;
+  total->lcdOnSeconds += c.lcdOnSeconds;
+  total->backlightOnSeconds += c.backlightOnSeconds;
+  return;
+}
+
+static void printRow(const char* mode, const EnergyCounters& c)
+{
+  printf("%s, %u, %u, %u, %u, %u, %u, %u, %u, %u, %u, %u\n", mode,
+         c.seconds, c.activeMs, c.idleMs, c.adcConversions, c.i2cTransactions,
+         c.sdBlocks, c.lcdPages, c.lcdOnSeconds, c.backlightOnSeconds,
+         energyAverageMicroamps(c), energyProjectedHours(c));
+  return;
+}
+
+// A report is complete, print it
+static void finishReport(const Report& r)
+{
+  if(!r.haveOn) missingOn = true;
+  if(!quiet) printRow(r.mode.c_str(), r.counters);
+  return;
+}
+
+// The last report of a run covers the run, add it to its mode
+static void finishRun(const Report& r)
+{
+  add(&modes[r.mode], r.counters);
+  return;
+}
+
+static int run(FILE* in)
+{
+  char line[LINE_SIZE];
+  char mode[LINE_SIZE];
+  Report report;
+  Report last;
+  bool inReport = false;
+  bool haveLast = false;
+  unsigned long reports = 0;
+
+  printf("mode, seconds, active ms, idle ms, adc, i2c, sd, lcd pages, lcd s, backlight s, avg uA, life h\n");
+
+  while(fgets(line, sizeof(line), in)) {
+    EnergyCounters& c = report.counters;
+    unsigned long a, b, d, e;
+
+    if(sscanf(line, "# energy %255s t=%lu act=%lu idle=%lu", mode, &a, &b, &d) == 4) {
+      if(inReport) finishReport(report);
+
+      report.mode = mode;
+      memset(&c, 0, sizeof(c));
+      c.seconds = a;
+      c.activeMs = b;
+      c.idleMs = d;
+      report.haveOn = false;
+      inReport = true;
+      reports++;
+
+      // A new mode or counters that went back: the last run is over
+      if(haveLast && (last.mode != report.mode || c.seconds < last.counters.seconds)) finishRun(last);
+      last = report;
+      haveLast = true;
+    }else if(inReport && sscanf(line, "# adc=%lu i2c=%lu sd=%lu lcd=%lu", &a, &b, &d, &e) == 4) {
+      c.adcConversions = a;
+      c.i2cTransactions = b;
+      c.sdBlocks = d;
+      c.lcdPages = e;
+      last = report;
+    }else if(inReport && sscanf(line, "# on lcd=%lu bl=%lu", &a, &b) == 2) {
+      c.lcdOnSeconds = a;
+      c.backlightOnSeconds = b;
+      report.haveOn = true;
+      last = report;
+    }
+  }
+  if(inReport) finishReport(report);
+  if(haveLast) finishRun(last);
+
+  if(reports == 0) {
+    fprintf(stderr, "no '# energy' reports found\n");
+    return 1;
+  }
+
+  if(!quiet) printf("\n");
+  for(const auto& m : modes) printRow((m.first + " total").c_str(), m.second);
+
+  if(missingOn) {
+    fprintf(stderr, "some reports have no '# on' line, their LCD and backlight time is counted as 0\n");
+  }
+  return 0;
+}
+
+int main(int argc, char** argv)
+{
+  FILE* in = stdin;
+  int c;
+  int result;
+
+  while((c = getopt(argc, argv, "q")) != -1) {
+    switch(c) {
+    case 'q': quiet = true; break;
+    default:
+      fprintf(stderr, "usage: t400energy [-q] [FILE]\n");
+      return 2;
+    }
+  }
+  if(optind < argc) {
+    in = fopen(argv[optind], "r");
+    if(!in) {
+      perror(argv[optind]);
+      return 2;
+    }
+  }
+
+  result = run(in);
+  if(in != stdin) fclose(in);
+  return result;
+}
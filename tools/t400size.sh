@@ -0,0 +1,145 @@
+#!/bin/sh
+#
+# t400size - flash and RAM map of the firmware, per feature flag
+#
+# Builds the default firmware, then once more with each feature flag in
+# t400.h flipped, and prints what each build takes: flash (.text + .data),
+# static RAM (.data + .bss) and what that leaves for the stack. A build that
+# is over the flash below the bootloader, or leaves less than T400_STACK_MIN
+# bytes of stack, is marked "too big". With -p every pair of flags is flipped
+# as well, to find features that only fit apart. The largest RAM symbols of
+# the default build are listed from the linker map. The exit status is 1 if
+# the default build doesn't fit.
+#
+# Needs arduino-cli with the Pax Instruments core and the libraries in the
+# README installed, and avr-size and avr-nm on the path (they come with the
+# core's toolchain).
+#
+# Usage:
+#   T400_FQBN=<core>:avr:<board> tools/t400size.sh [-p] [FLAG...]
+#     -p      Flip each pair of the flags too
+#     FLAG    Only flip these flags, eg ALARM_ENABLED (default every *_ENABLED flag)
+#
+
+set -e
+
+FLASH_MAX=28672                 # 32 KB less the 4 KB bootloader
+RAM_SIZE=2560                   # ATmega32U4 SRAM
+STACK_MIN=${T400_STACK_MIN:-512}
+
+pairs=0
+if [ "$1" = "-p" ]; then
+  pairs=1
+  shift
+fi
+
+if [ -z "$T400_FQBN" ]; then
+  echo "set T400_FQBN to the board's fully qualified name, see arduino-cli board listall" >&2
+  exit 2
+fi
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+# Build the sketch with t400.h as it is in $work/t400
+# @param $1 Build directory
+build() {
+  arduino-cli compile --fqbn "$T400_FQBN" --build-path "$1" \
+    --build-property "compiler.c.elf.extra_flags=-Wl,-Map,$1/t400.map" \
+    "$work/t400" > "$1.log" 2>&1
+}
+
+# Print a row of the table
+# @param $1 Name of the build
+# @param $2 Build directory
+report() {
+  avr-size -A "$2/t400.ino.elf" | awk -v name="$1" -v flash="$FLASH_MAX" -v ram="$RAM_SIZE" -v stack="$STACK_MIN" '
+    $1 == ".text" { text = $2 }
+    $1 == ".data" { data = $2 }
+    $1 == ".bss"  { bss = $2 }
+    END {
+      fit = (text + data > flash || ram - data - bss < stack) ? "  too big" : ""
+      printf "%-56s %6d %6d %6d%s\n", name, text + data, data + bss, ram - data - bss, fit
+    }'
+}
+
+# Write t400.h with flags flipped from the default
+# @param $@ Flags to flip
+# @return The flags as FLAG=VALUE in $name, status 1 if one isn't in t400.h
+flip() {
+  cp "$work/t400.h.default" "$work/t400.h.flip"
+  name=""
+  for f in "$@"; do
+    value=$(sed -n "s/^#define $f *\([01]\).*/\1/p" "$work/t400.h.default")
+    if [ -z "$value" ]; then
+      echo "$f isn't a flag in t400.h" >&2
+      return 1
+    fi
+    value=$((1 - value))
+    sed "s/^\(#define $f *\)[01]/\1$value/" "$work/t400.h.flip" > "$work/t400.h.next"
+    mv "$work/t400.h.next" "$work/t400.h.flip"
+    name="$name${name:+ }$f=$value"
+  done
+  cp "$work/t400.h.flip" "$work/t400/t400.h"
+}
+
+# Build and report with flags flipped from the default
+# @param $@ Flags to flip
+try() {
+  flip "$@" || return 0
+  dir="$work/$(echo "$@" | tr ' ' '+')"
+  if build "$dir"; then
+    report "$name" "$dir"
+  else
+    printf "%-56s %s\n" "$name" "doesn't build, see below"
+    tail -5 "$dir.log"
+  fi
+  rm -rf "$dir"
+}
+
+cp -r "$root/t400" "$work/t400"
+cp "$work/t400/t400.h" "$work/t400.h.default"
+
+flags=$*
+if [ -z "$flags" ]; then
+  flags=$(sed -n 's/^#define \([A-Z_]*_ENABLED\) .*/\1/p' "$work/t400.h.default")
+fi
+
+printf "%-56s %6s %6s %6s\n" "build" "flash" "ram" "stack"
+
+if ! build "$work/default"; then
+  cat "$work/default.log" >&2
+  exit 1
+fi
+report "default" "$work/default"
+
+for flag in $flags; do
+  try "$flag"
+done
+if [ "$pairs" = 1 ]; then
+  rest=$flags
+  for flag in $flags; do
+    rest=${rest#*"$flag"}
+    for other in $rest; do
+      try "$flag" "$other"
+    done
+  done
+fi
+cp "$work/t400.h.default" "$work/t400/t400.h"
+
+echo
+echo "Largest RAM symbols of the default build:"
+avr-nm --size-sort -S -C -t d "$work/default/t400.ino.elf" |
+  awk '$3 ~ /^[bBdD]$/ { size = $2; $1 = $2 = $3 = ""; sub(/^ +/, ""); printf "%6d %s\n", size, $0 }' | tail -15
+echo "Linker map: the .data and .bss lines of the default build"
+grep -E '^ \.(data|bss)' "$work/default/t400.map" | head -30 || true
+
+avr-size -A "$work/default/t400.ino.elf" | awk -v flash="$FLASH_MAX" -v ram="$RAM_SIZE" -v stack="$STACK_MIN" '
+  $1 == ".text" { text = $2 }
+  $1 == ".data" { data = $2 }
+  $1 == ".bss"  { bss = $2 }
+  END {
+    if(text + data > flash) { print "default build is over the flash limit of " flash " bytes"; exit 1 }
+    if(ram - data - bss < stack) { print "default build leaves less than " stack " bytes of stack"; exit 1 }
+  }'
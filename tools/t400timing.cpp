@@ -0,0 +1,239 @@
+/*
+ * t400timing - simulate the logger's sample timing on a PC
+ *
+ * Plays the sample ticks of the RTC and Timer 1 against a model of loop():
+ * conversions read from the ADC, the row formatted and written to the SD
+ * card, and the display sent a page per pass behind the SD card, with the
+ * readings row redrawn on its own between samples. Each sample is stamped
+ * at its tick, its last conversion, when loop() takes it and when its row
+ * is written, and reported with the logger's own statistics
+ * (t400/sample_timing.h), so the output reads the same as the '#' lines of
+ * a board built with TIMING_HARNESS_ENABLED.
+ *
+ * The card and display times are injected, to see what a slow card or a
+ * slow page does to the rows. With -g it is a regression gate: the exit
+ * status is 1 if any row is later than the limit.
+ *
+ * Build:
+ *   g++ -O2 -std=c++17 -o t400timing tools/t400timing.cpp
+ *
+ * Usage:
+ *   t400timing [-i S] [-t S] [-d MS] [-f MS] [-w MS] [-p MS] [-n] [-q] [-g US]
+ *     -i S    Log interval in seconds, 0 is half a second (default 0)
+ *     -t S    Seconds to simulate (default 3600)
+ *     -d MS   SD time to write a row (default 2)
+ *     -f MS   SD time to flush, at most once a second (default 20)
+ *     -w MS   SD time of a slow write, one row in 64 at random (default 0, none)
+ *     -p MS   Time to draw and send a display page (default 4)
+ *     -n      Don't hold display pages back behind the SD card
+ *     -q      Only print the report for the whole run
+ *     -g US   Exit 1 if a row is written more than US after its tick
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+
+#include "../t400/sample_timing.h"   // The logger's own statistics
+
+// The same as t400.h and t400.ino
+#define MCP3424_CONVERSION_MS   67         // One channel's conversion
+#define SYNC_INTERVAL           1000       // millis between flushes
+#define TIMING_REPORT_SAMPLES   120
+#define TIMER_ISR_MS            100        // Timer 1 period in half second mode
+#define DISPLAY_PAGES           8
+#define LIVE_READINGS_MS        250        // Fastest refresh of the readings row between frames
+
+// Half a second after the RTC edge, as Timer 1 really counts it: OCR1A is
+// set to ms*124 and the timer runs at 8 us a count, OCR1A+1 counts a period
+#define TIMER1_HALF_SECOND_US   ((500/TIMER_ISR_MS)*(TIMER_ISR_MS*124UL + 1)*8)
+
+// Estimated costs of the parts of loop() that aren't injected. Only their
+// order and rough size matter here, check them against a board's report.
+#define LOOP_BASE_US            300        // Buttons, serial, a pass with nothing to do
+#define ADC_READ_US             1500       // I2C read of a conversion, convert and start the next
+#define SAMPLE_FORMAT_US        2500       // Align, derive, format the row and queue it for serial
+#define GRAPH_UPDATE_US         1500       // Graph data and scaling, start a frame
+
+struct Options {
+  unsigned interval = 0;
+  unsigned seconds = 3600;
+  unsigned sdMs = 2;
+  unsigned flushMs = 20;
+  unsigned slowMs = 0;
+  unsigned pageMs = 4;
+  bool priority = true;
+  bool quiet = false;
+  unsigned long gateUs = 0;
+};
+
+// Sample ticks, in order
+class Ticks {
+public:
+  Ticks(unsigned interval) : interval(interval) {}
+
+  // @return Time of the next tick, in us
+  uint64_t peek() const
+  {
+    if(interval == 0) return edge + (half ? TIMER1_HALF_SECOND_US : 0);
+    return edge;
+  }
+
+  // Move on to the tick after peek()
+  void next()
+  {
+    if(interval == 0) {
+      if(half) edge += 1000000;
+      half = !half;
+    }else{
+      edge += interval*1000000ULL;
+    }
+  }
+
+  // @return The interval the tick at peek() is meant to keep, in us
+  uint32_t nominal() const { return interval ? interval*1000000UL : 500000; }
+
+private:
+  unsigned interval;
+  uint64_t edge = 1000000;    // RTC second edge
+  bool half = false;          // Next tick is Timer 1's, half a second after the edge
+};
+
+static uint32_t randomState = 1;
+
+static uint32_t nextRandom()
+{
+  randomState = randomState*1103515245 + 12345;
+  return (randomState >> 16) & 0x7FFF;
+}
+
+static void printReport(const SampleTiming* t)
+{
+  char buf[TIMING_LINE_SIZE];
+
+  for(uint8_t line = 0; timingReportLine(t, line, buf); line++) puts(buf);
+}
+
+static int run(const Options& o)
+{
+  Ticks ticks(o.interval);
+  SampleTiming period;
+  SampleTiming whole;
+  SampleTimes sample;
+  uint64_t end = o.seconds*1000000ULL;
+  uint64_t t = 0;
+  uint64_t nextConversion = MCP3424_CONVERSION_MS*1000;
+  uint64_t lastConversion = 0;
+  uint64_t lastFlush = 0;
+  uint64_t tickUs = 0;
+  bool sampleFlag = false;
+  uint8_t pagesLeft = 0;
+  bool waited = false;
+  uint64_t liveReadings = 0;
+
+  memset(&period, 0, sizeof(period));
+  memset(&whole, 0, sizeof(whole));
+
+  while(t < end) {
+    bool sdUsed = false;
+
+    // Ticks that came in since the flag was last looked at. A second tick
+    // before loop() gets there overwrites the first, as on the board.
+    while(ticks.peek() <= t) {
+      tickUs = ticks.peek();
+      sample.nominalUs = ticks.nominal();
+      sampleFlag = true;
+      ticks.next();
+    }
+
+    // A conversion is ready
+    if(nextConversion <= t) {
+      t += ADC_READ_US;
+      lastConversion = t;
+      while(nextConversion <= t) nextConversion += MCP3424_CONVERSION_MS*1000;
+    }
+
+    if(sampleFlag) {
+      sampleFlag = false;
+      sample.tickUs = tickUs;
+      sample.adcUs = lastConversion;
+      sample.noticeUs = t;
+
+      t += SAMPLE_FORMAT_US + o.sdMs*1000;
+      if(o.slowMs && nextRandom()%64 == 0) t += o.slowMs*1000;
+      if(t - lastFlush >= SYNC_INTERVAL*1000ULL) {
+        t += o.flushMs*1000;
+        lastFlush = t;
+      }
+      sdUsed = true;
+      sample.commitUs = t;
+
+      timingRecord(&period, &sample);
+      timingRecord(&whole, &sample);
+      if(period.samples >= TIMING_REPORT_SAMPLES) {
+        if(!o.quiet) printReport(&period);
+        timingReset(&period);
+      }
+
+      t += GRAPH_UPDATE_US;
+      pagesLeft = DISPLAY_PAGES;
+      liveReadings = t;
+    }else if(pagesLeft == 0 && t - liveReadings >= LIVE_READINGS_MS*1000ULL) {
+      // Only the readings row
+      pagesLeft = 1;
+      liveReadings = t;
+    }
+
+    // A display page, held back for one pass if the SD card had the bus
+    if(pagesLeft > 0) {
+      if(!o.priority || !sdUsed || waited) {
+        t += o.pageMs*1000;
+        pagesLeft--;
+        waited = false;
+      }else{
+        waited = true;
+      }
+    }
+
+    t += LOOP_BASE_US;
+  }
+
+  printf("# run %u s, interval %u s, sd %u ms, flush %u ms, slow %u ms, page %u ms%s\n",
+         o.seconds, o.interval, o.sdMs, o.flushMs, o.slowMs, o.pageMs,
+         o.priority ? "" : ", no bus priority");
+  printReport(&whole);
+
+  if(o.gateUs && whole.latencyMaxUs > o.gateUs) {
+    fprintf(stderr, "latency %lu us is over the limit of %lu us\n",
+            (unsigned long)whole.latencyMaxUs, o.gateUs);
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char** argv)
+{
+  Options o;
+  int c;
+
+  while((c = getopt(argc, argv, "i:t:d:f:w:p:nqg:")) != -1) {
+    switch(c) {
+    case 'i': o.interval = atoi(optarg); break;
+    case 't': o.seconds = atoi(optarg); break;
+    case 'd': o.sdMs = atoi(optarg); break;
+    case 'f': o.flushMs = atoi(optarg); break;
+    case 'w': o.slowMs = atoi(optarg); break;
+    case 'p': o.pageMs = atoi(optarg); break;
+    case 'n': o.priority = false; break;
+    case 'q': o.quiet = true; break;
+    case 'g': o.gateUs = strtoul(optarg, NULL, 10); break;
+    default:
+      fprintf(stderr,
+        "usage: t400timing [-i S] [-t S] [-d MS] [-f MS] [-w MS] [-p MS] [-n] [-q] [-g US]\n");
+      return 2;
+    }
+  }
+  return run(o);
+}